@@ -33,6 +33,25 @@
 
 #include "jo_mpeg.h"
 
+// Color conversion and DCT kernels for SSE2 and AVX2 are picked at runtime,
+// define JO_MPEG_NO_SIMD to build only the plain C ones.
+#if !defined(JO_MPEG_NO_SIMD) && (defined(__i386__) || defined(__x86_64__) || defined(_M_IX86) || defined(_M_X64))
+	#define JO_MPEG_SIMD 1
+	#ifdef _MSC_VER
+		#include <intrin.h>
+	#endif
+	#include <immintrin.h>
+	#if defined(__GNUC__)
+		#define JO_TARGET_SSE2 __attribute__((target("sse2")))
+		#define JO_TARGET_AVX2 __attribute__((target("avx2")))
+	#else
+		#define JO_TARGET_SSE2
+		#define JO_TARGET_AVX2
+	#endif
+#else
+	#define JO_MPEG_SIMD 0
+#endif
+
 // Huffman tables
 static const unsigned char s_jo_HTDC_Y[9][2] = {{4,3}, {0,2}, {1,2}, {5,3}, {6,3}, {14,4}, {30,5}, {62,6}, {126,7}};
 static const unsigned char s_jo_HTDC_C[9][2] = {{0,2}, {1,2}, {2,2}, {6,3}, {14,4}, {30,5}, {62,6}, {126,7}, {254,8}};
@@ -118,17 +137,582 @@ static void jo_DCT(float *d0, float *d1, float *d2, float *d3, float *d4, float
 	*d7 = z11 - z4;
 }
 
-static int jo_processDU(jo_bits_t *bits, float A[64], const unsigned char htdc[9][2], int DC) {
+// Source of one full 16x16 macroblock. Flips are resolved here once so the
+// converters only see a row pointer, a row pitch and a pixel direction.
+typedef struct {
+	const unsigned char *src; // leftmost source pixel of the first output row
+	int pitch;                // bytes to the next output row, negative when flipped vertically
+	int flipx;                // output pixels run right to left in the source
+	int swap;                 // take R from byte 2 and B from byte 0 (callers pass BGR when flipping both ways)
+	int load[4];              // AVX2: byte offset of the 16 byte load for each group of 4 output pixels
+	signed char mask[4][16];  // AVX2: pshufb pattern turning that load into 4 x 0x00BBGGRR in output order
+} jo_src_t;
+
+typedef void (*jo_convert_fn)(const jo_src_t *s, float *Y, float *CB, float *CR);
+typedef void (*jo_fdct_fn)(float A[64], int Q[64]);
+
+static float jo_round(float v) {
+	return v < 0 ? ceilf(v - 0.5f) : floorf(v + 0.5f);
+}
+
+// Forward DCT and quantization, Q is in natural (not zigzag) order
+static void jo_fdct_quant_c(float A[64], int Q[64]) {
 	for(int dataOff=0; dataOff<64; dataOff+=8) {
 		jo_DCT(&A[dataOff], &A[dataOff+1], &A[dataOff+2], &A[dataOff+3], &A[dataOff+4], &A[dataOff+5], &A[dataOff+6], &A[dataOff+7]);
 	}
 	for(int dataOff=0; dataOff<8; ++dataOff) {
 		jo_DCT(&A[dataOff], &A[dataOff+8], &A[dataOff+16], &A[dataOff+24], &A[dataOff+32], &A[dataOff+40], &A[dataOff+48], &A[dataOff+56]);
 	}
-	int Q[64];
 	for(int i=0; i<64; ++i) {
-		float v = A[i]*s_jo_quantTbl[i];
-		Q[s_jo_ZigZag[i]] = (int)(v < 0 ? ceilf(v - 0.5f) : floorf(v + 0.5f));
+		Q[i] = (int)jo_round(A[i]*s_jo_quantTbl[i]);
+	}
+}
+
+// Downsample Cb,Cr (420 format)
+static void jo_downsample_c(const float *CBx, const float *CRx, float *CB, float *CR) {
+	for (int i=0; i<64; ++i) {
+		int j =(i&7)*2 + (i&56)*4;
+		CB[i] = (CBx[j] + CBx[j+1] + CBx[j+16] + CBx[j+17]) * 0.25f;
+		CR[i] = (CRx[j] + CRx[j+1] + CRx[j+16] + CRx[j+17]) * 0.25f;
+	}
+}
+
+static void jo_rgb_to_ycc(float r, float g, float b, float *Y, float *CB, float *CR) {
+	*Y = (0.299f*r + 0.587f*g + 0.114f*b) * (219.f/255) + 16;
+	*CB = (-0.299f*r - 0.587f*g + 0.886f*b) * (224.f/255) + 128;
+	*CR = (0.701f*r - 0.587f*g - 0.114f*b) * (224.f/255) + 128;
+}
+
+static void jo_convert_rgb_c(const jo_src_t *s, int bpp, float *Y, float *CB, float *CR) {
+	float CBx[256], CRx[256];
+	int step = s->flipx ? -bpp : bpp;
+	int ri = s->swap ? 2 : 0, bi = 2 - ri;
+
+	for (int row=0; row<16; ++row) {
+		const unsigned char *c = s->src + row*s->pitch + (s->flipx ? 15*bpp : 0);
+		for (int i=row*16; i<row*16+16; ++i, c+=step) {
+			jo_rgb_to_ycc(c[ri], c[1], c[bi], &Y[i], &CBx[i], &CRx[i]);
+		}
+	}
+	jo_downsample_c(CBx, CRx, CB, CR);
+}
+
+static void jo_convert_rgbx_c(const jo_src_t *s, float *Y, float *CB, float *CR) {
+	jo_convert_rgb_c(s, 4, Y, CB, CR);
+}
+
+static void jo_convert_rgb24_c(const jo_src_t *s, float *Y, float *CB, float *CR) {
+	jo_convert_rgb_c(s, 3, Y, CB, CR);
+}
+
+// YUYV carries one Cb,Cr per pixel pair already, average two rows for 420
+static void jo_convert_yuyv_c(const jo_src_t *s, float *Y, float *CB, float *CR) {
+	for (int row=0; row<16; ++row) {
+		const unsigned char *c = s->src + row*s->pitch;
+		for (int p=0; p<8; ++p) {
+			const unsigned char *pair = c + (s->flipx ? 7-p : p)*4;
+			float *cb = &CB[(row>>1)*8+p], *cr = &CR[(row>>1)*8+p];
+			Y[row*16+p*2]   = pair[s->flipx ? 2 : 0];
+			Y[row*16+p*2+1] = pair[s->flipx ? 0 : 2];
+			if (row & 1) {
+				*cb = (*cb + pair[1]) * 0.5f;
+				*cr = (*cr + pair[3]) * 0.5f;
+			} else {
+				*cb = pair[1];
+				*cr = pair[3];
+			}
+		}
+	}
+}
+
+// Macroblocks hanging over the right or bottom edge, replicates the last column/row
+static void jo_convert_edge(const unsigned char *raw, int width, int height, int format, int flipx, int flipy, int hblock, int vblock, float *Y, float *CB, float *CR) {
+	float CBx[256], CRx[256];
+	int bpp = format == JO_RGBX ? 4 : format == JO_RGB24 ? 3 : 2;
+
+	for (int i=0; i<256; ++i) {
+		int y = vblock*16+(i/16);
+		int x = hblock*16+(i&15);
+		x = x >= width ? width-1 : x;
+		y = y >= height ? height-1 : y;
+		if (flipx) x = width - 1 - x;
+		if (flipy) y = height - 1 - y;
+		const unsigned char *row = raw + y*width*bpp;
+		if (format == JO_YUYV) {
+			int p = x & ~1;
+			if (p + 1 >= width && p >= 2) p -= 2; // odd width, last pixel has no pair
+			Y[i] = row[x*2];
+			CBx[i] = row[p*2+1];
+			CRx[i] = row[p*2+3];
+		} else {
+			const unsigned char *c = row + x*bpp;
+			if (flipx && flipy) {
+				jo_rgb_to_ycc(c[2], c[1], c[0], &Y[i], &CBx[i], &CRx[i]);
+			} else {
+				jo_rgb_to_ycc(c[0], c[1], c[2], &Y[i], &CBx[i], &CRx[i]);
+			}
+		}
+	}
+	jo_downsample_c(CBx, CRx, CB, CR);
+}
+
+#if JO_MPEG_SIMD
+// Kernels below produce the same results as the C ones above: same operations
+// in the same order, no FMA, so the encoded stream doesn't depend on the CPU.
+
+// Butterflies of jo_DCT over 8 vectors, i.e. one 1D DCT per lane
+#define JO_DCT_VEC(T, ADD, SUB, MUL, SET1, d) do { \
+	T tmp0 = ADD(d[0], d[7]), tmp7 = SUB(d[0], d[7]); \
+	T tmp1 = ADD(d[1], d[6]), tmp6 = SUB(d[1], d[6]); \
+	T tmp2 = ADD(d[2], d[5]), tmp5 = SUB(d[2], d[5]); \
+	T tmp3 = ADD(d[3], d[4]), tmp4 = SUB(d[3], d[4]); \
+	T tmp10 = ADD(tmp0, tmp3), tmp13 = SUB(tmp0, tmp3); \
+	T tmp11 = ADD(tmp1, tmp2), tmp12 = SUB(tmp1, tmp2); \
+	d[0] = ADD(tmp10, tmp11); \
+	d[4] = SUB(tmp10, tmp11); \
+	T z1 = MUL(ADD(tmp12, tmp13), SET1(0.707106781f)); \
+	d[2] = ADD(tmp13, z1); \
+	d[6] = SUB(tmp13, z1); \
+	tmp10 = ADD(tmp4, tmp5); \
+	tmp11 = ADD(tmp5, tmp6); \
+	tmp12 = ADD(tmp6, tmp7); \
+	T z5 = MUL(SUB(tmp10, tmp12), SET1(0.382683433f)); \
+	T z2 = ADD(MUL(tmp10, SET1(0.541196100f)), z5); \
+	T z4 = ADD(MUL(tmp12, SET1(1.306562965f)), z5); \
+	T z3 = MUL(tmp11, SET1(0.707106781f)); \
+	T z11 = ADD(tmp7, z3), z13 = SUB(tmp7, z3); \
+	d[5] = ADD(z13, z2); \
+	d[3] = SUB(z13, z2); \
+	d[1] = ADD(z11, z4); \
+	d[7] = SUB(z11, z4); \
+} while (0)
+
+// 8x8 transpose of lo (columns 0-3) and hi (columns 4-7) halves of 8 rows
+JO_TARGET_SSE2 static void jo_transpose8_sse2(__m128 lo[8], __m128 hi[8]) {
+	__m128 tl0 = lo[0], tl1 = lo[1], tl2 = lo[2], tl3 = lo[3];
+	__m128 tr0 = hi[0], tr1 = hi[1], tr2 = hi[2], tr3 = hi[3];
+	__m128 bl0 = lo[4], bl1 = lo[5], bl2 = lo[6], bl3 = lo[7];
+	__m128 br0 = hi[4], br1 = hi[5], br2 = hi[6], br3 = hi[7];
+	_MM_TRANSPOSE4_PS(tl0, tl1, tl2, tl3);
+	_MM_TRANSPOSE4_PS(tr0, tr1, tr2, tr3);
+	_MM_TRANSPOSE4_PS(bl0, bl1, bl2, bl3);
+	_MM_TRANSPOSE4_PS(br0, br1, br2, br3);
+	lo[0] = tl0; lo[1] = tl1; lo[2] = tl2; lo[3] = tl3;
+	lo[4] = tr0; lo[5] = tr1; lo[6] = tr2; lo[7] = tr3;
+	hi[0] = bl0; hi[1] = bl1; hi[2] = bl2; hi[3] = bl3;
+	hi[4] = br0; hi[5] = br1; hi[6] = br2; hi[7] = br3;
+}
+
+JO_TARGET_SSE2 static __m128i jo_quant_sse2(__m128 v, const float *q) {
+	// round half away from zero: truncate v +/- 0.5
+	v = _mm_mul_ps(v, _mm_loadu_ps(q));
+	__m128 half = _mm_or_ps(_mm_and_ps(v, _mm_set1_ps(-0.f)), _mm_set1_ps(0.5f));
+	return _mm_cvttps_epi32(_mm_add_ps(v, half));
+}
+
+JO_TARGET_SSE2 static void jo_fdct_quant_sse2(float A[64], int Q[64]) {
+	__m128 lo[8], hi[8];
+	for (int i=0; i<8; ++i) {
+		lo[i] = _mm_loadu_ps(A+i*8);
+		hi[i] = _mm_loadu_ps(A+i*8+4);
+	}
+	// rows: transpose so each vector holds one column, then DCT across vectors
+	jo_transpose8_sse2(lo, hi);
+	JO_DCT_VEC(__m128, _mm_add_ps, _mm_sub_ps, _mm_mul_ps, _mm_set1_ps, lo);
+	JO_DCT_VEC(__m128, _mm_add_ps, _mm_sub_ps, _mm_mul_ps, _mm_set1_ps, hi);
+	// columns
+	jo_transpose8_sse2(lo, hi);
+	JO_DCT_VEC(__m128, _mm_add_ps, _mm_sub_ps, _mm_mul_ps, _mm_set1_ps, lo);
+	JO_DCT_VEC(__m128, _mm_add_ps, _mm_sub_ps, _mm_mul_ps, _mm_set1_ps, hi);
+	for (int i=0; i<8; ++i) {
+		_mm_storeu_si128((__m128i *)(Q+i*8), jo_quant_sse2(lo[i], s_jo_quantTbl+i*8));
+		_mm_storeu_si128((__m128i *)(Q+i*8+4), jo_quant_sse2(hi[i], s_jo_quantTbl+i*8+4));
+	}
+}
+
+JO_TARGET_SSE2 static void jo_downsample_sse2(const float *CBx, const float *CRx, float *CB, float *CR) {
+	for (int k=0; k<2; ++k) {
+		const float *src = k ? CRx : CBx;
+		float *dst = k ? CR : CB;
+		for (int i=0; i<16; ++i) {
+			const float *a = src + (i>>1)*32 + (i&1)*8;
+			__m128 t0 = _mm_loadu_ps(a), t1 = _mm_loadu_ps(a+4);
+			__m128 b0 = _mm_loadu_ps(a+16), b1 = _mm_loadu_ps(a+20);
+			__m128 v = _mm_add_ps(_mm_shuffle_ps(t0, t1, _MM_SHUFFLE(2,0,2,0)), _mm_shuffle_ps(t0, t1, _MM_SHUFFLE(3,1,3,1)));
+			v = _mm_add_ps(v, _mm_shuffle_ps(b0, b1, _MM_SHUFFLE(2,0,2,0)));
+			v = _mm_add_ps(v, _mm_shuffle_ps(b0, b1, _MM_SHUFFLE(3,1,3,1)));
+			_mm_storeu_ps(dst + i*4, _mm_mul_ps(v, _mm_set1_ps(0.25f)));
+		}
+	}
+}
+
+// 4 pixels as 0x??BBGGRR (0x??RRGGBB if swap) lanes in output order
+JO_TARGET_SSE2 static void jo_rgb_to_ycc_sse2(__m128i px, int swap, float *Y, float *CB, float *CR) {
+	__m128i m = _mm_set1_epi32(0xff);
+	__m128 r = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(px, swap ? 16 : 0), m));
+	__m128 g = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(px, 8), m));
+	__m128 b = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(px, swap ? 0 : 16), m));
+	__m128 v;
+
+	v = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(0.299f), r), _mm_mul_ps(_mm_set1_ps(0.587f), g)), _mm_mul_ps(_mm_set1_ps(0.114f), b));
+	_mm_storeu_ps(Y, _mm_add_ps(_mm_mul_ps(v, _mm_set1_ps(219.f/255)), _mm_set1_ps(16)));
+	v = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(_mm_set1_ps(-0.299f), r), _mm_mul_ps(_mm_set1_ps(0.587f), g)), _mm_mul_ps(_mm_set1_ps(0.886f), b));
+	_mm_storeu_ps(CB, _mm_add_ps(_mm_mul_ps(v, _mm_set1_ps(224.f/255)), _mm_set1_ps(128)));
+	v = _mm_sub_ps(_mm_sub_ps(_mm_mul_ps(_mm_set1_ps(0.701f), r), _mm_mul_ps(_mm_set1_ps(0.587f), g)), _mm_mul_ps(_mm_set1_ps(0.114f), b));
+	_mm_storeu_ps(CR, _mm_add_ps(_mm_mul_ps(v, _mm_set1_ps(224.f/255)), _mm_set1_ps(128)));
+}
+
+JO_TARGET_SSE2 static void jo_convert_rgbx_sse2(const jo_src_t *s, float *Y, float *CB, float *CR) {
+	float CBx[256], CRx[256];
+	for (int row=0; row<16; ++row) {
+		const unsigned char *c = s->src + row*s->pitch;
+		for (int q=0; q<4; ++q) {
+			__m128i px;
+			if (s->flipx) {
+				px = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(c + (3-q)*16)), _MM_SHUFFLE(0,1,2,3));
+			} else {
+				px = _mm_loadu_si128((const __m128i *)(c + q*16));
+			}
+			jo_rgb_to_ycc_sse2(px, s->swap, Y+row*16+q*4, CBx+row*16+q*4, CRx+row*16+q*4);
+		}
+	}
+	jo_downsample_sse2(CBx, CRx, CB, CR);
+}
+
+JO_TARGET_SSE2 static void jo_convert_rgb24_sse2(const jo_src_t *s, float *Y, float *CB, float *CR) {
+	float CBx[256], CRx[256];
+	int step = s->flipx ? -3 : 3;
+	for (int row=0; row<16; ++row) {
+		const unsigned char *c = s->src + row*s->pitch + (s->flipx ? 15*3 : 0);
+		for (int q=0; q<4; ++q, c+=step*4) {
+			// no byte shuffles in SSE2, widen 3 byte pixels to lanes with scalar loads
+			const unsigned char *p0 = c, *p1 = c+step, *p2 = c+step*2, *p3 = c+step*3;
+			__m128i px = _mm_setr_epi32(p0[0] | p0[1] << 8 | p0[2] << 16, p1[0] | p1[1] << 8 | p1[2] << 16,
+				p2[0] | p2[1] << 8 | p2[2] << 16, p3[0] | p3[1] << 8 | p3[2] << 16);
+			jo_rgb_to_ycc_sse2(px, s->swap, Y+row*16+q*4, CBx+row*16+q*4, CRx+row*16+q*4);
+		}
+	}
+	jo_downsample_sse2(CBx, CRx, CB, CR);
+}
+
+// One 32 bit lane per pixel pair: Y0 U Y1 V
+JO_TARGET_SSE2 static void jo_convert_yuyv_sse2(const jo_src_t *s, float *Y, float *CB, float *CR) {
+	__m128i m = _mm_set1_epi32(0xff);
+	for (int row=0; row<16; ++row) {
+		const unsigned char *c = s->src + row*s->pitch;
+		__m128i p[2];
+		if (s->flipx) {
+			p[0] = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(c + 16)), _MM_SHUFFLE(0,1,2,3));
+			p[1] = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)c), _MM_SHUFFLE(0,1,2,3));
+		} else {
+			p[0] = _mm_loadu_si128((const __m128i *)c);
+			p[1] = _mm_loadu_si128((const __m128i *)(c + 16));
+		}
+		for (int h=0; h<2; ++h) {
+			__m128i y0 = _mm_and_si128(p[h], m);
+			__m128i y1 = _mm_and_si128(_mm_srli_epi32(p[h], 16), m);
+			__m128 u = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(p[h], 8), m));
+			__m128 v = _mm_cvtepi32_ps(_mm_srli_epi32(p[h], 24));
+			float *cb = CB + (row>>1)*8 + h*4, *cr = CR + (row>>1)*8 + h*4;
+			if (s->flipx) {
+				__m128i t = y0; y0 = y1; y1 = t;
+			}
+			_mm_storeu_ps(Y+row*16+h*8, _mm_cvtepi32_ps(_mm_unpacklo_epi32(y0, y1)));
+			_mm_storeu_ps(Y+row*16+h*8+4, _mm_cvtepi32_ps(_mm_unpackhi_epi32(y0, y1)));
+			if (row & 1) {
+				u = _mm_mul_ps(_mm_add_ps(_mm_loadu_ps(cb), u), _mm_set1_ps(0.5f));
+				v = _mm_mul_ps(_mm_add_ps(_mm_loadu_ps(cr), v), _mm_set1_ps(0.5f));
+			}
+			_mm_storeu_ps(cb, u);
+			_mm_storeu_ps(cr, v);
+		}
+	}
+}
+
+JO_TARGET_AVX2 static void jo_fdct_quant_avx2(float A[64], int Q[64]) {
+	__m256 r[8];
+	for (int i=0; i<8; ++i) {
+		r[i] = _mm256_loadu_ps(A+i*8);
+	}
+	for (int pass=0; pass<2; ++pass) {
+		// transpose, rows first, then columns
+		__m256 t0 = _mm256_unpacklo_ps(r[0], r[1]), t1 = _mm256_unpackhi_ps(r[0], r[1]);
+		__m256 t2 = _mm256_unpacklo_ps(r[2], r[3]), t3 = _mm256_unpackhi_ps(r[2], r[3]);
+		__m256 t4 = _mm256_unpacklo_ps(r[4], r[5]), t5 = _mm256_unpackhi_ps(r[4], r[5]);
+		__m256 t6 = _mm256_unpacklo_ps(r[6], r[7]), t7 = _mm256_unpackhi_ps(r[6], r[7]);
+		__m256 s0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1,0,1,0)), s1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3,2,3,2));
+		__m256 s2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1,0,1,0)), s3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3,2,3,2));
+		__m256 s4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1,0,1,0)), s5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3,2,3,2));
+		__m256 s6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1,0,1,0)), s7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3,2,3,2));
+		r[0] = _mm256_permute2f128_ps(s0, s4, 0x20);
+		r[1] = _mm256_permute2f128_ps(s1, s5, 0x20);
+		r[2] = _mm256_permute2f128_ps(s2, s6, 0x20);
+		r[3] = _mm256_permute2f128_ps(s3, s7, 0x20);
+		r[4] = _mm256_permute2f128_ps(s0, s4, 0x31);
+		r[5] = _mm256_permute2f128_ps(s1, s5, 0x31);
+		r[6] = _mm256_permute2f128_ps(s2, s6, 0x31);
+		r[7] = _mm256_permute2f128_ps(s3, s7, 0x31);
+		JO_DCT_VEC(__m256, _mm256_add_ps, _mm256_sub_ps, _mm256_mul_ps, _mm256_set1_ps, r);
+	}
+	for (int i=0; i<8; ++i) {
+		__m256 v = _mm256_mul_ps(r[i], _mm256_loadu_ps(s_jo_quantTbl+i*8));
+		__m256 half = _mm256_or_ps(_mm256_and_ps(v, _mm256_set1_ps(-0.f)), _mm256_set1_ps(0.5f));
+		_mm256_storeu_si256((__m256i *)(Q+i*8), _mm256_cvttps_epi32(_mm256_add_ps(v, half)));
+	}
+}
+
+// Flips and R/B swap live in the per frame pshufb masks, see jo_init_src()
+JO_TARGET_AVX2 static void jo_convert_rgb_avx2(const jo_src_t *s, float *Y, float *CB, float *CR) {
+	float CBx[256], CRx[256];
+	__m256i m = _mm256_set1_epi32(0xff);
+	__m128i mask[4];
+	for (int q=0; q<4; ++q) {
+		mask[q] = _mm_loadu_si128((const __m128i *)s->mask[q]);
+	}
+	for (int row=0; row<16; ++row) {
+		const unsigned char *c = s->src + row*s->pitch;
+		for (int h=0; h<2; ++h) {
+			__m128i a = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(c + s->load[h*2])), mask[h*2]);
+			__m128i b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(c + s->load[h*2+1])), mask[h*2+1]);
+			__m256i px = _mm256_inserti128_si256(_mm256_castsi128_si256(a), b, 1);
+			__m256 R = _mm256_cvtepi32_ps(_mm256_and_si256(px, m));
+			__m256 G = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(px, 8), m));
+			__m256 B = _mm256_cvtepi32_ps(_mm256_srli_epi32(px, 16));
+			int i = row*16 + h*8;
+			__m256 v;
+
+			v = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(0.299f), R), _mm256_mul_ps(_mm256_set1_ps(0.587f), G)), _mm256_mul_ps(_mm256_set1_ps(0.114f), B));
+			_mm256_storeu_ps(Y+i, _mm256_add_ps(_mm256_mul_ps(v, _mm256_set1_ps(219.f/255)), _mm256_set1_ps(16)));
+			v = _mm256_add_ps(_mm256_sub_ps(_mm256_mul_ps(_mm256_set1_ps(-0.299f), R), _mm256_mul_ps(_mm256_set1_ps(0.587f), G)), _mm256_mul_ps(_mm256_set1_ps(0.886f), B));
+			_mm256_storeu_ps(CBx+i, _mm256_add_ps(_mm256_mul_ps(v, _mm256_set1_ps(224.f/255)), _mm256_set1_ps(128)));
+			v = _mm256_sub_ps(_mm256_sub_ps(_mm256_mul_ps(_mm256_set1_ps(0.701f), R), _mm256_mul_ps(_mm256_set1_ps(0.587f), G)), _mm256_mul_ps(_mm256_set1_ps(0.114f), B));
+			_mm256_storeu_ps(CRx+i, _mm256_add_ps(_mm256_mul_ps(v, _mm256_set1_ps(224.f/255)), _mm256_set1_ps(128)));
+		}
+	}
+	jo_downsample_sse2(CBx, CRx, CB, CR);
+}
+
+JO_TARGET_AVX2 static void jo_convert_yuyv_avx2(const jo_src_t *s, float *Y, float *CB, float *CR) {
+	__m256i m = _mm256_set1_epi32(0xff);
+	__m256i rev = _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+	for (int row=0; row<16; ++row) {
+		__m256i p = _mm256_loadu_si256((const __m256i *)(s->src + row*s->pitch));
+		if (s->flipx) p = _mm256_permutevar8x32_epi32(p, rev);
+		__m256i y0 = _mm256_and_si256(p, m);
+		__m256i y1 = _mm256_and_si256(_mm256_srli_epi32(p, 16), m);
+		__m256 u = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(p, 8), m));
+		__m256 v = _mm256_cvtepi32_ps(_mm256_srli_epi32(p, 24));
+		float *cb = CB + (row>>1)*8, *cr = CR + (row>>1)*8;
+		if (s->flipx) {
+			__m256i t = y0; y0 = y1; y1 = t;
+		}
+		__m256i lo = _mm256_unpacklo_epi32(y0, y1), hi = _mm256_unpackhi_epi32(y0, y1);
+		_mm256_storeu_ps(Y+row*16, _mm256_cvtepi32_ps(_mm256_permute2x128_si256(lo, hi, 0x20)));
+		_mm256_storeu_ps(Y+row*16+8, _mm256_cvtepi32_ps(_mm256_permute2x128_si256(lo, hi, 0x31)));
+		if (row & 1) {
+			u = _mm256_mul_ps(_mm256_add_ps(_mm256_loadu_ps(cb), u), _mm256_set1_ps(0.5f));
+			v = _mm256_mul_ps(_mm256_add_ps(_mm256_loadu_ps(cr), v), _mm256_set1_ps(0.5f));
+		}
+		_mm256_storeu_ps(cb, u);
+		_mm256_storeu_ps(cr, v);
+	}
+}
+
+#if defined(_MSC_VER)
+static int jo_cpu_level(void) {
+	int r[4];
+	__cpuid(r, 0);
+	int max = r[0];
+	__cpuid(r, 1);
+	if (!((r[3] >> 26) & 1)) return 0;
+	// AVX2 also needs the OS to save ymm state
+	if (max < 7 || !((r[2] >> 27) & 1) || !((r[2] >> 28) & 1) || (_xgetbv(0) & 6) != 6) return 1;
+	__cpuidex(r, 7, 0);
+	return (r[1] >> 5) & 1 ? 2 : 1;
+}
+#else
+static int jo_cpu_level(void) {
+	__builtin_cpu_init();
+	if (!__builtin_cpu_supports("sse2")) return 0;
+	return __builtin_cpu_supports("avx2") ? 2 : 1;
+}
+#endif
+#endif // JO_MPEG_SIMD
+
+static jo_convert_fn s_jo_convert[3] = { jo_convert_rgbx_c, jo_convert_rgb24_c, jo_convert_yuyv_c };
+static jo_fdct_fn s_jo_fdct = jo_fdct_quant_c;
+
+// Picks kernels once, racing callers store the same pointers
+static void jo_init_simd(void) {
+#if JO_MPEG_SIMD
+	static volatile int s_jo_simd_init;
+	if (s_jo_simd_init) return;
+	int level = jo_cpu_level();
+	if (level >= 1) {
+		s_jo_convert[JO_RGBX] = jo_convert_rgbx_sse2;
+		s_jo_convert[JO_RGB24] = jo_convert_rgb24_sse2;
+		s_jo_convert[JO_YUYV] = jo_convert_yuyv_sse2;
+		s_jo_fdct = jo_fdct_quant_sse2;
+	}
+	if (level >= 2) {
+		s_jo_convert[JO_RGBX] = jo_convert_rgb_avx2;
+		s_jo_convert[JO_RGB24] = jo_convert_rgb_avx2;
+		s_jo_convert[JO_YUYV] = jo_convert_yuyv_avx2;
+		s_jo_fdct = jo_fdct_quant_avx2;
+	}
+	s_jo_simd_init = 1;
+#endif
+}
+
+// Per frame part of jo_src_t
+static void jo_init_src(jo_src_t *s, int bpp, int flipx, int swap) {
+	s->flipx = flipx;
+	s->swap = swap;
+	for (int q=0; q<4; ++q) {
+		// source pixels of output pixels q*4..q*4+3
+		int first = flipx ? 12-q*4 : q*4;
+		int load = first*bpp;
+		if (load > 16*bpp-16) load = 16*bpp-16; // don't read past the macroblock
+		s->load[q] = load;
+		for (int k=0; k<4; ++k) {
+			int px = flipx ? 15-(q*4+k) : q*4+k;
+			for (int ch=0; ch<3; ++ch) {
+				s->mask[q][k*4+ch] = (signed char)(px*bpp + (swap ? 2-ch : ch) - load);
+			}
+			s->mask[q][k*4+3] = -1;
+		}
+	}
+}
+
+// Scaling from a crop of the source to the output size. Works on one 16x16
+// output macroblock at a time and writes it to a small tile in the source
+// format, which then goes through the same converters as unscaled input.
+typedef struct {
+	const unsigned char *raw;
+	int stride, bpp, format;
+	int crop_x, crop_y, crop_w, crop_h; // part of the source scaled to the output
+	int width, height;                  // output
+	int flipx, flipy;
+	int box;                            // integer factor for a box filter, 0 for bilinear
+} jo_scale_t;
+
+#define JO_MAX_BOX 4
+
+static void jo_init_scale(jo_scale_t *sc, const unsigned char *raw, int src_width, int src_height, int src_stride, int width, int height, int format, int flipx, int flipy) {
+	sc->raw = raw;
+	sc->bpp = format == JO_RGBX ? 4 : format == JO_RGB24 ? 3 : 2;
+	sc->stride = src_stride ? src_stride : src_width*sc->bpp;
+	sc->format = format;
+	sc->width = width;
+	sc->height = height;
+	sc->flipx = flipx;
+	sc->flipy = flipy;
+
+	// center crop to the output aspect ratio
+	sc->crop_w = src_width;
+	sc->crop_h = src_height;
+	if ((long long)src_width*height > (long long)src_height*width)
+		sc->crop_w = (int)((long long)src_height*width/height);
+	else
+		sc->crop_h = (int)((long long)src_width*height/width);
+	if (format == JO_YUYV) sc->crop_w &= ~1;
+	sc->crop_x = ((src_width - sc->crop_w)/2) & ~1;
+	sc->crop_y = (src_height - sc->crop_h)/2;
+
+	sc->box = 0;
+	for (int f=1; f<=JO_MAX_BOX; ++f) {
+		if (sc->crop_w == width*f && sc->crop_h == height*f) sc->box = f;
+	}
+}
+
+// Byte offsets of the 3 channels of source pixel x, YUYV shares Cb,Cr within a pair
+static void jo_channel_offsets(const jo_scale_t *sc, int x, int off[3]) {
+	if (sc->format == JO_YUYV) {
+		off[0] = x*2;
+		off[1] = (x & ~1)*2 + 1;
+		off[2] = (x & ~1)*2 + 3;
+	} else {
+		off[0] = x*sc->bpp;
+		off[1] = x*sc->bpp + 1;
+		off[2] = x*sc->bpp + 2;
+	}
+}
+
+// 16.16 fixed point bilinear source position of output coordinate o, clamped to [first, first+size-1]
+static void jo_bilinear_pos(int o, int out_size, int first, int size, int *p0, int *p1, int *w) {
+	long long pos = ((2LL*o + 1)*size << 16)/(2*out_size) - (1 << 15);
+	if (pos < 0) pos = 0;
+	int i = (int)(pos >> 16);
+	*w = (int)(pos >> 8) & 255;
+	if (i >= size - 1) {
+		i = size - 1;
+		*w = 0;
+	}
+	*p0 = first + i;
+	*p1 = first + (i + 1 < size ? i + 1 : i);
+}
+
+static void jo_scale_tile(const jo_scale_t *sc, int hblock, int vblock, unsigned char *tile) {
+	int taps = sc->box ? sc->box : 2;
+	int xoff[16][JO_MAX_BOX][3], xw[16];
+	const unsigned char *rows[16][JO_MAX_BOX];
+	int yw[16];
+
+	for (int t=0; t<16; ++t) {
+		int ox = hblock*16+t, oy = vblock*16+t;
+		ox = ox >= sc->width ? sc->width-1 : ox;
+		oy = oy >= sc->height ? sc->height-1 : oy;
+		if (sc->flipx) ox = sc->width - 1 - ox;
+		if (sc->flipy) oy = sc->height - 1 - oy;
+		if (sc->box) {
+			for (int k=0; k<taps; ++k) {
+				jo_channel_offsets(sc, sc->crop_x + ox*taps + k, xoff[t][k]);
+				rows[t][k] = sc->raw + (sc->crop_y + oy*taps + k)*sc->stride;
+			}
+		} else {
+			int x0, x1, y0, y1;
+			jo_bilinear_pos(ox, sc->width, sc->crop_x, sc->crop_w, &x0, &x1, &xw[t]);
+			jo_bilinear_pos(oy, sc->height, sc->crop_y, sc->crop_h, &y0, &y1, &yw[t]);
+			jo_channel_offsets(sc, x0, xoff[t][0]);
+			jo_channel_offsets(sc, x1, xoff[t][1]);
+			rows[t][0] = sc->raw + y0*sc->stride;
+			rows[t][1] = sc->raw + y1*sc->stride;
+		}
+	}
+
+	for (int ty=0; ty<16; ++ty) {
+		for (int tx=0; tx<16; ++tx) {
+			unsigned char *d = tile + (ty*16+tx)*sc->bpp;
+			for (int c=0; c<3; ++c) {
+				int v;
+				if (sc->box) {
+					int sum = 0;
+					for (int ky=0; ky<taps; ++ky)
+						for (int kx=0; kx<taps; ++kx)
+							sum += rows[ty][ky][xoff[tx][kx][c]];
+					v = (sum + taps*taps/2) / (taps*taps);
+				} else {
+					int a = rows[ty][0][xoff[tx][0][c]]*(256-xw[tx]) + rows[ty][0][xoff[tx][1][c]]*xw[tx];
+					int b = rows[ty][1][xoff[tx][0][c]]*(256-xw[tx]) + rows[ty][1][xoff[tx][1][c]]*xw[tx];
+					v = (a*(256-yw[ty]) + b*yw[ty] + (1 << 15)) >> 16;
+				}
+				if (sc->format != JO_YUYV) {
+					d[c] = (unsigned char)v;
+				} else if (c == 0) {
+					d[0] = (unsigned char)v;
+				} else if (!(tx & 1)) {
+					d[c == 1 ? 1 : 3] = (unsigned char)v; // pair chroma from its first pixel
+				}
+			}
+		}
+	}
+}
+
+static int jo_processDU(jo_bits_t *bits, float A[64], const unsigned char htdc[9][2], int DC) {
+	int Qn[64], Q[64];
+	s_jo_fdct(A, Qn);
+	for(int i=0; i<64; ++i) {
+		Q[s_jo_ZigZag[i]] = Qn[i];
 	}
 
 	DC = Q[0] - DC;
@@ -177,120 +761,162 @@ static int jo_processDU(jo_bits_t *bits, float A[64], const unsigned char htdc[9
 	return Q[0];
 }
 
-unsigned long jo_write_mpeg(unsigned char *mpeg_buf, const unsigned char *raw, int width, int height, int format, int flipx, int flipy) {
+// Everything about a frame that stays the same between macroblocks
+typedef struct {
+	const unsigned char *raw;
+	int width, height, format, flipx, flipy;
+	int bpp, stride, packed, scaled;
+	jo_scale_t scale;
+	jo_src_t src;      // straight from raw
+	jo_src_t tile_src; // from a jo_scale_tile() tile, already flipped
+} jo_frame_t;
+
+static void jo_init_frame(jo_frame_t *f, const unsigned char *raw, int src_width, int src_height, int src_stride, int width, int height, int format, int flipx, int flipy) {
+	f->raw = raw;
+	f->width = width;
+	f->height = height;
+	f->format = format;
+	f->flipx = !!flipx;
+	f->flipy = !!flipy;
+	f->bpp = format == JO_RGBX ? 4 : format == JO_RGB24 ? 3 : 2;
+	f->stride = src_stride ? src_stride : src_width*f->bpp;
+	f->packed = f->stride == src_width*f->bpp;
+	f->scaled = src_width != width || src_height != height;
+	int swap = flipx && flipy && format != JO_YUYV;
+
+	jo_init_simd();
+	jo_init_scale(&f->scale, raw, src_width, src_height, src_stride, width, height, format, f->flipx, f->flipy);
+	jo_init_src(&f->src, f->bpp, f->flipx, swap);
+	f->src.pitch = f->flipy ? -f->stride : f->stride;
+	jo_init_src(&f->tile_src, f->bpp, 0, swap);
+	f->tile_src.pitch = 16*f->bpp;
+}
+
+static void jo_load_mb(const jo_frame_t *f, int hblock, int vblock, float Y[256], float CB[64], float CR[64]) {
+	int width = f->width, height = f->height;
+	if (!f->scaled && hblock*16+16 <= width && vblock*16+16 <= height && !(f->format == JO_YUYV && (width & 1))) {
+		jo_src_t src = f->src;
+		int x = f->flipx ? width - 16 - hblock*16 : hblock*16;
+		int y = f->flipy ? height - 1 - vblock*16 : vblock*16;
+		src.src = f->raw + y*f->stride + x*f->bpp;
+		s_jo_convert[f->format](&src, Y, CB, CR);
+	} else if (!f->scaled && f->packed) {
+		jo_convert_edge(f->raw, width, height, f->format, f->flipx, f->flipy, hblock, vblock, Y, CB, CR);
+	} else {
+		// scaled, or padded rows at the edge where the scaler does the clamping at 1:1
+		unsigned char tile[16*16*4];
+		jo_src_t src = f->tile_src;
+		src.src = tile;
+		jo_scale_tile(&f->scale, hblock, vblock, tile);
+		s_jo_convert[f->format](&src, Y, CB, CR);
+	}
+}
+
+static void jo_y_block(const float Y[256], int k1, int k2, float block[64]) {
+	for (int i=0; i<64; i+=8) {
+		int j = (i&7)+(i&56)*2 + k1*8*16 + k2*8;
+		memcpy(block+i, Y+j, 8*sizeof(Y[0]));
+	}
+}
+
+static int jo_dc(float A[64]) {
+	int Q[64];
+	s_jo_fdct(A, Q);
+	return Q[0];
+}
+
+// Macroblock rows first_row..last_row-1. DC prediction runs through the whole
+// frame, so a later part starts from the DCs of the macroblock before it.
+static void jo_encode_rows(jo_bits_t *bits, const jo_frame_t *f, int first_row, int last_row) {
 	int lastDCY = 128, lastDCCR = 128, lastDCCB = 128;
-	unsigned char *head = mpeg_buf;
-	jo_bits_t bits = {mpeg_buf};
+	int hblocks = (f->width+15)/16;
+	float Y[256], CB[64], CR[64];
+
+	if (first_row > 0) {
+		float block[64];
+		jo_load_mb(f, hblocks-1, first_row-1, Y, CB, CR);
+		jo_y_block(Y, 1, 1, block);
+		lastDCY = jo_dc(block);
+		lastDCCB = jo_dc(CB);
+		lastDCCR = jo_dc(CR);
+	}
 
-	for (int vblock = 0; vblock < (height+15)/16; vblock++) {
-		for (int hblock = 0; hblock < (width+15)/16; hblock++) {
+	for (int vblock = first_row; vblock < last_row; vblock++) {
+		for (int hblock = 0; hblock < hblocks; hblock++) {
 			if (vblock == 0 && hblock == 0) {
-				jo_writeBits(&bits, 0b01, 2); // macroblock_type = intra+quant
-				jo_writeBits(&bits, 8, 5); // quantiser_scale_code = 8
+				jo_writeBits(bits, 0b01, 2); // macroblock_type = intra+quant
+				jo_writeBits(bits, 8, 5); // quantiser_scale_code = 8
 			} else {
-				jo_writeBits(&bits, 0b1, 1); // macroblock_address_increment
-				jo_writeBits(&bits, 0b1, 1); // macroblock_type = intra
+				jo_writeBits(bits, 0b1, 1); // macroblock_address_increment
+				jo_writeBits(bits, 0b1, 1); // macroblock_type = intra
 			}
 
-			float Y[256], CBx[256], CRx[256];
-			float CB[64], CR[64];
-
-			if (format == JO_RGBX) {
-				for (int i=0; i<256; ++i) {
-					int y = vblock*16+(i/16);
-					int x = hblock*16+(i&15);
-					x = x >= width ? width-1 : x;
-					y = y >= height ? height-1 : y;
-					if (flipx) x = width - 1 - x;
-					if (flipy) y = height - 1 - y;
-					const unsigned char *c = raw + y*width*4+x*4;
-					float r, g, b;
-					if (flipx && flipy) {
-						r = c[2], g = c[1], b = c[0];
-					} else {
-						r = c[0], g = c[1], b = c[2];
-					}
-					Y[i] = (0.299f*r + 0.587f*g + 0.114f*b) * (219.f/255) + 16;
-					CBx[i] = (-0.299f*r - 0.587f*g + 0.886f*b) * (224.f/255) + 128;
-					CRx[i] = (0.701f*r - 0.587f*g - 0.114f*b) * (224.f/255) + 128;
-				}
-				// Downsample Cb,Cr (420 format)
-				for (int i=0; i<64; ++i) {
-					int j =(i&7)*2 + (i&56)*4;
-					CB[i] = (CBx[j] + CBx[j+1] + CBx[j+16] + CBx[j+17]) * 0.25f;
-					CR[i] = (CRx[j] + CRx[j+1] + CRx[j+16] + CRx[j+17]) * 0.25f;
-				}
-			} else
-			if (format == JO_RGB24) {
-				for (int i=0; i<256; ++i) {
-					int y = vblock*16+(i/16);
-					int x = hblock*16+(i&15);
-					x = x >= width ? width-1 : x;
-					y = y >= height ? height-1 : y;
-					if (flipx) x = width - 1 - x;
-					if (flipy) y = height - 1 - y;
-					const unsigned char *c = raw + y*width*3+x*3;
-					float r, g, b;
-					if (flipx && flipy) {
-						r = c[2], g = c[1], b = c[0];
-					} else {
-						r = c[0], g = c[1], b = c[2];
-					}
-					Y[i] = (0.299f*r + 0.587f*g + 0.114f*b) * (219.f/255) + 16;
-					CBx[i] = (-0.299f*r - 0.587f*g + 0.886f*b) * (224.f/255) + 128;
-					CRx[i] = (0.701f*r - 0.587f*g - 0.114f*b) * (224.f/255) + 128;
-				}
-				// Downsample Cb,Cr (420 format)
-				for (int i=0; i<64; ++i) {
-					int j =(i&7)*2 + (i&56)*4;
-					CB[i] = (CBx[j] + CBx[j+1] + CBx[j+16] + CBx[j+17]) * 0.25f;
-					CR[i] = (CRx[j] + CRx[j+1] + CRx[j+16] + CRx[j+17]) * 0.25f;
-				}
-			} else
-			if (format == JO_YUYV) {
-				for (int i=0; i<256; i+=2) {
-					int y = vblock*16+(i/16);
-					int x = hblock*16+(i&15);
-					x = x >= width ? width-1 : x;
-					y = y >= height ? height-1 : y;
-					if (flipx) x = width - 1 - x;
-					if (flipy) y = height - 1 - y;
-					const unsigned char *c = raw + y*width*2+x*2-2;
-					if (flipx) {
-						Y[i+1]  = c[0];
-						CB[i/4] = c[1];
-						Y[i]    = c[2];
-						CR[i/4] = c[3];
-					} else {
-						Y[i]    = c[2];
-						CB[i/4] = c[3];
-						Y[i+1]  = c[4];
-						CR[i/4] = c[5];
-					}
-				}
-			}
+			jo_load_mb(f, hblock, vblock, Y, CB, CR);
 
 			for (int k1=0; k1<2; ++k1) {
 				for (int k2=0; k2<2; ++k2) {
 					float block[64];
-					for (int i=0; i<64; i+=8) {
-						int j = (i&7)+(i&56)*2 + k1*8*16 + k2*8;
-						memcpy(block+i, Y+j, 8*sizeof(Y[0]));
-					}
-					lastDCY = jo_processDU(&bits, block, s_jo_HTDC_Y, lastDCY);
+					jo_y_block(Y, k1, k2, block);
+					lastDCY = jo_processDU(bits, block, s_jo_HTDC_Y, lastDCY);
 				}
 			}
-			lastDCCB = jo_processDU(&bits, CB, s_jo_HTDC_C, lastDCCB);
-			lastDCCR = jo_processDU(&bits, CR, s_jo_HTDC_C, lastDCCR);
+			lastDCCB = jo_processDU(bits, CB, s_jo_HTDC_C, lastDCCB);
+			lastDCCR = jo_processDU(bits, CR, s_jo_HTDC_C, lastDCCR);
 		}
 	}
-	jo_writeBits(&bits, 0, 7);
+}
+
+static void jo_write_end(jo_bits_t *bits) {
+	jo_writeBits(bits, 0, 7);
 
 	// End of Sequence
-	*(bits.buf_ptr++) = 0x00;
-	*(bits.buf_ptr++) = 0x00;
-	*(bits.buf_ptr++) = 0x01;
-	*(bits.buf_ptr++) = 0xb0;
+	*(bits->buf_ptr++) = 0x00;
+	*(bits->buf_ptr++) = 0x00;
+	*(bits->buf_ptr++) = 0x01;
+	*(bits->buf_ptr++) = 0xb0;
+}
 
-	return bits.buf_ptr - head;
+unsigned long jo_write_mpeg(unsigned char *mpeg_buf, const unsigned char *raw, int width, int height, int format, int flipx, int flipy) {
+	return jo_write_mpeg_scaled(mpeg_buf, raw, width, height, 0, width, height, format, flipx, flipy);
+}
+
+unsigned long jo_write_mpeg_scaled(unsigned char *mpeg_buf, const unsigned char *raw, int src_width, int src_height, int src_stride, int width, int height, int format, int flipx, int flipy) {
+	jo_bits_t bits = {mpeg_buf};
+	jo_frame_t frame;
+	jo_init_frame(&frame, raw, src_width, src_height, src_stride, width, height, format, flipx, flipy);
+	jo_encode_rows(&bits, &frame, 0, (height+15)/16);
+	jo_write_end(&bits);
+	return bits.buf_ptr - mpeg_buf;
+}
+
+void jo_write_mpeg_slice(jo_mpeg_slice_t *slice, const unsigned char *raw, int src_width, int src_height, int src_stride, int width, int height, int format, int flipx, int flipy, int first_row, int last_row) {
+	jo_bits_t bits = {slice->buf};
+	jo_frame_t frame;
+	jo_init_frame(&frame, raw, src_width, src_height, src_stride, width, height, format, flipx, flipy);
+	jo_encode_rows(&bits, &frame, first_row, last_row);
+	slice->bits = (unsigned long)(bits.buf_ptr - slice->buf)*8 + bits.cnt;
+	if (bits.cnt) {
+		*bits.buf_ptr = (bits.buf >> 16) & 255;
+	}
+}
+
+unsigned long jo_join_mpeg_slices(unsigned char *mpeg_buf, const jo_mpeg_slice_t *slices, int count) {
+	jo_bits_t bits = {mpeg_buf};
+	for (int i=0; i<count; ++i) {
+		unsigned long bytes = slices[i].bits/8;
+		int rest = slices[i].bits & 7;
+		if (bits.cnt == 0) {
+			memcpy(bits.buf_ptr, slices[i].buf, bytes);
+			bits.buf_ptr += bytes;
+		} else {
+			for (unsigned long j=0; j<bytes; ++j) {
+				jo_writeBits(&bits, slices[i].buf[j], 8);
+			}
+		}
+		if (rest) {
+			jo_writeBits(&bits, slices[i].buf[bytes] >> (8-rest), rest);
+		}
+	}
+	jo_write_end(&bits);
+	return bits.buf_ptr - mpeg_buf;
 }
@@ -1,3 +1,6 @@
+#ifndef JO_MPEG_H
+#define JO_MPEG_H
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -16,6 +19,24 @@ typedef enum {
 
 unsigned long jo_write_mpeg(unsigned char *mpeg_buf, const unsigned char *rgbx, int width, int height, int format, int flipx, int flipy);
 
+// Encodes a width x height frame from a src_width x src_height image of any size: the center of
+// the source with the output's aspect ratio is box filtered if it's an exact 1-4x multiple of
+// the output size, bilinear scaled otherwise. src_stride is bytes per source row, 0 if packed.
+unsigned long jo_write_mpeg_scaled(unsigned char *mpeg_buf, const unsigned char *raw, int src_width, int src_height, int src_stride, int width, int height, int format, int flipx, int flipy);
+
+// Same frame in parts for encoding on several threads: each slice encodes macroblock rows
+// first_row..last_row-1 into its own buffer, jo_join_mpeg_slices() then stitches all of them
+// in order into one stream that's identical to jo_write_mpeg_scaled()'s.
+typedef struct {
+	unsigned char *buf; // room for the slice's macroblocks
+	unsigned long bits; // encoded length
+} jo_mpeg_slice_t;
+
+void jo_write_mpeg_slice(jo_mpeg_slice_t *slice, const unsigned char *raw, int src_width, int src_height, int src_stride, int width, int height, int format, int flipx, int flipy, int first_row, int last_row);
+unsigned long jo_join_mpeg_slices(unsigned char *mpeg_buf, const jo_mpeg_slice_t *slices, int count);
+
 #ifdef __cplusplus
 }
 #endif
+
+#endif
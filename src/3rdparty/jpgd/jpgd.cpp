@@ -634,6 +634,32 @@ namespace jpgd {
 		m_pMem_blocks = nullptr;
 	}
 
+	// Empties all m_blocks for the next image. Several blocks are merged into one,
+	// so an image of the same size fits again without allocating.
+	void jpeg_decoder::reuse_all_blocks()
+	{
+		if (m_pMem_blocks && m_pMem_blocks->m_pNext)
+		{
+			size_t capacity = 0;
+			for (mem_block* b = m_pMem_blocks; b; b = b->m_pNext)
+				capacity += b->m_size;
+
+			free_all_blocks();
+
+			// on failure alloc() just starts from scratch
+			mem_block* b = (mem_block*)jpgd_malloc(sizeof(mem_block) + capacity);
+			if (b)
+			{
+				b->m_pNext = nullptr;
+				b->m_size = capacity;
+				m_pMem_blocks = b;
+			}
+		}
+
+		for (mem_block* b = m_pMem_blocks; b; b = b->m_pNext)
+			b->m_used_count = 0;
+	}
+
 	// This method handles all errors. It will never return.
 	// It could easily be changed to use C++ exceptions.
 	JPGD_NORETURN void jpeg_decoder::stop_decoding(jpgd_status status)
@@ -1185,7 +1211,7 @@ namespace jpgd {
 	void jpeg_decoder::init(jpeg_decoder_stream* pStream, uint32_t flags)
 	{
 		m_flags = flags;
-		m_pMem_blocks = nullptr;
+		reuse_all_blocks();
 		m_error_code = JPGD_SUCCESS;
 		m_ready_flag = false;
 		m_image_x_size = m_image_y_size = 0;
@@ -3040,11 +3066,31 @@ namespace jpgd {
 
 	jpeg_decoder::jpeg_decoder(jpeg_decoder_stream* pStream, uint32_t flags)
 	{
+		m_pMem_blocks = nullptr;
 		if (::setjmp(m_jmp_state))
 			return;
 		decode_init(pStream, flags);
 	}
 
+	jpeg_decoder::jpeg_decoder()
+	{
+		m_flags = 0;
+		m_pMem_blocks = nullptr;
+		m_pStream = nullptr;
+		m_error_code = JPGD_FAILED;
+		m_ready_flag = false;
+		m_image_x_size = m_image_y_size = 0;
+		m_comps_in_frame = 0;
+	}
+
+	jpgd_status jpeg_decoder::reset(jpeg_decoder_stream* pStream, uint32_t flags)
+	{
+		if (::setjmp(m_jmp_state))
+			return m_error_code;
+		decode_init(pStream, flags);
+		return m_error_code;
+	}
+
 	int jpeg_decoder::begin_decoding()
 	{
 		if (m_ready_flag)
@@ -3167,45 +3213,18 @@ namespace jpgd {
 		return max_bytes_to_read;
 	}
 
-	unsigned char* decompress_jpeg_image_from_stream(jpeg_decoder_stream* pStream, int* width, int* height, int* actual_comps, int req_comps, uint32_t flags)
+	// Converts all scan lines of a started decoder to req_comps and stores them at pImage_data.
+	static bool decode_image(jpeg_decoder& decoder, uint8* pImage_data, int req_comps)
 	{
-		if (!actual_comps)
-			return nullptr;
-		*actual_comps = 0;
-
-		if ((!pStream) || (!width) || (!height) || (!req_comps))
-			return nullptr;
-
-		if ((req_comps != 1) && (req_comps != 3) && (req_comps != 4))
-			return nullptr;
-
-		jpeg_decoder decoder(pStream, flags);
-		if (decoder.get_error_code() != JPGD_SUCCESS)
-			return nullptr;
-
 		const int image_width = decoder.get_width(), image_height = decoder.get_height();
-		*width = image_width;
-		*height = image_height;
-		*actual_comps = decoder.get_num_components();
-
-		if (decoder.begin_decoding() != JPGD_SUCCESS)
-			return nullptr;
-
 		const int dst_bpl = image_width * req_comps;
 
-		uint8* pImage_data = (uint8*)jpgd_malloc(dst_bpl * image_height);
-		if (!pImage_data)
-			return nullptr;
-
 		for (int y = 0; y < image_height; y++)
 		{
 			const uint8* pScan_line;
 			uint scan_line_len;
 			if (decoder.decode((const void**)&pScan_line, &scan_line_len) != JPGD_SUCCESS)
-			{
-				jpgd_free(pImage_data);
-				return nullptr;
-			}
+				return false;
 
 			uint8* pDst = pImage_data + y * dst_bpl;
 
@@ -3263,9 +3282,75 @@ namespace jpgd {
 			}
 		}
 
+		return true;
+	}
+
+	unsigned char* decompress_jpeg_image_from_stream(jpeg_decoder_stream* pStream, int* width, int* height, int* actual_comps, int req_comps, uint32_t flags)
+	{
+		if (!actual_comps)
+			return nullptr;
+		*actual_comps = 0;
+
+		if ((!pStream) || (!width) || (!height) || (!req_comps))
+			return nullptr;
+
+		if ((req_comps != 1) && (req_comps != 3) && (req_comps != 4))
+			return nullptr;
+
+		jpeg_decoder decoder(pStream, flags);
+		if (decoder.get_error_code() != JPGD_SUCCESS)
+			return nullptr;
+
+		const int image_width = decoder.get_width(), image_height = decoder.get_height();
+		*width = image_width;
+		*height = image_height;
+		*actual_comps = decoder.get_num_components();
+
+		if (decoder.begin_decoding() != JPGD_SUCCESS)
+			return nullptr;
+
+		uint8* pImage_data = (uint8*)jpgd_malloc(image_width * req_comps * image_height);
+		if (!pImage_data)
+			return nullptr;
+
+		if (!decode_image(decoder, pImage_data, req_comps))
+		{
+			jpgd_free(pImage_data);
+			return nullptr;
+		}
+
 		return pImage_data;
 	}
 
+	bool decompress_jpeg_image_into(jpeg_decoder* pDecoder, jpeg_decoder_stream* pStream, unsigned char* pDst, int dst_size, int* width, int* height, int* actual_comps, int req_comps, uint32_t flags)
+	{
+		if (!actual_comps)
+			return false;
+		*actual_comps = 0;
+
+		if ((!pDecoder) || (!pStream) || (!pDst) || (!width) || (!height) || (!req_comps))
+			return false;
+
+		if ((req_comps != 1) && (req_comps != 3) && (req_comps != 4))
+			return false;
+
+		if (pDecoder->reset(pStream, flags) != JPGD_SUCCESS)
+			return false;
+
+		const int image_width = pDecoder->get_width(), image_height = pDecoder->get_height();
+		*width = image_width;
+		*height = image_height;
+		*actual_comps = pDecoder->get_num_components();
+
+		if ((int64_t)image_width * image_height * req_comps > dst_size)
+			return false;
+
+		if (pDecoder->begin_decoding() != JPGD_SUCCESS)
+			return false;
+
+		return decode_image(*pDecoder, pDst, req_comps);
+	}
+
 	unsigned char* decompress_jpeg_image_from_memory(const unsigned char* pSrc_data, int src_data_size, int* width, int* height, int* actual_comps, int req_comps, uint32_t flags)
 	{
 		jpgd::jpeg_decoder_mem_stream mem_stream(pSrc_data, src_data_size);
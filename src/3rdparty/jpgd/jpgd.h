@@ -112,6 +112,13 @@ namespace jpgd
 	// Loads JPEG file from a jpeg_decoder_stream.
 	unsigned char* decompress_jpeg_image_from_stream(jpeg_decoder_stream* pStream, int* width, int* height, int* actual_comps, int req_comps, uint32_t flags = 0);
 
+	class jpeg_decoder;
+
+	// Like decompress_jpeg_image_from_stream(), but decodes into the caller's pDst buffer of dst_size bytes with the given decoder,
+	// which keeps its memory from one image to the next. Decoding a stream of same sized images doesn't allocate after the first one.
+	// Returns false on error or if width * height * req_comps doesn't fit into dst_size. width/height are set in either case if the header could be read.
+	bool decompress_jpeg_image_into(jpeg_decoder* pDecoder, jpeg_decoder_stream* pStream, unsigned char* pDst, int dst_size, int* width, int* height, int* actual_comps, int req_comps, uint32_t flags = 0);
+
 	enum
 	{
 		JPGD_IN_BUF_SIZE = 8192, JPGD_MAX_BLOCKS_PER_MCU = 10, JPGD_MAX_HUFF_TABLES = 8, JPGD_MAX_QUANT_TABLES = 4,
@@ -134,8 +141,15 @@ namespace jpgd
 		// methods after the constructor is called. You may then either destruct the object, or begin decoding the image by calling begin_decoding(), then decode() on each scanline.
 		jpeg_decoder(jpeg_decoder_stream* pStream, uint32_t flags = 0);
 
+		// Idle decoder, call reset() to start on an image.
+		jpeg_decoder();
+
 		~jpeg_decoder();
 
+		// Starts over on a new stream like the constructor does, but keeps the memory allocated for the previous image.
+		// Returns get_error_code().
+		jpgd_status reset(jpeg_decoder_stream* pStream, uint32_t flags = 0);
+
 		// Call this method after constructing the object to begin decompression.
 		// If JPGD_SUCCESS is returned you may then call decode() on each scanline.
 
@@ -277,6 +291,7 @@ namespace jpgd
 
 		inline int check_sample_buf_ofs(int ofs) const { assert(ofs >= 0); assert(ofs < m_max_blocks_per_row * 64); return ofs; }
 		void free_all_blocks();
+		void reuse_all_blocks();
 		JPGD_NORETURN void stop_decoding(jpgd_status status);
 		void* alloc(size_t n, bool zero = false);
 		void* alloc_aligned(size_t nSize, uint32_t align = 16, bool zero = false);
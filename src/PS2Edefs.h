@@ -74,6 +74,9 @@
 #define FREEZE_SAVE			1
 #define FREEZE_SIZE			2
 
+// USBnextDeadline: nothing scheduled
+#define USB_NO_DEADLINE		0xFFFFFFFFu
+
 // event values:
 #define KEYPRESS	1
 #define KEYRELEASE	2
@@ -88,6 +91,40 @@ typedef struct _keyEvent {
 	u32 evt;
 } keyEvent;
 
+// USB profiling counters, cheap enough to be always on
+#define USB_STATS_PORTS		2
+#define USB_STATS_ENDPOINTS	16
+
+typedef struct {
+	u64 packets;
+	u64 naks;
+	u64 bytes;
+} USBendpointStats;
+
+typedef struct {
+	u64 ns; // host time spent handling device's packets
+	USBendpointStats in[USB_STATS_ENDPOINTS];
+	USBendpointStats out[USB_STATS_ENDPOINTS]; // and SETUP
+} USBportStats;
+
+typedef struct {
+	u64 cache_hits;   // image blocks served from read cache
+	u64 cache_misses; // blocks guest had to wait for
+	u64 prefetched;   // blocks read ahead in background
+} USBstorageStats;
+
+typedef struct {
+	u64 frames;         // processed by ohci_frame_boundary
+	u64 frame_ns;       // host time spent in them
+	u64 idle_frames;    // skipped without list processing
+	u64 catchup_frames; // coalesced or dropped after host stalls
+	u64 eds;            // endpoint descriptors walked
+	u64 tds;
+	u64 iso_tds;
+	USBportStats port[USB_STATS_PORTS];
+	USBstorageStats msd; // all mass storage devices
+} USBstats;
+
 ///////////////////////////////////////////////////////////////////////
 
 #if defined(GSdefs)   || defined(PADdefs)  || defined(SIOdefs)  || \
@@ -521,6 +558,8 @@ void CALLBACK USBwrite8(u32 addr,  u8 value);
 void CALLBACK USBwrite16(u32 addr, u16 value);
 void CALLBACK USBwrite32(u32 addr, u32 value);
 void CALLBACK USBasync(u32 cycles);
+// cycles until USBasync needs to be called again
+u32  CALLBACK USBnextDeadline();
 
 // cycles = IOP cycles before calling callback,
 // if callback returns 1 the irq is triggered, else not
@@ -531,6 +570,11 @@ void CALLBACK USBsetRAM(void *mem);
 // extended funcs
 
 s32  CALLBACK USBfreeze(int mode, freezeData *data);
+s32  CALLBACK USBfreezeDelta(int mode, freezeData *data);
+
+// copies up to 'size' bytes of stats, returns bytes copied
+s32  CALLBACK USBgetStats(USBstats *stats, u32 size);
+
 void CALLBACK USBconfigure();
 void CALLBACK USBabout();
 s32  CALLBACK USBtest();
@@ -717,6 +761,9 @@ typedef void (CALLBACK* _USBwrite8)(u32 mem, u8 value);
 typedef void (CALLBACK* _USBwrite16)(u32 mem, u16 value);
 typedef void (CALLBACK* _USBwrite32)(u32 mem, u32 value);
 typedef void (CALLBACK* _USBasync)(u32 cycles);
+typedef u32  (CALLBACK* _USBnextDeadline)();
+typedef s32  (CALLBACK* _USBfreezeDelta)(int mode, freezeData *data);
+typedef s32  (CALLBACK* _USBgetStats)(USBstats *stats, u32 size);
 
 typedef void (CALLBACK* _USBirqCallback)(USBcallback callback);
 typedef USBhandler (CALLBACK* _USBirqHandler)(void);
@@ -831,6 +878,9 @@ extern _USBwrite8         USBwrite8;
 extern _USBwrite16        USBwrite16;
 extern _USBwrite32        USBwrite32;
 extern _USBasync          USBasync;
+extern _USBnextDeadline   USBnextDeadline;
+extern _USBfreezeDelta    USBfreezeDelta;
+extern _USBgetStats       USBgetStats;
 
 extern _USBirqCallback    USBirqCallback;
 extern _USBirqHandler     USBirqHandler;
@@ -21,6 +21,9 @@
 #include <string>
 #include <cerrno>
 #include <cassert>
+#include <vector>
+#include <deque>
+#include <algorithm>
 
 #include "version.h" //CMake generated
 #include "USB.h"
@@ -29,6 +32,8 @@
 #include "qemu-usb/USBinternal.h"
 #include "qemu-usb/desc.h"
 #include "shared/shared.h"
+#include "shared/freezestream.h"
+#include "shared/xorrle.h"
 #include "deviceproxy.h"
 
 #define PSXCLK	36864000	/* 36.864 Mhz */
@@ -43,24 +48,8 @@ bool configChanged = false;
 static bool usb_opened = false;
 
 Config conf;
-char USBfreezeID[] = "USBqemuW02";
-typedef struct {
-	char freezeID[11];
-	s64 cycles;
-	s64 remaining;
-	OHCIState t;
-	struct {
-		DeviceType index;
-		u32 size;
-		USBDevice dev;
-	} device[2];
-
-	struct usb_packet {
-		USBEndpoint ep; //usb packet endpoint
-		int dev_index;
-		int data_size;
-	} usb_packet;
-} USBfreezeData;
+char USBfreezeID[] = "USBqemuW04";
+#define USB_FREEZE_VERSION 1
 
 u8 *ram = 0;
 USBcallback _USBirq;
@@ -70,6 +59,7 @@ int64_t usb_bit_time;
 
 s64 clocks = 0;
 s64 remaining = 0;
+bool usb_freeze_delta = false;
 
 #if _WIN32
 HWND gsWnd = nullptr;
@@ -81,7 +71,7 @@ Display *g_GSdsp;
 Window g_GSwin;
 #endif
 
-Config::Config(): Log(0)
+Config::Config(): Log(0), CatchUp(CATCHUP_COALESCE), CatchUpBudget(8)
 {
 	memset(&WheelType, 0, sizeof(WheelType));
 }
@@ -343,9 +333,54 @@ EXPORT_C_(s32) USBopen(void *pDsp) {
 	return 0;
 }
 
+static void DumpStats()
+{
+	const USBstats& s = usb_stats;
+
+	USB_LOG("USB stats: %llu frames (%llu us), %llu idle, %llu caught up\n",
+		(unsigned long long)s.frames, (unsigned long long)(s.frame_ns / 1000),
+		(unsigned long long)s.idle_frames, (unsigned long long)s.catchup_frames);
+	USB_LOG("  %llu EDs walked, %llu TDs, %llu ISO TDs\n",
+		(unsigned long long)s.eds, (unsigned long long)s.tds, (unsigned long long)s.iso_tds);
+
+	for (int i = 0; i < USB_STATS_PORTS; i++)
+	{
+		const USBportStats& ps = s.port[i];
+		USB_LOG("  port %d (%s): %llu us\n", i, conf.Port[i].c_str(), (unsigned long long)(ps.ns / 1000));
+
+		for (int k = 0; k < USB_STATS_ENDPOINTS; k++)
+		{
+			const USBendpointStats *dirs[] = { &ps.in[k], &ps.out[k] };
+			for (int d = 0; d < 2; d++)
+			{
+				if (!dirs[d]->packets)
+					continue;
+				USB_LOG("    ep %d %-3s: %llu packets, %llu NAKs, %llu bytes\n", k, d ? "out" : "in",
+					(unsigned long long)dirs[d]->packets, (unsigned long long)dirs[d]->naks,
+					(unsigned long long)dirs[d]->bytes);
+			}
+		}
+	}
+
+	if (s.msd.cache_hits || s.msd.cache_misses)
+		USB_LOG("  msd: %llu cache hits, %llu misses, %llu blocks prefetched\n",
+			(unsigned long long)s.msd.cache_hits, (unsigned long long)s.msd.cache_misses,
+			(unsigned long long)s.msd.prefetched);
+}
+
+EXPORT_C_(s32) USBgetStats(USBstats *stats, u32 size) {
+	size = std::min<u32>(size, sizeof(USBstats));
+	if (stats)
+		memcpy(stats, &usb_stats, size);
+	return size;
+}
+
 EXPORT_C_(void) USBclose() {
 	OSDebugOut(TEXT("USBclose\n"));
 
+	DumpStats();
+	memset(&usb_stats, 0, sizeof(usb_stats));
+
 	CloseDevice(0);
 	CloseDevice(1);
 	shared::Uninitialize();
@@ -407,253 +442,661 @@ EXPORT_C_(void) USBsetRAM(void *mem) {
 	Reset();
 }
 
-EXPORT_C_(s32) USBfreeze(int mode, freezeData *data) {
+// Save state sections
+#define FREEZE_TAG_CLOCK  FREEZE_TAG('C','L','K',' ')
+#define FREEZE_TAG_OHCI   FREEZE_TAG('O','H','C','I')
+#define FREEZE_TAG_DEVICE FREEZE_TAG('D','E','V',' ')
+#define FREEZE_TAG_PACKET FREEZE_TAG('P','K','T',' ')
 
-	// YoUr FuNcTiOn UsEs 19k of sTacK oF 16K
-	std::unique_ptr<USBfreezeData> usbd_ptr(new USBfreezeData);
-	USBfreezeData& usbd = *usbd_ptr.get();
+static void SaveOHCIState(FreezeWriter& w, const OHCIState *ohci)
+{
+	w.begin(FREEZE_TAG_OHCI);
+	w.put<u64>(ohci->eof_timer);
+	w.put<s64>(ohci->sof_time);
+	w.put<u32>(ohci->ctl);
+	w.put<u32>(ohci->status);
+	w.put<u32>(ohci->intr_status);
+	w.put<u32>(ohci->intr);
+	w.put<u32>(ohci->hcca);
+	w.put<u32>(ohci->ctrl_head);
+	w.put<u32>(ohci->ctrl_cur);
+	w.put<u32>(ohci->bulk_head);
+	w.put<u32>(ohci->bulk_cur);
+	w.put<u32>(ohci->per_cur);
+	w.put<u32>(ohci->done);
+	w.put<s32>(ohci->done_count);
+	w.put<u16>(ohci->fsmps);
+	w.put<u8>(ohci->fit);
+	w.put<u16>(ohci->fi);
+	w.put<u8>(ohci->frt);
+	w.put<u16>(ohci->frame_number);
+	w.put<u32>(ohci->pstart);
+	w.put<u32>(ohci->lst);
+	w.put<u32>(ohci->rhdesc_a);
+	w.put<u32>(ohci->rhdesc_b);
+	w.put<u32>(ohci->rhstatus);
+	w.put<u32>(ohci->old_ctl);
+	w.put<u32>(ohci->num_ports);
+	for (u32 i = 0; i < ohci->num_ports; i++)
+		w.put<u32>(ohci->rhport[i].ctrl);
+	w.end();
+}
 
-	//TODO FREEZE_SIZE mismatch causes loading to fail in PCSX2 beforehand
-	if (mode == FREEZE_LOAD)
+// Fields missing from an older, shorter section keep their current values
+static void LoadOHCIState(FreezeReader& r, OHCIState *ohci)
+{
+	u8 u8v;
+	u16 u16v;
+	u32 num_ports;
+
+	r.get(ohci->eof_timer);
+	r.get(ohci->sof_time);
+	r.get(ohci->ctl);
+	r.get(ohci->status);
+	r.get(ohci->intr_status);
+	r.get(ohci->intr);
+	r.get(ohci->hcca);
+	r.get(ohci->ctrl_head);
+	r.get(ohci->ctrl_cur);
+	r.get(ohci->bulk_head);
+	r.get(ohci->bulk_cur);
+	r.get(ohci->per_cur);
+	r.get(ohci->done);
+	r.get(ohci->done_count);
+	if (r.get(u16v)) ohci->fsmps = u16v;
+	if (r.get(u8v)) ohci->fit = u8v;
+	if (r.get(u16v)) ohci->fi = u16v;
+	if (r.get(u8v)) ohci->frt = u8v;
+	r.get(ohci->frame_number);
+	r.get(ohci->pstart);
+	r.get(ohci->lst);
+	r.get(ohci->rhdesc_a);
+	r.get(ohci->rhdesc_b);
+	r.get(ohci->rhstatus);
+	r.get(ohci->old_ctl);
+	if (r.get(num_ports))
 	{
-		if(data->size < sizeof(USBfreezeData))
+		for (u32 i = 0; i < num_ports; i++)
 		{
-			SysMessage(TEXT("ERROR: Unable to load freeze data! Got %d bytes, expected >= %zu.\n"), data->size, sizeof(USBfreezeData));
-			return -1;
+			u32 ctrl;
+			if (r.get(ctrl) && i < ohci->num_ports)
+				ohci->rhport[i].ctrl = ctrl;
 		}
+	}
+}
 
-		usbd = *(USBfreezeData*)data->data;
-		usbd.freezeID[10] = 0;
-
-		if( strcmp(usbd.freezeID, USBfreezeID) != 0)
-		{
-			SysMessage(TEXT("ERROR: Unable to load freeze data! Found ID '%") TEXT(SFMTs) TEXT("', expected ID '%") TEXT(SFMTs) TEXT("'.\n"), usbd.freezeID, USBfreezeID);
-			return -1;
-		}
+// 'worst_case' sizes every variable length field at its maximum (FREEZE_SIZE)
+static void SaveDeviceState(FreezeWriter& w, int port, bool worst_case)
+{
+	RegisterDevice& regInst = RegisterDevice::instance();
+	//TODO check that current created usb device and conf.Port[n] are the same
+	auto index = regInst.Index(conf.Port[port]);
+	auto proxy = regInst.Device(index);
+	USBDevice *dev = usb_device[port];
+
+	w.begin(FREEZE_TAG_DEVICE);
+	w.put<s32>(port);
+	w.put<s32>(index);
+	if (dev)
+	{
+		w.put<u8>(dev->addr);
+		w.put<u8>(dev->attached);
+		w.put<s32>(dev->auto_attach);
+		w.put<s32>(dev->state);
+		w.put<s32>(dev->remote_wakeup);
+		w.put<s32>(dev->setup_state);
+		w.put<s32>(dev->setup_len);
+		w.put<s32>(dev->setup_index);
+		w.write(dev->setup_buf, sizeof(dev->setup_buf));
+		w.put<u32>(dev->flags);
+		w.put<s32>(dev->configuration);
+		w.put<s32>(dev->ninterfaces);
+		for (int k = 0; k < USB_MAX_INTERFACES; k++)
+			w.put<s32>(dev->altsetting[k]);
+
+		// only control transfer in progress has anything in data_buf
+		u32 len = 0;
+		if (worst_case)
+			len = sizeof(dev->data_buf);
+		else if (dev->setup_state != 0 /* SETUP_STATE_IDLE */ && dev->setup_len > 0)
+			len = std::min<u32>(dev->setup_len, sizeof(dev->data_buf));
+		w.put<u32>(len);
+		w.write(dev->data_buf, len);
+
+		u32 size = proxy ? proxy->Freeze(FREEZE_SIZE, dev, nullptr) : 0;
+		w.put<u32>(size);
+		void *ptr = w.reserve(size);
+		if (ptr && size && !worst_case)
+			proxy->Freeze(FREEZE_SAVE, dev, ptr);
+	}
+	w.end();
+}
 
-		s8 *ptr = data->data + sizeof(USBfreezeData);
-		// Load the state of the attached devices
-		if (data->size < sizeof(USBfreezeData) + usbd.device[0].size + usbd.device[1].size + 8192)
-			return -1;
+static int LoadDeviceState(FreezeReader& r, int i)
+{
+	s32 saved_index;
+	if (!r.get(saved_index))
+	{
+		// nothing saved for this port, keep the configured device
+		OpenDevice(i);
+		return 0;
+	}
 
-		//TODO Subsequent save state loadings make USB "stall" for n seconds since previous load
-		//clocks = usbd.cycles;
-		//remaining = usbd.remaining;
+	RegisterDevice& regInst = RegisterDevice::instance();
+	auto index = regInst.Index(conf.Port[i]);
+	auto proxy = regInst.Device(index);
 
-		CloseDevice(0);
-		CloseDevice(1);
+	//TODO FREEZE_SIZE mismatch causes loading to fail in PCSX2 beforehand
+	// but just in case, recreate the same device type as was saved
+	if ((DeviceType)saved_index != index)
+	{
+		index = (DeviceType)saved_index;
+		DestroyDevice(i);
 
-		for(int i=0; i< qemu_ohci->num_ports; i++)
+		proxy = regInst.Device(index);
+		if (proxy)
 		{
-			usbd.t.rhport[i].port.opaque = qemu_ohci;
-			usbd.t.rhport[i].port.ops = qemu_ohci->rhport[i].port.ops;
-			usbd.t.rhport[i].port.dev = qemu_ohci->rhport[i].port.dev;
+			// re-create with saved device type
+			conf.Port[i] = proxy->TypeName(); // TODO config dialog reloads from ini
+			usb_device[i] = CreateDevice(index, i);
+			USBAttach(i, usb_device[i], index != DEVTYPE_MSD);
 		}
+	}
 
-		//if (qemu_ohci->usb_packet.iov.iov)
-		usb_packet_cleanup(&qemu_ohci->usb_packet);
-		*qemu_ohci = usbd.t;
-		// restore USBPacket for OHCIState
-		usb_packet_init(&qemu_ohci->usb_packet);
-
-		RegisterDevice& regInst = RegisterDevice::instance();
-		for (int i=0; i<2; i++)
+	if (proxy && usb_device[i]) /* usb device creation may have failed for some reason */
+	{
+		USBDevice *dev = usb_device[i];
+		u8 u8v;
+		u32 len, size;
+
+		if (r.get(u8v)) dev->addr = u8v;
+		if (r.get(u8v)) dev->attached = !!u8v;
+		r.get(dev->auto_attach);
+		r.get(dev->state);
+		r.get(dev->remote_wakeup);
+		r.get(dev->setup_state);
+		r.get(dev->setup_len);
+		r.get(dev->setup_index);
+		r.read(dev->setup_buf, sizeof(dev->setup_buf));
+		r.get(dev->flags);
+		r.get(dev->configuration);
+		r.get(dev->ninterfaces);
+		for (int k = 0; k < USB_MAX_INTERFACES; k++)
+			r.get(dev->altsetting[k]);
+
+		if (r.get(len))
 		{
-			auto index = regInst.Index(conf.Port[i]);
-			auto proxy = regInst.Device(index);
-
-			//TODO FREEZE_SIZE mismatch causes loading to fail in PCSX2 beforehand
-			// but just in case, recreate the same device type as was saved
-			if (usbd.device[i].index != index)
-			{
-				index = usbd.device[i].index;
-				DestroyDevice(i);
-
-				proxy = regInst.Device(index);
-				if (proxy)
-				{
-					// re-create with saved device type
-					conf.Port[i] = proxy->TypeName(); // TODO config dialog reloads from ini
-					usb_device[i] = CreateDevice(index, i);
-					USBAttach(i, usb_device[i], index != DEVTYPE_MSD);
-				}
-			}
-
-			if (proxy && usb_device[i]) /* usb device creation may have failed for some reason */
-			{
-				if (proxy->Freeze(FREEZE_SIZE, usb_device[i], nullptr) != usbd.device[i].size)
-				{
-					SysMessage(TEXT("Port %d: device's freeze size doesn't match.\n"), 1+(1-i));
-					return -1;
-				}
-
-				const USBDevice& tmp = usbd.device[i].dev;
-
-				usb_device[i]->addr = tmp.addr;
-				usb_device[i]->attached = tmp.attached;
-				usb_device[i]->auto_attach = tmp.auto_attach;
-				usb_device[i]->configuration = tmp.configuration;
-				usb_device[i]->ninterfaces = tmp.ninterfaces;
-				usb_device[i]->flags = tmp.flags;
-				usb_device[i]->state = tmp.state;
-				usb_device[i]->remote_wakeup = tmp.remote_wakeup;
-				usb_device[i]->setup_state = tmp.setup_state;
-				usb_device[i]->setup_len = tmp.setup_len;
-				usb_device[i]->setup_index = tmp.setup_index;
+			u32 n = std::min<u32>(len, sizeof(dev->data_buf));
+			r.read(dev->data_buf, n);
+			r.skip(len - n);
+		}
 
 #ifndef NDEBUG
-				std::cerr << "Loading save state:\nport: " << i
-					<< "\naddr:        " << (int)usb_device[i]->addr
-					<< "\nattached:    " << usb_device[i]->attached
-					<< "\nauto_attach: " << usb_device[i]->auto_attach
-					<< "\nconfig:  " << usb_device[i]->configuration
-					<< "\nninterf: " << usb_device[i]->ninterfaces
-					<< "\nflags:   " << usb_device[i]->flags
-					<< "\nstate:   " << usb_device[i]->state
-					<< "\nremote_wakeup: " << usb_device[i]->remote_wakeup
-					<< "\nsetup_state:   " << usb_device[i]->setup_state
-					<< "\nsetup_len:     " << usb_device[i]->setup_len
-					<< "\nsetup_index:   " << usb_device[i]->setup_index
-					<< std::endl;
+		std::cerr << "Loading save state:\nport: " << i
+			<< "\naddr:        " << (int)dev->addr
+			<< "\nattached:    " << dev->attached
+			<< "\nauto_attach: " << dev->auto_attach
+			<< "\nconfig:  " << dev->configuration
+			<< "\nninterf: " << dev->ninterfaces
+			<< "\nflags:   " << dev->flags
+			<< "\nstate:   " << dev->state
+			<< "\nremote_wakeup: " << dev->remote_wakeup
+			<< "\nsetup_state:   " << dev->setup_state
+			<< "\nsetup_len:     " << dev->setup_len
+			<< "\nsetup_index:   " << dev->setup_index
+			<< std::endl;
 #endif
-				memcpy(usb_device[i]->data_buf, tmp.data_buf, sizeof(tmp.data_buf));
-				memcpy(usb_device[i]->setup_buf, tmp.setup_buf, sizeof(tmp.setup_buf));
-
-				usb_desc_set_config(usb_device[i], tmp.configuration);
-				for (int k = 0; k < 16; k++) {
-					usb_device[i]->altsetting[k] = tmp.altsetting[k];
-					usb_desc_set_interface(usb_device[i], k, tmp.altsetting[k]);
-				}
-
-				proxy->Freeze(FREEZE_LOAD, usb_device[i], ptr);
-				if (!usb_device[i]->attached) { // FIXME FREEZE_SAVE fcked up
-					usb_device[i]->attached = true;
-					usb_device_reset(usb_device[i]);
-					//TODO reset port if save state's and configured wheel types are different
-					usb_detach (&qemu_ohci->rhport[i].port);
-					usb_attach (&qemu_ohci->rhport[i].port);
-				}
-				OpenDevice(i);
-			}
-			else if (!proxy && index != DEVTYPE_NONE)
+
+		usb_desc_set_config(dev, dev->configuration);
+		for (int k = 0; k < USB_MAX_INTERFACES; k++)
+			usb_desc_set_interface(dev, k, dev->altsetting[k]);
+
+		if (r.get(size))
+		{
+			if (proxy->Freeze(FREEZE_SIZE, dev, nullptr) != (s32)size || r.remaining() < size)
 			{
-				SysMessage(TEXT("Port %d: unknown device.\nPlugin is probably too old for this save.\n"), i);
+				SysMessage(TEXT("Port %d: device's freeze size doesn't match.\n"), 1+(1-i));
+				return -1;
 			}
-			ptr += usbd.device[i].size;
+			proxy->Freeze(FREEZE_LOAD, dev, (void *)r.data());
+			r.skip(size);
 		}
 
-		int dev_index = usbd.usb_packet.dev_index;
+		if (!dev->attached) { // FIXME FREEZE_SAVE fcked up
+			dev->attached = true;
+			usb_device_reset(dev);
+			//TODO reset port if save state's and configured wheel types are different
+			usb_detach (&qemu_ohci->rhport[i].port);
+			usb_attach (&qemu_ohci->rhport[i].port);
+		}
+		OpenDevice(i);
+	}
+	else if (!proxy && index != DEVTYPE_NONE)
+	{
+		SysMessage(TEXT("Port %d: unknown device.\nPlugin is probably too old for this save.\n"), i);
+	}
+	return 0;
+}
+
+static USBEndpoint *FindEndpoint(USBDevice *dev, u8 pid, u8 nr, u8 type, u8 ifnum)
+{
+	if (pid == USB_TOKEN_SETUP)
+		return dev->ep_ctl.ifnum == ifnum ? &dev->ep_ctl : nullptr;
+
+	USBEndpoint *eps = (pid == USB_TOKEN_IN) ? dev->ep_in : dev->ep_out;
+	for (int k = 0; k < USB_MAX_ENDPOINTS; k++)
+	{
+		if (type == eps[k].type
+			&& nr == eps[k].nr
+			&& ifnum == eps[k].ifnum
+			&& pid == eps[k].pid)
+			return &eps[k];
+	}
+	return nullptr;
+}
+
+static void SavePacketState(FreezeWriter& w, const OHCIState *ohci, int slot, bool worst_case)
+{
+	const OHCIPacket *pkt = &ohci->packets[slot];
+	const USBPacket *p = &pkt->packet;
+	const USBEndpoint *ep = p->ep;
+	s32 port = -1;
+
+	for (int i = 0; i < 2; i++)
+	{
+		if (ep && usb_device[i] && ep->dev == usb_device[i])
+			port = i;
+	}
+
+	w.begin(FREEZE_TAG_PACKET);
+	w.put<s32>(slot);
+	w.put<u32>(pkt->td);
+	w.put<u8>(pkt->complete);
+	w.put<s32>(port);
+	w.put<u8>(ep ? ep->pid : 0);
+	w.put<u8>(ep ? ep->nr : 0);
+	w.put<u8>(ep ? ep->type : 0);
+	w.put<u8>(ep ? ep->ifnum : 0);
+	w.put<s32>(p->pid);
+	w.put<u64>(p->id);
+	w.put<u32>(p->stream);
+	w.put<u64>(p->parameter);
+	w.put<u8>(p->short_not_ok);
+	w.put<u8>(p->int_req);
+	w.put<s32>(p->status);
+	w.put<s32>(p->actual_length);
+	w.put<s32>(p->state);
+
+	u32 size = worst_case ? sizeof(pkt->buf) : (u32)std::min(p->iov.size, sizeof(pkt->buf));
+	w.put<u32>(size);
+	// data may be mapped from guest memory, so gather it from iov
+	void *ptr = w.reserve(size);
+	if (ptr && !worst_case)
+		iov_to_buf(p->iov.iov, p->iov.niov, 0, ptr, size);
+	w.end();
+}
+
+// Packets that can't be restored are dropped, OHCI then just resubmits their TDs
+static void LoadPacketState(FreezeReader& r, OHCIState *ohci)
+{
+	s32 slot, port, pid, status, actual_length, state;
+	u32 td, stream, size;
+	u64 id, parameter;
+	u8 complete, ep_pid, ep_nr, ep_type, ep_ifnum, short_not_ok, int_req;
+
+	if (!(r.get(slot) && r.get(td) && r.get(complete) && r.get(port)
+		&& r.get(ep_pid) && r.get(ep_nr) && r.get(ep_type) && r.get(ep_ifnum)
+		&& r.get(pid) && r.get(id) && r.get(stream) && r.get(parameter)
+		&& r.get(short_not_ok) && r.get(int_req) && r.get(status)
+		&& r.get(actual_length) && r.get(state) && r.get(size)))
+		return;
+
+	if (slot < 0 || slot >= OHCI_MAX_PACKETS || !td)
+		return;
+
+	if (port < 0 || port > 1 || !usb_device[port])
+	{
+		OSDebugOut(TEXT("USB packet has invalid device index? %d\n"), port);
+		return;
+	}
+
+	OHCIPacket *pkt = &ohci->packets[slot];
+	USBPacket *p = &pkt->packet;
+	USBEndpoint *ep = FindEndpoint(usb_device[port], ep_pid, ep_nr, ep_type, ep_ifnum);
+
+	if (!ep || size > sizeof(pkt->buf) || !r.read(pkt->buf, size))
+		return;
+
+	usb_packet_setup(p, pid, ep, stream, id, !!short_not_ok, !!int_req);
+	// restored packets go through the bounce buffer, guest memory is loaded separately
+	usb_packet_addbuf(p, pkt->buf, size);
+	pkt->mapped = false;
+	p->parameter = parameter;
+	p->status = status;
+	p->actual_length = actual_length;
+	usb_packet_set_state(p, (USBPacketState)state);
+
+	// put in-flight packets back into endpoint queue so they can be cancelled
+	if (usb_packet_is_inflight(p))
+		QTAILQ_INSERT_TAIL(&ep->queue, p, queue);
+
+	pkt->td = td;
+	pkt->complete = !!complete;
+}
+
+// Header: freeze ID, format version, payload length, then tagged sections
+static void SaveState(FreezeWriter& w, bool worst_case)
+{
+	w.write(USBfreezeID, sizeof(USBfreezeID));
+	w.put<u32>(USB_FREEZE_VERSION);
+	size_t length_offset = w.size();
+	w.put<u32>(0);
+
+	w.begin(FREEZE_TAG_CLOCK);
+	w.put<s64>(clocks);
+	w.put<s64>(remaining);
+	w.end();
+
+	SaveOHCIState(w, qemu_ohci);
+
+	for (int i=0; i<2; i++)
+		SaveDeviceState(w, i, worst_case);
+
+	for (int j = 0; j < OHCI_MAX_PACKETS; j++)
+	{
+		if (worst_case || qemu_ohci->packets[j].td)
+			SavePacketState(w, qemu_ohci, j, worst_case);
+	}
+
+	u32 length = (u32)(w.size() - length_offset - sizeof(u32));
+	w.patch(length_offset, &length, sizeof(length));
+}
+
+EXPORT_C_(s32) USBfreeze(int mode, freezeData *data) {
+
+	if (mode == FREEZE_LOAD)
+	{
+		FreezeReader r(data->data, data->size);
+		char freezeID[sizeof(USBfreezeID)] = {};
+		u32 version = 0, length = 0;
+
+		if (!r.read(freezeID, sizeof(freezeID)) || !r.get(version) || !r.get(length) || length > r.remaining())
+		{
+			SysMessage(TEXT("ERROR: Unable to load freeze data! Got %d bytes.\n"), data->size);
+			return -1;
+		}
 
-		if (usb_device[dev_index])
+		freezeID[sizeof(freezeID) - 1] = 0;
+		if (strcmp(freezeID, USBfreezeID) != 0)
 		{
-			USBPacket *p = &qemu_ohci->usb_packet;
-			p->actual_length = usbd.usb_packet.data_size;
+			SysMessage(TEXT("ERROR: Unable to load freeze data! Found ID '%") TEXT(SFMTs) TEXT("', expected ID '%") TEXT(SFMTs) TEXT("'.\n"), freezeID, USBfreezeID);
+			return -1;
+		}
 
-			QEMUIOVector *iov = p->combined ? &p->combined->iov : &p->iov;
-			iov_from_buf(iov->iov, iov->niov, 0, ptr, p->actual_length);
+		if (version > USB_FREEZE_VERSION)
+			OSDebugOut(TEXT("Save state version %u is newer than %u, unknown fields are skipped\n"), version, USB_FREEZE_VERSION);
 
-			if (usbd.usb_packet.ep.pid == USB_TOKEN_SETUP)
+		FreezeReader body(r.data(), length), section;
+		FreezeReader ohci_section, dev_section[2];
+		bool has_ohci = false;
+		std::vector<FreezeReader> pkt_sections;
+		u32 tag;
+
+		while (body.next(tag, section))
+		{
+			switch (tag)
 			{
-				if (usb_device[dev_index]->ep_ctl.ifnum == usbd.usb_packet.ep.ifnum)
-					qemu_ohci->usb_packet.ep = &usb_device[dev_index]->ep_ctl;
-			}
-			else
+			case FREEZE_TAG_CLOCK:
+				//TODO Subsequent save state loadings make USB "stall" for n seconds since previous load
+				//section.get(clocks);
+				//section.get(remaining);
+				break;
+			case FREEZE_TAG_OHCI:
+				ohci_section = section;
+				has_ohci = true;
+				break;
+			case FREEZE_TAG_DEVICE:
 			{
-				USBEndpoint *eps = nullptr;
-				if (usbd.usb_packet.ep.pid == USB_TOKEN_IN)
-					eps = usb_device[dev_index]->ep_in;
-				else //if (usbd.ep.pid == USB_TOKEN_OUT)
-					eps = usb_device[dev_index]->ep_out;
-
-				for (int k = 0; k < USB_MAX_ENDPOINTS; k++) {
-
-					if (usbd.usb_packet.ep.type == eps[k].type
-						&& usbd.usb_packet.ep.nr == eps[k].nr
-						&& usbd.usb_packet.ep.ifnum == eps[k].ifnum
-						&& usbd.usb_packet.ep.pid == eps[k].pid)
-					{
-						qemu_ohci->usb_packet.ep = &eps[k];
-						break;
-					}
-				}
+				s32 port;
+				if (section.get(port) && port >= 0 && port < 2)
+					dev_section[port] = section;
+				break;
+			}
+			case FREEZE_TAG_PACKET:
+				pkt_sections.push_back(section);
+				break;
+			default:
+				OSDebugOut(TEXT("Skipping unknown save state section %08x\n"), tag);
+				break;
 			}
 		}
-		else
+
+		// endpoints are about to go away with the devices
+		ohci_cancel_packets(qemu_ohci);
+		CloseDevice(0);
+		CloseDevice(1);
+
+		if (has_ohci)
+			LoadOHCIState(ohci_section, qemu_ohci);
+
+		for (int i=0; i<2; i++)
 		{
-			SysMessage(TEXT("USB packet has invalid device index? %d\n"), dev_index); // or just a bug
+			if (LoadDeviceState(dev_section[i], i) < 0)
+				return -1;
+		}
+
+		for (auto& pkt : pkt_sections)
+			LoadPacketState(pkt, qemu_ohci);
+	}
+	else if (mode == FREEZE_SAVE)
+	{
+		memset(data->data, 0, data->size);
+		FreezeWriter w(data->data, data->size);
+		SaveState(w, false);
+		if (w.overflow())
+		{
+			SysMessage(TEXT("ERROR: Save state needs %zu bytes, only %d available.\n"), w.size(), data->size);
 			return -1;
 		}
 	}
-	//TODO straight copying of structs can break cross-platform/cross-compiler save states 'cause padding 'n' stuff
+	else if (mode == FREEZE_SIZE)
+	{
+		// PCSX2 reads back exactly this many bytes on load, so it has to depend
+		// on configured devices only and not on the transfers currently in flight.
+		FreezeWriter w(nullptr, 0);
+		SaveState(w, true);
+		data->size = w.size();
+	}
+
+	return 0;
+}
+
+// Delta save states for rewind. Full USBfreeze snapshots are XOR/RLE encoded
+// against a rolling base snapshot (key frame) that is refreshed every
+// USB_DELTA_KEY_INTERVAL saves. Few recent bases are kept around so deltas
+// taken shortly before a key frame can still be loaded.
+#define USB_DELTA_KEY_INTERVAL 60
+#define USB_DELTA_MAX_BASES 4
+
+char USBdeltaID[] = "USBdeltaW1";
+
+enum DeltaKind : u8
+{
+	DELTA_KEY = 0, // encoded against all-zero base and becomes the new base
+	DELTA_DIFF = 1,
+};
+
+struct DeltaHeader
+{
+	char deltaID[sizeof(USBdeltaID)];
+	u8 kind;
+	u32 serial; // key frame's serial this snapshot is based on
+	u32 full_size;
+	u32 encoded_size;
+};
+
+struct DeltaBase
+{
+	u32 serial;
+	std::vector<u8> data;
+};
+
+static std::deque<DeltaBase> delta_bases; // newest at the back
+static std::vector<u8> delta_scratch;
+static u32 delta_serial = 0;
+static int delta_count = 0;
+
+static const DeltaBase *FindDeltaBase(u32 serial)
+{
+	for (auto& base : delta_bases)
+		if (base.serial == serial)
+			return &base;
+	return nullptr;
+}
+
+static void PushDeltaBase(u32 serial, const std::vector<u8>& data)
+{
+	if (FindDeltaBase(serial))
+		return;
+	delta_bases.push_back({ serial, data });
+	while (delta_bases.size() > USB_DELTA_MAX_BASES)
+		delta_bases.pop_front();
+}
+
+// Same as USBfreeze, but FREEZE_SAVE only stores what changed since the last
+// key frame and sets data->size to the bytes actually used. FREEZE_SIZE is
+// the worst case (a key frame of incompressible data).
+EXPORT_C_(s32) USBfreezeDelta(int mode, freezeData *data)
+{
+	freezeData full;
+	if (USBfreeze(FREEZE_SIZE, &full) < 0)
+		return -1;
+
+	if (mode == FREEZE_SIZE)
+	{
+		data->size = sizeof(DeltaHeader) + xor_rle_bound(full.size);
+	}
 	else if (mode == FREEZE_SAVE)
 	{
-		memset(data->data, 0, data->size);//maybe it already is...
-		RegisterDevice& regInst = RegisterDevice::instance();
-		usbd.usb_packet.dev_index = -1;
+		DeltaHeader hdr = {};
+		size_t written;
+
+		delta_scratch.resize(full.size);
+		full.data = (s8 *)delta_scratch.data();
+		usb_freeze_delta = true;
+		s32 ret = USBfreeze(FREEZE_SAVE, &full);
+		usb_freeze_delta = false;
+		if (ret < 0)
+			return -1;
 
-		for (int i=0; i<2; i++)
+		const DeltaBase *base = delta_bases.empty() ? nullptr : &delta_bases.back();
+		if (!base || base->data.size() != delta_scratch.size() || delta_count >= USB_DELTA_KEY_INTERVAL)
+		{
+			PushDeltaBase(++delta_serial, delta_scratch);
+			delta_count = 0;
+			hdr.kind = DELTA_KEY;
+			base = nullptr;
+		}
+		else
 		{
-			//TODO check that current created usb device and conf.Port[n] are the same
-			auto index = regInst.Index(conf.Port[i]);
-			auto proxy = regInst.Device(index);
-			usbd.device[i].index = index;
-
-			if (proxy && usb_device[i])
-				usbd.device[i].size = proxy->Freeze(FREEZE_SIZE, usb_device[i], nullptr);
-			else
-				usbd.device[i].size = 0;
-
-			if (qemu_ohci->usb_packet.ep && qemu_ohci->usb_packet.ep->dev == usb_device[i])
-				usbd.usb_packet.dev_index = i;
+			delta_count++;
+			hdr.kind = DELTA_DIFF;
 		}
 
-		strncpy(usbd.freezeID,  USBfreezeID, strlen(USBfreezeID));
-		usbd.t = *qemu_ohci;
-		usbd.t.usb_packet.iov = {};
-		usbd.t.usb_packet.ep = nullptr;
-		if (qemu_ohci->usb_packet.ep)
-			usbd.usb_packet.ep = *qemu_ohci->usb_packet.ep;
+		memcpy(hdr.deltaID, USBdeltaID, sizeof(USBdeltaID));
+		hdr.serial = delta_serial;
+		hdr.full_size = full.size;
 
-		for(int i=0; i< qemu_ohci->num_ports; i++)
+		if (data->size < (int)sizeof(hdr) ||
+			!xor_rle_encode(base ? base->data.data() : nullptr, delta_scratch.data(), delta_scratch.size(),
+				(u8 *)data->data + sizeof(hdr), data->size - sizeof(hdr), written))
 		{
-			usbd.t.rhport[i].port.opaque = nullptr;
-			usbd.t.rhport[i].port.ops = nullptr;
-			usbd.t.rhport[i].port.dev = nullptr;
+			SysMessage(TEXT("ERROR: Delta save state doesn't fit into %d bytes.\n"), data->size);
+			return -1;
 		}
 
-		usbd.cycles = clocks;
-		usbd.remaining = remaining;
+		hdr.encoded_size = (u32)written;
+		memcpy(data->data, &hdr, sizeof(hdr));
+		data->size = sizeof(hdr) + written;
+	}
+	else if (mode == FREEZE_LOAD)
+	{
+		DeltaHeader hdr;
 
-		s8 *ptr = data->data + sizeof(USBfreezeData);
+		if (data->size < (int)sizeof(hdr))
+			return -1;
+		memcpy(&hdr, data->data, sizeof(hdr));
+		hdr.deltaID[sizeof(hdr.deltaID) - 1] = 0;
 
-		// Save the state of the attached devices
-		for (int i=0; i<2; i++)
+		if (strcmp(hdr.deltaID, USBdeltaID) != 0 || hdr.encoded_size > data->size - sizeof(hdr))
 		{
-			auto proxy = regInst.Device(conf.Port[i]);
+			SysMessage(TEXT("ERROR: Unable to load delta save state!\n"));
+			return -1;
+		}
 
-			if (usb_device[i]) {
-				usbd.device[i].dev = *usb_device[i];
-				if (proxy && usbd.device[i].size)
-					proxy->Freeze(FREEZE_SAVE, usb_device[i], ptr);
+		const DeltaBase *base = nullptr;
+		if (hdr.kind == DELTA_DIFF)
+		{
+			base = FindDeltaBase(hdr.serial);
+			if (!base || base->data.size() != hdr.full_size)
+			{
+				OSDebugOut(TEXT("Delta save state's key frame %u is gone\n"), hdr.serial);
+				return -1;
 			}
-			memset (&usbd.device[i].dev.klass, 0, sizeof(USBDeviceClass));
+		}
 
-			ptr += usbd.device[i].size;
+		delta_scratch.resize(hdr.full_size);
+		if (!xor_rle_decode(base ? base->data.data() : nullptr, (u8 *)data->data + sizeof(hdr), hdr.encoded_size,
+			delta_scratch.data(), delta_scratch.size()))
+		{
+			SysMessage(TEXT("ERROR: Delta save state is corrupted!\n"));
+			return -1;
 		}
 
-		USBPacket *p = &qemu_ohci->usb_packet;
-		usbd.usb_packet.data_size = p->actual_length;
-		QEMUIOVector *iov = p->combined ? &p->combined->iov : &p->iov;
-		iov_to_buf(iov->iov, iov->niov, 0, ptr, p->actual_length);
+		if (hdr.kind == DELTA_KEY)
+			PushDeltaBase(hdr.serial, delta_scratch);
 
-		*(USBfreezeData*)data->data = usbd;
+		full.size = (int)delta_scratch.size();
+		full.data = (s8 *)delta_scratch.data();
+		return USBfreeze(FREEZE_LOAD, &full);
 	}
-	else if (mode == FREEZE_SIZE)
+
+	return 0;
+}
+
+// Apply conf.CatchUp if host stalled for more frames than conf.CatchUpBudget.
+// Returns how many frame boundaries USBasync may process now, -1 for no limit.
+static s64 CatchUpFrames()
+{
+	s64 eof = qemu_ohci->eof_timer;
+
+	// idle frames are cheap to skip anyway
+	if (conf.CatchUpBudget <= 0 || remaining < eof || ohci_bus_idle(qemu_ohci))
+		return -1;
+
+	s64 due = 1 + (remaining - eof) / usb_frame_time;
+	s64 excess = due - conf.CatchUpBudget;
+	if (excess <= 0)
+		return -1;
+
+	switch (conf.CatchUp)
 	{
-		data->size = 0x10000;
+	case CATCHUP_COALESCE:
+		remaining -= eof + (excess - 1) * usb_frame_time;
+		ohci_coalesce_frames(qemu_ohci, excess);
+		break;
+	case CATCHUP_DROP:
+		remaining -= excess * usb_frame_time;
+		break;
+	default:
+		OSDebugOut(TEXT("USB is %lld frames behind, replaying %d per call\n"), (long long)excess, conf.CatchUpBudget);
+		return conf.CatchUpBudget;
 	}
 
-	return 0;
+	usb_stats.catchup_frames += excess;
+	OSDebugOut(TEXT("USB is %lld frames behind, %s them\n"), (long long)excess,
+		conf.CatchUp == CATCHUP_DROP ? TEXT("dropped") : TEXT("coalesced"));
+	return -1;
 }
 
 EXPORT_C_(void) USBasync(u32 cycles)
@@ -662,11 +1105,35 @@ EXPORT_C_(void) USBasync(u32 cycles)
 	clocks += remaining;
 	if(qemu_ohci->eof_timer>0)
 	{
+		s64 budget = CatchUpFrames();
+		bool behind = false;
+
 		while(remaining>=qemu_ohci->eof_timer)
 		{
+			// Nothing to talk to, so just move frame counter along for all elapsed frames
+			if (ohci_bus_idle(qemu_ohci))
+			{
+				s64 frames = 1 + (remaining - qemu_ohci->eof_timer) / usb_frame_time;
+				remaining -= qemu_ohci->eof_timer + (frames - 1) * usb_frame_time;
+				ohci_skip_frames(qemu_ohci, frames);
+				usb_stats.idle_frames += frames;
+				continue;
+			}
+
+			// rest is replayed on next calls, eof_timer stays due
+			if (budget-- == 0)
+			{
+				behind = true;
+				break;
+			}
+
 			remaining-=qemu_ohci->eof_timer;
 			qemu_ohci->eof_timer=0;
+
+			u64 start = usb_stats_ns();
 			ohci_frame_boundary(qemu_ohci);
+			usb_stats.frames++;
+			usb_stats.frame_ns += usb_stats_ns() - start;
 
 			/*
 			 * Break out of the loop if bus was stopped.
@@ -676,7 +1143,7 @@ EXPORT_C_(void) USBasync(u32 cycles)
 			if (!qemu_ohci->eof_timer)
 				break;
 		}
-		if((remaining>0)&&(qemu_ohci->eof_timer>0))
+		if(!behind&&(remaining>0)&&(qemu_ohci->eof_timer>0))
 		{
 			s64 m = qemu_ohci->eof_timer;
 			if(remaining < m)
@@ -691,21 +1158,44 @@ EXPORT_C_(void) USBasync(u32 cycles)
 	//}
 }
 
+// Cycles until USBasync has work to do, so host can schedule it instead of
+// ticking it constantly. Query again after register writes, they can (re)start
+// the bus. USB_NO_DEADLINE means bus is stopped.
+EXPORT_C_(u32) USBnextDeadline()
+{
+	if (!qemu_ohci || qemu_ohci->eof_timer == 0)
+		return USB_NO_DEADLINE;
+
+	s64 cycles = (s64)qemu_ohci->eof_timer - remaining;
+	cycles += ohci_idle_frames(qemu_ohci) * usb_frame_time;
+
+	if (cycles <= 0)
+		return 0;
+	return (u32)std::min<s64>(cycles, USB_NO_DEADLINE - 1);
+}
+
 EXPORT_C_(s32) USBtest() {
 	return 0;
 }
 
-int cpu_physical_memory_rw(u32 addr, u8 *buf, size_t len, int is_write)
+// invalid address, reset and try again
+static bool check_guest_range(u32 addr, size_t len)
 {
-	//OSDebugOut(TEXT("%s addr %08X, len %d\n"), is_write ? TEXT("write") : TEXT("read "), addr, len);
-	// invalid address, reset and try again
 	if (addr+len >= 0x200000)
 	{
 		OSDebugOut(TEXT("invalid address, soft resetting ohci.\n"));
 		if (qemu_ohci)
 			ohci_soft_reset(qemu_ohci);
-		return 1;
+		return false;
 	}
+	return true;
+}
+
+int cpu_physical_memory_rw(u32 addr, u8 *buf, size_t len, int is_write)
+{
+	//OSDebugOut(TEXT("%s addr %08X, len %d\n"), is_write ? TEXT("write") : TEXT("read "), addr, len);
+	if (!check_guest_range(addr, len))
+		return 1;
 
 	if(is_write)
 		memcpy(&(ram[addr]),buf,len);
@@ -714,6 +1204,19 @@ int cpu_physical_memory_rw(u32 addr, u8 *buf, size_t len, int is_write)
 	return 0;
 }
 
+// IOP ram is contiguous, so no bounce buffers are needed
+void *cpu_physical_memory_map(u32 addr, size_t len, int is_write)
+{
+	assert(len <= 0x1000 - (addr & 0xfff));
+	if (!check_guest_range(addr, len))
+		return nullptr;
+	return &ram[addr];
+}
+
+void cpu_physical_memory_unmap(void *buf, size_t len, int is_write)
+{
+}
+
 int get_ticks_per_second()
 {
 	return PSXCLK;
@@ -120,6 +120,8 @@ bool SaveSettingValue(const TSTDSTRING& ini, const TSTDSTRING& section, const TC
 void SaveConfig() {
 
 	SaveSetting(_T("MAIN"), _T("log"), conf.Log);
+	SaveSetting(_T("MAIN"), _T("catchup"), conf.CatchUp);
+	SaveSetting(_T("MAIN"), _T("catchup_budget"), conf.CatchUpBudget);
 
 	SaveSetting(nullptr, 0, N_DEVICE_PORT, N_DEVICE, conf.Port[0]);
 	SaveSetting(nullptr, 1, N_DEVICE_PORT, N_DEVICE, conf.Port[1]);
@@ -146,6 +148,8 @@ void LoadConfig() {
 	loaded = true;
 
 	LoadSetting(_T("MAIN"), _T("log"), conf.Log);
+	LoadSetting(_T("MAIN"), _T("catchup"), conf.CatchUp);
+	LoadSetting(_T("MAIN"), _T("catchup_budget"), conf.CatchUpBudget);
 
 	LoadSetting(nullptr, 0, N_DEVICE_PORT, N_DEVICE, conf.Port[0]);
 	LoadSetting(nullptr, 1, N_DEVICE_PORT, N_DEVICE, conf.Port[1]);
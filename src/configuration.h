@@ -41,8 +41,17 @@
 #define PLAYER_ONE_PORT 1
 #define USB_PORT PLAYER_ONE_PORT
 
+// How USBasync handles frames missed during long host stalls
+enum CatchUpMode {
+  CATCHUP_REPLAY = 0, // process them over next calls, CatchUpBudget per call
+  CATCHUP_COALESCE,   // advance frame counter in one step
+  CATCHUP_DROP,       // forget them, frame counter doesn't advance
+};
+
 struct Config {
   int Log;
+  int CatchUp;
+  int CatchUpBudget; // frames processed per USBasync call before CatchUp kicks in, 0 - unlimited
   std::string Port[2];
   int WheelType[2];
 
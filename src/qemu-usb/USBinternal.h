@@ -2,6 +2,8 @@
 #define USBINTERNAL_H
 
 #include "vl.h"
+#include "../PS2Edefs.h"
+#include <chrono>
 
 /* Dump packet contents.  */
 //#define DEBUG_PACKET
@@ -23,6 +25,19 @@ typedef struct OHCIPort {
 
 typedef uint32_t target_phys_addr_t;
 
+/* Number of packets that can be in flight at the same time.
+ * One async endpoint doesn't stall the others this way.
+ */
+#define OHCI_MAX_PACKETS 4
+
+typedef struct OHCIPacket {
+    USBPacket packet;
+    uint8_t buf[8192]; /* used when packet data isn't mapped from guest memory */
+    uint32_t td; /* TD address of an async packet, 0 if slot is free */
+    bool complete;
+    bool mapped; /* packet's iov points straight into guest memory */
+} OHCIPacket;
+
 typedef struct OHCIState {
     target_phys_addr_t mem_base;
     int mem;
@@ -62,11 +77,7 @@ typedef struct OHCIState {
     
     /* Active packets.  */
     uint32_t old_ctl;
-    USBPacket usb_packet;
-    uint8_t usb_buf[8192];
-    uint32_t async_td;
-    bool async_complete;
-    
+    OHCIPacket packets[OHCI_MAX_PACKETS];
 } OHCIState;
 
 /* Host Controller Communications Area */
@@ -279,6 +290,23 @@ OHCIState *ohci_create(uint32_t base, int ports);
 uint32_t ohci_mem_read(OHCIState *ohci, uint32_t addr );
 void ohci_mem_write(OHCIState *ohci, uint32_t addr, uint32_t value );
 void ohci_frame_boundary(void *opaque);
+int ohci_bus_idle(OHCIState *ohci);
+void ohci_skip_frames(OHCIState *ohci, int64_t frames);
+void ohci_coalesce_frames(OHCIState *ohci, int64_t frames);
+int ohci_idle_frames(OHCIState *ohci);
+int ohci_packets_inflight(OHCIState *ohci);
+void ohci_cancel_packets(OHCIState *ohci);
+
+extern USBstats usb_stats;
+/* Set while USBfreezeDelta takes a rewind snapshot, devices should skip
+   anything costly in FREEZE_SAVE that only matters for full save states */
+extern bool usb_freeze_delta;
+
+static inline uint64_t usb_stats_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
 
 void ohci_hard_reset(OHCIState *ohci);
 void ohci_soft_reset(OHCIState *ohci);
@@ -374,6 +374,13 @@ typedef struct USBDeviceClass {
      */
     void (*ep_stopped)(USBDevice *dev, USBEndpoint *ep);
 
+    /*
+     * Called by the hcd at the start of every processed frame, lets device
+     * complete async packets whose work finished on another thread.
+     * Optional may be NULL.
+     */
+    void (*handle_frame)(USBDevice *dev);
+
     /*
      * Called by the hcd to alloc / free streams on a bulk endpoint.
      * Optional may be NULL.
@@ -594,6 +601,8 @@ void usb_device_flush_ep_queue(USBDevice *dev, USBEndpoint *ep);
 
 void usb_device_ep_stopped(USBDevice *dev, USBEndpoint *ep);
 
+void usb_device_handle_frame(USBDevice *dev);
+
 int usb_device_alloc_streams(USBDevice *dev, USBEndpoint **eps, int nr_eps,
                              int streams);
 void usb_device_free_streams(USBDevice *dev, USBEndpoint **eps, int nr_eps);
@@ -37,6 +37,9 @@
 #define DMA_DIRECTION_TO_DEVICE 0
 #define DMA_DIRECTION_FROM_DEVICE 1
 #define ED_LINK_LIMIT 32
+/* How far ahead an idle bus lets the host skip, HCCA frame number lags
+ * behind by up to this many frames */
+#define IDLE_FRAMES_MAX 16
 
 int64_t last_cycle = 0;
 #define MIN_IRQ_INTERVAL 64 /* hack */
@@ -50,6 +53,104 @@ extern int get_ticks_per_second();
 
 static void ohci_async_cancel_device(OHCIState *ohci, USBDevice *dev);
 
+/* Find the slot of an async packet submitted for TD at addr */
+static OHCIPacket *ohci_find_packet(OHCIState *ohci, uint32_t addr)
+{
+    int i;
+
+    if (!addr)
+        return NULL;
+
+    for (i = 0; i < OHCI_MAX_PACKETS; i++) {
+        if (ohci->packets[i].td == addr)
+            return &ohci->packets[i];
+    }
+    return NULL;
+}
+
+/* Get a slot not holding an async packet */
+static OHCIPacket *ohci_get_packet(OHCIState *ohci)
+{
+    int i;
+
+    for (i = 0; i < OHCI_MAX_PACKETS; i++) {
+        if (!ohci->packets[i].td)
+            return &ohci->packets[i];
+    }
+    return NULL;
+}
+
+int ohci_packets_inflight(OHCIState *ohci)
+{
+    int i, n = 0;
+
+    for (i = 0; i < OHCI_MAX_PACKETS; i++) {
+        if (ohci->packets[i].td)
+            n++;
+    }
+    return n;
+}
+
+static void ohci_unmap_packet(OHCIPacket *pkt)
+{
+    USBPacket *p = &pkt->packet;
+    int i;
+
+    if (!pkt->mapped)
+        return;
+    for (i = 0; i < p->iov.niov; i++) {
+        cpu_physical_memory_unmap(p->iov.iov[i].iov_base, p->iov.iov[i].iov_len,
+                                  p->pid == USB_TOKEN_IN);
+    }
+    pkt->mapped = false;
+}
+
+static void ohci_cancel_packet(OHCIPacket *pkt)
+{
+    /* completed but not yet retired packets have left the endpoint queue */
+    if (usb_packet_is_inflight(&pkt->packet))
+        usb_cancel_packet(&pkt->packet);
+    ohci_unmap_packet(pkt);
+    pkt->td = 0;
+    pkt->complete = false;
+}
+
+USBstats usb_stats;
+
+/* Account finished packet to its device's endpoint */
+static void ohci_stats_packet(USBPacket *p, uint64_t ns)
+{
+    USBDevice *dev = p->ep ? p->ep->dev : NULL;
+    USBportStats *ps;
+    USBendpointStats *es;
+
+    if (!dev || !dev->port || dev->port->index >= USB_STATS_PORTS)
+        return;
+
+    ps = &usb_stats.port[dev->port->index];
+    ps->ns += ns;
+    if (p->status == USB_RET_ASYNC)
+        return; /* counted once it completes */
+
+    es = (p->pid == USB_TOKEN_IN ? ps->in : ps->out) + (p->ep->nr & 0xf);
+    es->packets++;
+    if (p->status == USB_RET_NAK)
+        es->naks++;
+    else if (p->status == USB_RET_SUCCESS)
+        es->bytes += p->actual_length;
+}
+
+/* Cancel all pending async packets */
+void ohci_cancel_packets(OHCIState *ohci)
+{
+    int i;
+
+    for (i = 0; i < OHCI_MAX_PACKETS; i++) {
+        if (ohci->packets[i].td)
+            ohci_cancel_packet(&ohci->packets[i]);
+    }
+}
+
 /* Update IRQ levels */
 static inline void ohci_intr_update(OHCIState *ohci)
 {
@@ -273,10 +374,7 @@ static void ohci_roothub_reset(OHCIState *ohci)
             usb_port_reset(&port->port);
         }
     }
-    if (ohci->async_td) {
-        usb_cancel_packet(&ohci->usb_packet);
-        ohci->async_td = 0;
-    }
+    ohci_cancel_packets(ohci);
     ohci_stop_endpoints(ohci);
 }
 
@@ -322,30 +420,18 @@ void ohci_hard_reset(OHCIState *ohci)
 #define le16_to_cpu(x) (x)
 #define cpu_to_le16(x) (x)
 
-/* Get an array of dwords from main memory */
+/* Get an array of dwords from main memory.
+ * Whole descriptor is bounds checked and copied in one go.
+ */
 static inline int get_dwords(uint32_t addr, uint32_t *buf, int num)
 {
     int i;
 
-    for (i = 0; i < num; i++, buf++, addr += sizeof(*buf)) {
-        if (cpu_physical_memory_rw(addr, (uint8_t *)buf, sizeof(*buf), 0))
-            return 0;
-        *buf = le32_to_cpu(*buf);
-    }
-
-    return 1;
-}
-
-/* Get an array of words from main memory */
-static inline int get_words(uint32_t addr, uint16_t *buf, int num)
-{
-    int i;
+    if (cpu_physical_memory_read(addr, (uint8_t *)buf, num * sizeof(*buf)))
+        return 0;
 
-    for (i = 0; i < num; i++, buf++, addr += sizeof(*buf)) {
-        if (cpu_physical_memory_rw(addr, (uint8_t *)buf, sizeof(*buf), 0))
-            return 0;
-        *buf = le16_to_cpu(*buf);
-    }
+    for (i = 0; i < num; i++)
+        buf[i] = le32_to_cpu(buf[i]);
 
     return 1;
 }
@@ -353,29 +439,14 @@ static inline int get_words(uint32_t addr, uint16_t *buf, int num)
 /* Put an array of dwords in to main memory */
 static inline int put_dwords(uint32_t addr, uint32_t *buf, int num)
 {
+    uint32_t tmp[8];
     int i;
 
-    for (i = 0; i < num; i++, buf++, addr += sizeof(*buf)) {
-        uint32_t tmp = cpu_to_le32(*buf);
-        if (cpu_physical_memory_rw(addr, (uint8_t *)&tmp, sizeof(tmp), 1))
-            return 0;
-    }
+    assert(num <= (int)countof(tmp));
+    for (i = 0; i < num; i++)
+        tmp[i] = cpu_to_le32(buf[i]);
 
-    return 1;
-}
-
-/* Put an array of dwords in to main memory */
-static inline int put_words(uint32_t addr, uint16_t *buf, int num)
-{
-    int i;
-
-    for (i = 0; i < num; i++, buf++, addr += sizeof(*buf)) {
-        uint16_t tmp = cpu_to_le16(*buf);
-        if (cpu_physical_memory_rw(addr, (uint8_t *)&tmp, sizeof(tmp), 1))
-            return 0;
-    }
-
-    return 1;
+    return !cpu_physical_memory_write(addr, (uint8_t *)tmp, num * sizeof(*tmp));
 }
 
 static inline int ohci_read_ed(OHCIState *ohci, uint32_t addr, struct ohci_ed *ed)
@@ -388,10 +459,22 @@ static inline int ohci_read_td(OHCIState *ohci, uint32_t addr, struct ohci_td *t
     return get_dwords(addr, (uint32_t *)td, sizeof(*td) >> 2);
 }
 
+/* ISO TD is 4 dwords followed by 8 offset words, fetch all 32 bytes at once */
 static inline int ohci_read_iso_td(OHCIState *ohci, uint32_t addr, struct ohci_iso_td *td)
 {
-    return get_dwords(addr, (uint32_t *)td, 4) &&
-        get_words(addr + 16, td->offset, 8);
+    int i;
+
+    if (cpu_physical_memory_read(addr, (uint8_t *)td, sizeof(*td)))
+        return 0;
+
+    td->flags = le32_to_cpu(td->flags);
+    td->bp = le32_to_cpu(td->bp);
+    td->next = le32_to_cpu(td->next);
+    td->be = le32_to_cpu(td->be);
+    for (i = 0; i < 8; i++)
+        td->offset[i] = le16_to_cpu(td->offset[i]);
+
+    return 1;
 }
 
 static inline int ohci_put_ed(OHCIState *ohci, uint32_t addr, struct ohci_ed *ed)
@@ -411,8 +494,17 @@ static inline int ohci_put_td(OHCIState *ohci, uint32_t addr, struct ohci_td *td
 
 static inline int ohci_put_iso_td(OHCIState *ohci, uint32_t addr, struct ohci_iso_td *td)
 {
-    return put_dwords(addr, (uint32_t *)td, 4) &&
-        put_words(addr + 16, td->offset, 8);
+    struct ohci_iso_td tmp;
+    int i;
+
+    tmp.flags = cpu_to_le32(td->flags);
+    tmp.bp = cpu_to_le32(td->bp);
+    tmp.next = cpu_to_le32(td->next);
+    tmp.be = cpu_to_le32(td->be);
+    for (i = 0; i < 8; i++)
+        tmp.offset[i] = cpu_to_le16(td->offset[i]);
+
+    return !cpu_physical_memory_write(addr, (uint8_t *)&tmp, sizeof(tmp));
 }
 
 static inline int ohci_put_hcca(OHCIState *ohci,
@@ -463,14 +555,42 @@ static int ohci_copy_iso_td(OHCIState *ohci, uint32_t start_addr, uint32_t end_a
     return 0;
 }
 
+/* Point packet's iov straight at guest memory instead of copying through
+ * pkt->buf. Buffer continues from start_addr's page onto end_addr's page.
+ */
+static int ohci_map_td(OHCIState *ohci, OHCIPacket *pkt, uint32_t start_addr,
+                       uint32_t end_addr, uint32_t len, int write)
+{
+    uint32_t ptr, n;
+    void *buf;
+
+    ptr = start_addr;
+    n = 0x1000 - (ptr & 0xfff);
+    if (n > len)
+        n = len;
+    if (!(buf = cpu_physical_memory_map(ptr, n, write)))
+        return 1;
+    usb_packet_addbuf(&pkt->packet, buf, n);
+    pkt->mapped = true;
+    if (n == len)
+        return 0;
+    ptr = end_addr & ~0xfffu;
+    if (!(buf = cpu_physical_memory_map(ptr, len - n, write)))
+        return 1;
+    usb_packet_addbuf(&pkt->packet, buf, len - n);
+    return 0;
+}
+
 static void ohci_process_lists(OHCIState *ohci, int completion);
 
 static void ohci_async_complete_packet(USBPort *port, USBPacket *packet)
 {
-    OHCIState *ohci = CONTAINER_OF(packet, OHCIState, usb_packet);
+    OHCIState *ohci = (OHCIState *)port->opaque;
+    OHCIPacket *pkt = CONTAINER_OF(packet, OHCIPacket, packet);
 
     //trace_usb_ohci_async_complete();
-    ohci->async_complete = true;
+    assert(pkt >= ohci->packets && pkt < ohci->packets + OHCI_MAX_PACKETS);
+    pkt->complete = true;
     ohci_process_lists(ohci, 1);
 }
 
@@ -484,6 +604,8 @@ static int ohci_service_iso_td(OHCIState *ohci, struct ohci_ed *ed,
     const char *str = NULL;
     int pid;
     int ret;
+    bool mapped;
+    uint64_t start;
     int i;
     USBDevice *dev;
     USBEndpoint *ep;
@@ -494,9 +616,16 @@ static int ohci_service_iso_td(OHCIState *ohci, struct ohci_ed *ed,
     int frame_count;
     uint32_t start_offset, next_offset, end_offset = 0;
     uint32_t start_addr, end_addr;
+    OHCIPacket *pkt;
 
     addr = ed->head & OHCI_DPTR_MASK;
 
+    /* Previously submitted packet still in flight */
+    pkt = ohci_find_packet(ohci, addr);
+    if (pkt && !pkt->complete)
+        return 1;
+    completion = (pkt != NULL);
+
     if (!ohci_read_iso_td(ohci, addr, &iso_td)) {
         //trace_usb_ohci_iso_td_read_failed(addr);
         ohci_die(ohci);
@@ -621,19 +750,23 @@ static int ohci_service_iso_td(OHCIState *ohci, struct ohci_ed *ed,
     } else {
         len = end_addr - start_addr + 1;
     }
-    if (len > sizeof(ohci->usb_buf)) {
-        len = sizeof(ohci->usb_buf);
+    if (len > sizeof(pkt->buf)) {
+        len = sizeof(pkt->buf);
     }
 
-    if (len && dir != OHCI_TD_DIR_IN) {
-        if (ohci_copy_iso_td(ohci, start_addr, end_addr, ohci->usb_buf, len,
-                             DMA_DIRECTION_TO_DEVICE)) {
-            ohci_die(ohci);
+    if (!pkt) {
+        pkt = ohci_get_packet(ohci);
+        if (!pkt) {
+            /* all slots busy, try again next frame */
             return 1;
         }
     }
 
-    if (!completion) {
+    if (completion) {
+        pkt->td = 0;
+        pkt->complete = false;
+        ohci_stats_packet(&pkt->packet, 0);
+    } else {
         bool int_req = relative_frame_number == frame_count &&
                        OHCI_BM(iso_td.flags, TD_DI) == 0;
         dev = ohci_find_device(ohci, OHCI_BM(ed->flags, ED_FA));
@@ -642,27 +775,38 @@ static int ohci_service_iso_td(OHCIState *ohci, struct ohci_ed *ed,
             return 1;
         }
         ep = usb_ep_get(dev, pid, OHCI_BM(ed->flags, ED_EN));
-        usb_packet_setup(&ohci->usb_packet, pid, ep, 0, addr, false, int_req);
-        usb_packet_addbuf(&ohci->usb_packet, ohci->usb_buf, len);
-        usb_handle_packet(dev, &ohci->usb_packet);
-        if (ohci->usb_packet.status == USB_RET_ASYNC) {
+        usb_packet_setup(&pkt->packet, pid, ep, 0, addr, false, int_req);
+        if (len && ohci_map_td(ohci, pkt, start_addr, end_addr, len,
+                               dir == OHCI_TD_DIR_IN)) {
+            ohci_unmap_packet(pkt);
+            ohci_die(ohci);
+            return 1;
+        }
+        usb_stats.iso_tds++;
+        start = usb_stats_ns();
+        usb_handle_packet(dev, &pkt->packet);
+        ohci_stats_packet(&pkt->packet, usb_stats_ns() - start);
+        if (pkt->packet.status == USB_RET_ASYNC) {
             usb_device_flush_ep_queue(dev, ep);
+            pkt->td = addr;
             return 1;
         }
     }
-    if (ohci->usb_packet.status == USB_RET_SUCCESS) {
-        ret = ohci->usb_packet.actual_length;
+    if (pkt->packet.status == USB_RET_SUCCESS) {
+        ret = pkt->packet.actual_length;
     } else {
-        ret = ohci->usb_packet.status;
+        ret = pkt->packet.status;
     }
 
     //trace_usb_ohci_iso_td_so(start_offset, end_offset, start_addr, end_addr,
     //                         str, len, ret);
 
-    /* Writeback */
+    /* Writeback, mapped IN data is already in place */
+    mapped = pkt->mapped;
+    ohci_unmap_packet(pkt);
     if (dir == OHCI_TD_DIR_IN && ret >= 0 && ret <= len) {
         /* IN transfer succeeded */
-        if (ohci_copy_iso_td(ohci, start_addr, end_addr, ohci->usb_buf, ret,
+        if (!mapped && ohci_copy_iso_td(ohci, start_addr, end_addr, pkt->buf, ret,
                              DMA_DIRECTION_FROM_DEVICE)) {
             ohci_die(ohci);
             return 1;
@@ -739,6 +883,8 @@ static int ohci_service_td(OHCIState *ohci, struct ohci_ed *ed)
     const char *str = NULL;
     int pid;
     int ret;
+    bool mapped;
+    uint64_t start;
     int i;
     USBDevice *dev;
     USBEndpoint *ep;
@@ -746,14 +892,26 @@ static int ohci_service_td(OHCIState *ohci, struct ohci_ed *ed)
     uint32_t addr;
     int flag_r;
     int completion;
+    OHCIPacket *pkt;
 
     addr = ed->head & OHCI_DPTR_MASK;
     /* See if this TD has already been submitted to the device.  */
-    completion = (addr == ohci->async_td);
-    if (completion && !ohci->async_complete) {
+    pkt = ohci_find_packet(ohci, addr);
+    completion = (pkt != NULL);
+    if (completion && !pkt->complete) {
         //trace_usb_ohci_td_skip_async();
         return 1;
     }
+    if (!pkt) {
+        pkt = ohci_get_packet(ohci);
+        if (!pkt) {
+            /* Every slot has an async packet pending on some other
+               endpoint. Leave this TD for the next frame.
+            */
+            //trace_usb_ohci_td_too_many_pending();
+            return 1;
+        }
+    }
     if (!ohci_read_td(ohci, addr, &td)) {
         //trace_usb_ohci_td_read_error(addr);
         ohci_die(ohci);
@@ -799,8 +957,8 @@ static int ohci_service_td(OHCIState *ohci, struct ohci_ed *ed)
             }
             len = (td.be - td.cbp) + 1;
         }
-        if (len > sizeof(ohci->usb_buf)) {
-            len = sizeof(ohci->usb_buf);
+        if (len > sizeof(pkt->buf)) {
+            len = sizeof(pkt->buf);
         }
 
         pktlen = len;
@@ -810,64 +968,61 @@ static int ohci_service_td(OHCIState *ohci, struct ohci_ed *ed)
             if (pktlen > len) {
                 pktlen = len;
             }
-            if (!completion) {
-                if (ohci_copy_td(ohci, &td, ohci->usb_buf, pktlen,
-                                 DMA_DIRECTION_TO_DEVICE)) {
-                    ohci_die(ohci);
-                }
-            }
         }
     }
 
     flag_r = (td.flags & OHCI_TD_R) != 0;
     //trace_usb_ohci_td_pkt_hdr(addr, (int64_t)pktlen, (int64_t)len, str,
     //                          flag_r, td.cbp, td.be);
-    //ohci_td_pkt("OUT", ohci->usb_buf, pktlen);
+    //ohci_td_pkt("OUT", pkt->buf, pktlen);
 
     if (completion) {
-        ohci->async_td = 0;
-        ohci->async_complete = false;
+        pkt->td = 0;
+        pkt->complete = false;
+        ohci_stats_packet(&pkt->packet, 0);
     } else {
-        if (ohci->async_td) {
-            /* ??? The hardware should allow one active packet per
-               endpoint.  We only allow one active packet per controller.
-               This should be sufficient as long as devices respond in a
-               timely manner.
-            */
-            //trace_usb_ohci_td_too_many_pending();
-            return 1;
-        }
         dev = ohci_find_device(ohci, OHCI_BM(ed->flags, ED_FA));
         if (dev == NULL) {
             //trace_usb_ohci_td_dev_error();
             return 1;
         }
         ep = usb_ep_get(dev, pid, OHCI_BM(ed->flags, ED_EN));
-        usb_packet_setup(&ohci->usb_packet, pid, ep, 0, addr, !flag_r,
+        usb_packet_setup(&pkt->packet, pid, ep, 0, addr, !flag_r,
                          OHCI_BM(td.flags, TD_DI) == 0);
-        usb_packet_addbuf(&ohci->usb_packet, ohci->usb_buf, pktlen);
-        usb_handle_packet(dev, &ohci->usb_packet);
-        //trace_usb_ohci_td_packet_status(ohci->usb_packet.status);
+        if (pktlen && ohci_map_td(ohci, pkt, td.cbp, td.be, pktlen,
+                                  dir == OHCI_TD_DIR_IN)) {
+            ohci_unmap_packet(pkt);
+            ohci_die(ohci);
+            return 1;
+        }
+        usb_stats.tds++;
+        start = usb_stats_ns();
+        usb_handle_packet(dev, &pkt->packet);
+        ohci_stats_packet(&pkt->packet, usb_stats_ns() - start);
+        //trace_usb_ohci_td_packet_status(pkt->packet.status);
 
-        if (ohci->usb_packet.status == USB_RET_ASYNC) {
+        if (pkt->packet.status == USB_RET_ASYNC) {
             usb_device_flush_ep_queue(dev, ep);
-            ohci->async_td = addr;
+            pkt->td = addr;
             return 1;
         }
     }
-    if (ohci->usb_packet.status == USB_RET_SUCCESS) {
-        ret = ohci->usb_packet.actual_length;
+    if (pkt->packet.status == USB_RET_SUCCESS) {
+        ret = pkt->packet.actual_length;
     } else {
-        ret = ohci->usb_packet.status;
+        ret = pkt->packet.status;
     }
 
+    /* mapped IN data is already in place */
+    mapped = pkt->mapped;
+    ohci_unmap_packet(pkt);
     if (ret >= 0) {
         if (dir == OHCI_TD_DIR_IN) {
-            if (ohci_copy_td(ohci, &td, ohci->usb_buf, ret,
+            if (!mapped && ohci_copy_td(ohci, &td, pkt->buf, ret,
                              DMA_DIRECTION_FROM_DEVICE)) {
                 ohci_die(ohci);
             }
-            //ohci_td_pkt("IN", ohci->usb_buf, pktlen);
+            //ohci_td_pkt("IN", pkt->buf, pktlen);
         } else {
             ret = pktlen;
         }
@@ -969,18 +1124,18 @@ static int ohci_service_ed_list(OHCIState *ohci, uint32_t head, int completion)
             ohci_die(ohci);
             return 0;
         }
+        usb_stats.eds++;
 
         next_ed = ed.next & OHCI_DPTR_MASK;
 
         if ((ed.head & OHCI_ED_H) || (ed.flags & OHCI_ED_K)) {
-            uint32_t addr;
+            OHCIPacket *pkt;
             /* Cancel pending packets for ED that have been paused.  */
-            addr = ed.head & OHCI_DPTR_MASK;
-            if (ohci->async_td && addr == ohci->async_td) {
-                usb_cancel_packet(&ohci->usb_packet);
-                ohci->async_td = 0;
-                usb_device_ep_stopped(ohci->usb_packet.ep->dev,
-                                      ohci->usb_packet.ep);
+            pkt = ohci_find_packet(ohci, ed.head & OHCI_DPTR_MASK);
+            if (pkt) {
+                ohci_cancel_packet(pkt);
+                usb_device_ep_stopped(pkt->packet.ep->dev,
+                                      pkt->packet.ep);
             }
             continue;
         }
@@ -1050,6 +1205,13 @@ void ohci_frame_boundary(void *opaque)
 {
     OHCIState *ohci = (OHCIState *)opaque;
     struct ohci_hcca hcca;
+    uint32_t i;
+
+    /* Let devices complete packets finished in the background */
+    for (i = 0; i < ohci->num_ports; i++) {
+        if (ohci->rhport[i].port.dev)
+            usb_device_handle_frame(ohci->rhport[i].port.dev);
+    }
 
     cpu_physical_memory_read(ohci->hcca, (uint8_t *)&hcca, sizeof(hcca));
 
@@ -1069,10 +1231,7 @@ void ohci_frame_boundary(void *opaque)
 
     /* Cancel all pending packets if either of the lists has been disabled.  */
     if (ohci->old_ctl & (~ohci->ctl) & (OHCI_CTL_BLE | OHCI_CTL_CLE)) {
-        if (ohci->async_td) {
-            usb_cancel_packet(&ohci->usb_packet);
-            ohci->async_td = 0;
-        }
+        ohci_cancel_packets(ohci);
         OSDebugOut(TEXT("usb-ohci: stop endpoints\n"));
         ohci_stop_endpoints(ohci);
     }
@@ -1112,6 +1271,145 @@ void ohci_frame_boundary(void *opaque)
     ohci_put_hcca(ohci, &hcca);
 }
 
+/* Any periodic ED with TDs queued? Those would be retired by normal frame
+ * processing (ISO ones once their frame has passed) even with nothing
+ * attached. The 32 slots usually share the inner nodes of one interrupt
+ * tree, a slot's walk stops at the first ED an earlier slot already
+ * checked, so every ED is read once. More than 128 EDs counts as busy.
+ */
+static int ohci_periodic_pending(OHCIState *ohci)
+{
+    struct ohci_hcca hcca;
+    struct ohci_ed ed;
+    uint32_t visited[128];
+    int i, j, n = 0;
+
+    if (cpu_physical_memory_read(ohci->hcca, (uint8_t *)&hcca, sizeof(hcca.intr)))
+        return 1;
+
+    for (i = 0; i < 32; i++) {
+        uint32_t cur = le32_to_cpu(hcca.intr[i]);
+        while (cur) {
+            for (j = 0; j < n && visited[j] != cur; j++)
+                ;
+            if (j < n)
+                break;
+            if (n == (int)countof(visited) || !ohci_read_ed(ohci, cur, &ed))
+                return 1;
+            visited[n++] = cur;
+            if (!(ed.flags & OHCI_ED_K) && !(ed.head & OHCI_ED_H) &&
+                (ed.head & OHCI_DPTR_MASK) != (ed.tail & OHCI_DPTR_MASK))
+                return 1;
+            cur = ed.next & OHCI_DPTR_MASK;
+        }
+    }
+    return 0;
+}
+
+/* Check if frames can be skipped without walking the lists, ie. no list is
+ * enabled or there's nothing attached to talk to and no work queued that
+ * frame processing would retire. Re-evaluated on every USBasync so any
+ * HcControl/HcCommandStatus/port status write or attach drops back to
+ * normal frame processing.
+ */
+int ohci_bus_idle(OHCIState *ohci)
+{
+    int i;
+
+    if ((ohci->ctl & OHCI_CTL_HCFS) != OHCI_USB_OPERATIONAL)
+        return 0;
+
+    /* pending list disable needs ohci_frame_boundary to cancel packets */
+    if (ohci->old_ctl != ohci->ctl || ohci_packets_inflight(ohci))
+        return 0;
+
+    if (ohci->intr_status & OHCI_INTR_UE)
+        return 0;
+
+    /* done queue countdown isn't idle until it has been written back */
+    if (ohci->done_count != 7 &&
+        !(ohci->done_count == 0 && (ohci->intr_status & OHCI_INTR_WD)))
+        return 0;
+
+    if (!(ohci->ctl & (OHCI_CTL_PLE | OHCI_CTL_CLE | OHCI_CTL_BLE)))
+        return 1;
+
+    for (i = 0; i < ohci->num_ports; i++) {
+        if ((ohci->rhport[i].ctrl & OHCI_PORT_PES) && ohci->rhport[i].port.dev)
+            return 0;
+    }
+
+    /* filled lists are serviced (and CLF/BLF cleared) by a real frame */
+    if (((ohci->ctl & OHCI_CTL_CLE) && (ohci->status & OHCI_STATUS_CLF)) ||
+        ((ohci->ctl & OHCI_CTL_BLE) && (ohci->status & OHCI_STATUS_BLF)))
+        return 0;
+
+    if ((ohci->ctl & OHCI_CTL_PLE) && ohci_periodic_pending(ohci))
+        return 0;
+
+    return 1;
+}
+
+/* Move frame counter ahead and signal SOF for the last frame */
+static void ohci_advance_frames(OHCIState *ohci, int64_t frames)
+{
+    uint16_t frame;
+
+    ohci->frt = ohci->fit;
+    ohci->frame_number = (ohci->frame_number + frames) & 0xffff;
+
+    frame = cpu_to_le16(ohci->frame_number);
+    cpu_physical_memory_write(ohci->hcca + HCCA_WRITEBACK_OFFSET,
+        (uint8_t *)&frame, sizeof(frame));
+
+    ohci_sof(ohci);
+}
+
+/* Advance idle bus by number of frames in one step.
+ * Equivalent to calling ohci_frame_boundary 'frames' times while
+ * ohci_bus_idle() holds.
+ */
+void ohci_skip_frames(OHCIState *ohci, int64_t frames)
+{
+    if (frames <= 0)
+        return;
+
+    ohci_advance_frames(ohci, frames);
+}
+
+/* Advance a bus that may have work queued by number of frames in one step,
+ * to catch up after a host stall. Periodic and isochronous work of those
+ * frames and device frame handlers are dropped, lists are serviced again
+ * from the next frame. Done queue interrupt delay counts down as if the
+ * frames ran, so a due writeback happens on the next frame.
+ */
+void ohci_coalesce_frames(OHCIState *ohci, int64_t frames)
+{
+    if (frames <= 0)
+        return;
+
+    if (ohci->done_count != 7)
+        ohci->done_count = frames < ohci->done_count ? ohci->done_count - frames : 0;
+
+    ohci_advance_frames(ohci, frames);
+}
+
+/* Number of frames after the current one that need no processing
+ * besides advancing the frame counter, see ohci_skip_frames.
+ */
+int ohci_idle_frames(OHCIState *ohci)
+{
+    if (!ohci_bus_idle(ohci))
+        return 0;
+
+    /* next SOF raises an interrupt, later ones are no-op until it's acked */
+    if ((ohci->intr & OHCI_INTR_MIE) && (ohci->intr & OHCI_INTR_SF) &&
+        !(ohci->intr_status & OHCI_INTR_SF))
+        return 0;
+
+    return IDLE_FRAMES_MAX;
+}
+
 /* Start sending SOF tokens across the USB bus, lists are processed in
  * next frame
  */
@@ -1571,11 +1869,15 @@ void ohci_mem_write(OHCIState *ptr,uint32_t addr, uint32_t val)
 
 static void ohci_async_cancel_device(OHCIState *ohci, USBDevice *dev)
 {
-    if (ohci->async_td &&
-        usb_packet_is_inflight(&ohci->usb_packet) &&
-        ohci->usb_packet.ep->dev == dev) {
-        usb_cancel_packet(&ohci->usb_packet);
-        ohci->async_td = 0;
+    int i;
+
+    for (i = 0; i < OHCI_MAX_PACKETS; i++) {
+        OHCIPacket *pkt = &ohci->packets[i];
+        if (pkt->td &&
+            usb_packet_is_inflight(&pkt->packet) &&
+            pkt->packet.ep->dev == dev) {
+            ohci_cancel_packet(pkt);
+        }
     }
 }
 
@@ -1628,7 +1930,9 @@ OHCIState *ohci_create(uint32_t base, int ports)
     }
 
     ohci_hard_reset(ohci);
-    usb_packet_init (&ohci->usb_packet);
+    for (i = 0; i < OHCI_MAX_PACKETS; i++) {
+        usb_packet_init (&ohci->packets[i].packet);
+    }
 
 	return ohci;
 }
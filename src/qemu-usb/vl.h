@@ -83,4 +83,10 @@ inline int cpu_physical_memory_write(uint32_t addr,
 	return cpu_physical_memory_rw(addr, (uint8_t *)buf, len, 1);
 }
 
+/* Direct host pointer to guest memory range, NULL if it's not accessible.
+ * Range must not cross a page boundary, split it into several mappings.
+ */
+void *cpu_physical_memory_map(uint32_t addr, size_t len, int is_write);
+void cpu_physical_memory_unmap(void *buf, size_t len, int is_write);
+
 #endif /* VL_H */
@@ -0,0 +1,106 @@
+#include "freezestream.h"
+#include <cstring>
+#include <cassert>
+
+FreezeWriter::FreezeWriter(void *data, size_t capacity)
+	: m_data((uint8_t *)data)
+	, m_capacity(capacity)
+	, m_pos(0)
+	, m_section(0)
+	, m_overflow(false)
+{
+}
+
+void FreezeWriter::begin(uint32_t tag)
+{
+	m_section = m_pos;
+	put<uint32_t>(tag);
+	put<uint32_t>(0); // length, filled by end()
+}
+
+void FreezeWriter::end()
+{
+	assert(m_pos >= m_section + FREEZE_SECTION_HEADER_SIZE);
+	uint32_t len = (uint32_t)(m_pos - m_section - FREEZE_SECTION_HEADER_SIZE);
+	patch(m_section + sizeof(uint32_t), &len, sizeof(len));
+}
+
+void FreezeWriter::write(const void *src, size_t bytes)
+{
+	if (m_data)
+	{
+		if (m_pos + bytes > m_capacity)
+			m_overflow = true;
+		else
+			memcpy(m_data + m_pos, src, bytes);
+	}
+	m_pos += bytes;
+}
+
+void *FreezeWriter::reserve(size_t bytes)
+{
+	void *ptr = nullptr;
+	if (m_data)
+	{
+		if (m_pos + bytes > m_capacity)
+			m_overflow = true;
+		else
+			ptr = m_data + m_pos;
+	}
+	m_pos += bytes;
+	return ptr;
+}
+
+void FreezeWriter::patch(size_t offset, const void *src, size_t bytes)
+{
+	if (m_data && offset + bytes <= m_capacity)
+		memcpy(m_data + offset, src, bytes);
+}
+
+FreezeReader::FreezeReader()
+	: m_data(nullptr)
+	, m_size(0)
+	, m_pos(0)
+{
+}
+
+FreezeReader::FreezeReader(const void *data, size_t size)
+	: m_data((const uint8_t *)data)
+	, m_size(size)
+	, m_pos(0)
+{
+}
+
+bool FreezeReader::next(uint32_t &tag, FreezeReader &section)
+{
+	uint32_t len;
+
+	if (remaining() < FREEZE_SECTION_HEADER_SIZE)
+		return false;
+
+	if (!get(tag) || !get(len))
+		return false;
+	if (len > remaining())
+		return false;
+
+	section = FreezeReader(m_data + m_pos, len);
+	m_pos += len;
+	return true;
+}
+
+bool FreezeReader::read(void *dst, size_t bytes)
+{
+	if (bytes > remaining())
+		return false;
+	memcpy(dst, m_data + m_pos, bytes);
+	m_pos += bytes;
+	return true;
+}
+
+bool FreezeReader::skip(size_t bytes)
+{
+	if (bytes > remaining())
+		return false;
+	m_pos += bytes;
+	return true;
+}
@@ -0,0 +1,69 @@
+#ifndef FREEZESTREAM_H
+#define FREEZESTREAM_H
+#include <cstdint>
+#include <cstddef>
+
+// Save state is a list of tagged sections: [tag u32][length u32][payload].
+// Fields inside a section are appended in order, so loader can stop early
+// on a shorter (older) section and skip the unknown tail of a longer one.
+#define FREEZE_TAG(a, b, c, d) \
+	((uint32_t)(a) | ((uint32_t)(b) << 8) | ((uint32_t)(c) << 16) | ((uint32_t)(d) << 24))
+
+#define FREEZE_SECTION_HEADER_SIZE 8
+
+class FreezeWriter
+{
+public:
+	// data can be NULL to only count the bytes needed
+	FreezeWriter(void *data, size_t capacity);
+
+	void begin(uint32_t tag);
+	void end();
+
+	void write(const void *src, size_t bytes);
+	template<typename T>
+	void put(T value) { write(&value, sizeof(value)); }
+
+	// Advance by 'bytes' and return where caller should write them,
+	// NULL when only counting or out of space.
+	void *reserve(size_t bytes);
+
+	// overwrite previously written bytes
+	void patch(size_t offset, const void *src, size_t bytes);
+
+	size_t size() const { return m_pos; }
+	bool overflow() const { return m_overflow; }
+
+private:
+	uint8_t *m_data;
+	size_t m_capacity;
+	size_t m_pos;
+	size_t m_section; // start of currently open section's header
+	bool m_overflow;
+};
+
+class FreezeReader
+{
+public:
+	FreezeReader();
+	FreezeReader(const void *data, size_t size);
+
+	// Get next section, 'section' then reads just its payload
+	bool next(uint32_t &tag, FreezeReader &section);
+
+	// Returns false and leaves dst untouched if not enough data left
+	bool read(void *dst, size_t bytes);
+	template<typename T>
+	bool get(T &value) { return read(&value, sizeof(value)); }
+	bool skip(size_t bytes);
+
+	const uint8_t *data() const { return m_data + m_pos; }
+	size_t remaining() const { return m_size - m_pos; }
+
+private:
+	const uint8_t *m_data;
+	size_t m_size;
+	size_t m_pos;
+};
+
+#endif
@@ -0,0 +1,161 @@
+#include "lz4block.h"
+#include <cstring>
+#include <vector>
+
+#define MIN_MATCH 4
+#define LAST_LITERALS 5 // format requires block to end with literals
+#define MF_LIMIT 12     // no match starts this close to the end
+#define MAX_OFFSET 65535
+#define HASH_LOG 12
+
+static inline uint32_t read32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t hash32(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - HASH_LOG);
+}
+
+static uint8_t *put_length(uint8_t *op, size_t len)
+{
+	while (len >= 255)
+	{
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = (uint8_t)len;
+	return op;
+}
+
+size_t lz4_compress_bound(size_t size)
+{
+	return size + size / 255 + 16;
+}
+
+static uint8_t *put_sequence(uint8_t *op, const uint8_t *lit, size_t lit_len,
+	size_t offset, size_t match_len)
+{
+	uint8_t *token = op++;
+
+	*token = (uint8_t)((lit_len >= 15 ? 15 : lit_len) << 4);
+	if (lit_len >= 15)
+		op = put_length(op, lit_len - 15);
+	if (lit_len)
+		memcpy(op, lit, lit_len);
+	op += lit_len;
+
+	if (!match_len)
+		return op;
+
+	*op++ = (uint8_t)offset;
+	*op++ = (uint8_t)(offset >> 8);
+
+	match_len -= MIN_MATCH;
+	*token |= (uint8_t)(match_len >= 15 ? 15 : match_len);
+	if (match_len >= 15)
+		op = put_length(op, match_len - 15);
+	return op;
+}
+
+size_t lz4_compress(const uint8_t *src, size_t size, uint8_t *dst, size_t capacity)
+{
+	std::vector<int64_t> table(1 << HASH_LOG, -1);
+	size_t ip = 0, anchor = 0;
+	uint8_t *op = dst, *end = dst + capacity;
+
+	if (size > MF_LIMIT)
+	{
+		while (ip < size - MF_LIMIT)
+		{
+			uint32_t seq = read32(src + ip);
+			uint32_t h = hash32(seq);
+			int64_t ref = table[h];
+			size_t len, max_len;
+
+			table[h] = (int64_t)ip;
+			if (ref < 0 || ip - ref > MAX_OFFSET || read32(src + ref) != seq)
+			{
+				ip++;
+				continue;
+			}
+
+			max_len = size - LAST_LITERALS - ip;
+			for (len = MIN_MATCH; len < max_len && src[ref + len] == src[ip + len]; len++)
+				;
+
+			// worst case for sequence: token, lengths, literals, offset
+			if ((size_t)(end - op) < 1 + (ip - anchor) / 255 + 1 + (ip - anchor) + 2 + len / 255 + 1)
+				return 0;
+
+			op = put_sequence(op, src + anchor, ip - anchor, ip - (size_t)ref, len);
+			ip += len;
+			anchor = ip;
+		}
+	}
+
+	if ((size_t)(end - op) < 1 + (size - anchor) / 255 + 1 + (size - anchor))
+		return 0;
+	op = put_sequence(op, src + anchor, size - anchor, 0, 0);
+	return op - dst;
+}
+
+static bool get_length(const uint8_t *src, size_t src_size, size_t &ip, size_t &len)
+{
+	uint8_t b;
+	do
+	{
+		if (ip >= src_size)
+			return false;
+		b = src[ip++];
+		len += b;
+	} while (b == 255);
+	return true;
+}
+
+bool lz4_decompress(const uint8_t *src, size_t src_size, uint8_t *dst, size_t size)
+{
+	size_t ip = 0, op = 0;
+
+	while (ip < src_size)
+	{
+		uint8_t token = src[ip++];
+		size_t lit_len = token >> 4;
+		size_t match_len = token & 15;
+		size_t offset;
+
+		if (lit_len == 15 && !get_length(src, src_size, ip, lit_len))
+			return false;
+		if (lit_len > src_size - ip || lit_len > size - op)
+			return false;
+		if (lit_len)
+			memcpy(dst + op, src + ip, lit_len);
+		ip += lit_len;
+		op += lit_len;
+
+		if (ip == src_size) // last sequence
+			break;
+
+		if (src_size - ip < 2)
+			return false;
+		offset = src[ip] | (src[ip + 1] << 8);
+		ip += 2;
+		if (!offset || offset > op)
+			return false;
+
+		if (match_len == 15 && !get_length(src, src_size, ip, match_len))
+			return false;
+		match_len += MIN_MATCH;
+		if (match_len > size - op)
+			return false;
+
+		// may overlap with itself, byte by byte on purpose
+		for (size_t i = 0; i < match_len; i++, op++)
+			dst[op] = dst[op - offset];
+	}
+
+	return op == size;
+}
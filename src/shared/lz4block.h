@@ -0,0 +1,19 @@
+#ifndef LZ4BLOCK_H
+#define LZ4BLOCK_H
+#include <cstdint>
+#include <cstddef>
+
+// Minimal codec for the LZ4 block format: sequences of
+// [token][literal length ext][literals][offset u16][match length ext],
+// last sequence has literals only. Compressor is a fast single pass
+// greedy one, decoder checks every length and offset against the buffers.
+
+size_t lz4_compress_bound(size_t size);
+
+// Returns compressed size, 0 if it doesn't fit into capacity
+size_t lz4_compress(const uint8_t *src, size_t size, uint8_t *dst, size_t capacity);
+
+// Returns false on malformed stream or if it doesn't decode to exactly 'size' bytes
+bool lz4_decompress(const uint8_t *src, size_t src_size, uint8_t *dst, size_t size);
+
+#endif
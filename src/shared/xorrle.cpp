@@ -0,0 +1,136 @@
+#include "xorrle.h"
+#include <cstring>
+
+// Shorter unchanged runs are cheaper to just copy as part of the literal
+#define MIN_ZERO_RUN 8
+#define MAX_VARINT_SIZE 5
+
+static inline uint8_t xor_at(const uint8_t *base, const uint8_t *src, size_t i)
+{
+	return base ? base[i] ^ src[i] : src[i];
+}
+
+static size_t zero_run(const uint8_t *base, const uint8_t *src, size_t pos, size_t size, size_t limit)
+{
+	size_t i = pos;
+	uint64_t a, b = 0;
+
+	while (i + sizeof(a) <= size && i - pos < limit)
+	{
+		memcpy(&a, src + i, sizeof(a));
+		if (base)
+			memcpy(&b, base + i, sizeof(b));
+		if (a != b)
+			break;
+		i += sizeof(a);
+	}
+
+	while (i < size && i - pos < limit && !xor_at(base, src, i))
+		i++;
+
+	return i - pos;
+}
+
+static bool put_varint(uint8_t *dst, size_t capacity, size_t &pos, size_t value)
+{
+	do
+	{
+		if (pos >= capacity)
+			return false;
+		uint8_t b = value & 0x7F;
+		value >>= 7;
+		dst[pos++] = b | (value ? 0x80 : 0);
+	} while (value);
+	return true;
+}
+
+static bool get_varint(const uint8_t *src, size_t size, size_t &pos, size_t &value)
+{
+	value = 0;
+	for (int shift = 0; shift < MAX_VARINT_SIZE * 7; shift += 7)
+	{
+		if (pos >= size)
+			return false;
+		uint8_t b = src[pos++];
+		value |= (size_t)(b & 0x7F) << shift;
+		if (!(b & 0x80))
+			return true;
+	}
+	return false;
+}
+
+size_t xor_rle_bound(size_t size)
+{
+	// every token but the last two is preceded by at least MIN_ZERO_RUN unchanged bytes
+	return size + 2 * MAX_VARINT_SIZE * (size / MIN_ZERO_RUN + 2);
+}
+
+bool xor_rle_encode(const uint8_t *base, const uint8_t *src, size_t size,
+	uint8_t *dst, size_t capacity, size_t &written)
+{
+	size_t i = 0, out = 0;
+
+	while (i < size)
+	{
+		size_t zeros = zero_run(base, src, i, size, size);
+		i += zeros;
+
+		// literal ends at next long enough unchanged run or at the end
+		size_t start = i;
+		while (i < size)
+		{
+			if (xor_at(base, src, i))
+			{
+				i++;
+				continue;
+			}
+			size_t run = zero_run(base, src, i, size, MIN_ZERO_RUN);
+			if (run >= MIN_ZERO_RUN || i + run == size)
+				break;
+			i += run;
+		}
+
+		size_t lit = i - start;
+		if (!put_varint(dst, capacity, out, zeros) ||
+			!put_varint(dst, capacity, out, lit) ||
+			out + lit > capacity)
+			return false;
+
+		for (size_t k = 0; k < lit; k++)
+			dst[out + k] = xor_at(base, src, start + k);
+		out += lit;
+	}
+
+	written = out;
+	return true;
+}
+
+bool xor_rle_decode(const uint8_t *base, const uint8_t *src, size_t src_size,
+	uint8_t *dst, size_t size)
+{
+	size_t in = 0, i = 0;
+
+	while (in < src_size)
+	{
+		size_t zeros, lit;
+		if (!get_varint(src, src_size, in, zeros) ||
+			!get_varint(src, src_size, in, lit))
+			return false;
+
+		if (zeros > size - i)
+			return false;
+		if (base)
+			memcpy(dst + i, base + i, zeros);
+		else
+			memset(dst + i, 0, zeros);
+		i += zeros;
+
+		if (lit > size - i || lit > src_size - in)
+			return false;
+		for (size_t k = 0; k < lit; k++, i++)
+			dst[i] = base ? base[i] ^ src[in + k] : src[in + k];
+		in += lit;
+	}
+
+	return i == size;
+}
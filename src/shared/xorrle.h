@@ -0,0 +1,21 @@
+#ifndef XORRLE_H
+#define XORRLE_H
+#include <cstdint>
+#include <cstddef>
+
+// Delta of two equally sized buffers: src XOR base, with runs of unchanged
+// (zero) bytes collapsed. Stream is a list of
+// [varint unchanged count][varint literal count][literal bytes].
+// NULL base means an all-zero base, i.e. plain zero run compression.
+
+size_t xor_rle_bound(size_t size);
+
+// Returns false if output doesn't fit into capacity
+bool xor_rle_encode(const uint8_t *base, const uint8_t *src, size_t size,
+	uint8_t *dst, size_t capacity, size_t &written);
+
+// Returns false on malformed stream or if it doesn't decode to exactly 'size' bytes
+bool xor_rle_decode(const uint8_t *base, const uint8_t *src, size_t src_size,
+	uint8_t *dst, size_t size);
+
+#endif
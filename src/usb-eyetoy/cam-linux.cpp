@@ -12,11 +12,15 @@
 #include <unistd.h>
 
 #include <linux/videodev2.h>
+#include <algorithm>
+#include <atomic>
 
 #include "gtk.h"
 
 #include "cam-linux.h"
 #include "usb-eyetoy-webcam.h"
+#include "framebuffer.h"
+#include "mpegencoder.h"
 #include "jpgd/jpgd.h"
 #include "jo_mpeg/jo_mpeg.h"
 
@@ -36,9 +40,28 @@ static int           fd = -1;
 buffer_t             *buffers;
 static unsigned int  n_buffers;
 static unsigned int  pixelformat;
-
-buffer_t             mpeg_buffer;
-std::mutex           mpeg_mutex;
+static int           capture_width;
+static int           capture_height;
+static int           capture_stride;
+
+// Frame size the game asked for, the camera mode may be bigger and gets
+// cropped and scaled down while encoding. SetSize() only posts the request
+// (width << 16 | height), the capture thread applies it between frames.
+static std::atomic<uint32_t> requested_size(320 << 16 | 240);
+static int           frame_width = 320;
+static int           frame_height = 240;
+
+static FrameBuffer   mpeg_frames;
+static MpegEncoder   mpeg_encoder;
+
+// Set up once in Open(), steady state capture doesn't allocate: the JPEG
+// decoder keeps its memory between frames, decoded RGB goes to a fixed
+// buffer and MPEG is encoded straight into mpeg_frames.
+static struct {
+	jpgd::jpeg_decoder            jpeg;
+	jpgd::jpeg_decoder_mem_stream jpeg_src;
+	std::vector<unsigned char>    rgb;
+} capture;
 
 static int xioctl(int fh, unsigned long int request, void *arg) {
 	int r;
@@ -48,27 +71,20 @@ static int xioctl(int fh, unsigned long int request, void *arg) {
 	return r;
 }
 
-static void store_mpeg_frame(unsigned char *data, unsigned int len) {
-	mpeg_mutex.lock();
-	memcpy(mpeg_buffer.start, data, len);
-	mpeg_buffer.length = len;
-	mpeg_mutex.unlock();
-}
-
 static void process_image(const unsigned char *ptr, int size) {
 	if (pixelformat == V4L2_PIX_FMT_YUYV) {
-		unsigned char *mpegData = (unsigned char*) calloc(1, 320 * 240 * 2);
-		int mpegLen = jo_write_mpeg(mpegData, ptr, 320, 240, JO_YUYV, JO_FLIP_X, JO_NONE);
-		store_mpeg_frame(mpegData, mpegLen);
-		free(mpegData);
+		int mpegLen = mpeg_encoder.Encode(mpeg_frames.Back(), ptr, capture_width, capture_height, capture_stride,
+				frame_width, frame_height, JO_YUYV, JO_FLIP_X, JO_NONE);
+		mpeg_frames.Publish(mpegLen, frame_width, frame_height);
 	} else if (pixelformat == V4L2_PIX_FMT_JPEG) {
 		int width, height, actual_comps;
-		unsigned char *rgbData = jpgd::decompress_jpeg_image_from_memory(ptr, size, &width, &height, &actual_comps, 3);
-		unsigned char *mpegData = (unsigned char*) calloc(1, 320 * 240 * 2);
-		int mpegLen = jo_write_mpeg(mpegData, rgbData, 320, 240, JO_RGB24, JO_FLIP_X, JO_NONE);
-		free(rgbData);
-		store_mpeg_frame(mpegData, mpegLen);
-		free(mpegData);
+		capture.jpeg_src.open(ptr, size);
+		if (!jpgd::decompress_jpeg_image_into(&capture.jpeg, &capture.jpeg_src, capture.rgb.data(), capture.rgb.size(),
+				&width, &height, &actual_comps, 3) || width != capture_width || height != capture_height)
+			return;
+		int mpegLen = mpeg_encoder.Encode(mpeg_frames.Back(), capture.rgb.data(), width, height, 0,
+				frame_width, frame_height, JO_RGB24, JO_FLIP_X, JO_NONE);
+		mpeg_frames.Publish(mpegLen, frame_width, frame_height);
 	} else {
 		fprintf(stderr, "unk format %c%c%c%c\n", pixelformat, pixelformat>>8, pixelformat>>16, pixelformat>>24);
 	}
@@ -126,96 +142,106 @@ std::vector<std::string> getDevList() {
 	return devList;
 }
 
-static int v4l_open(std::string selectedDevice) {
-	char dev_name[64];
-	struct v4l2_capability cap;
-
-	fd = -1;
-	for (int index = 0; index < 64; index++) {
-		snprintf(dev_name, sizeof(dev_name), "/dev/video%d", index);
-
-		if ((fd = open(dev_name, O_RDWR | O_NONBLOCK, 0)) < 0) {
-			continue;
-		}
-
-		CLEAR(cap);
-		if(ioctl(fd, VIDIOC_QUERYCAP, &cap) >= 0) {
-			fprintf(stderr, "Camera: %s / %s\n", dev_name, (char*)cap.card);
-			if (!selectedDevice.empty() && strcmp(selectedDevice.c_str(), (char*)cap.card) == 0) {
-				goto cont;
-			}
-		}
-
-		close(fd);
-		fd = -1;
-	}
-
-	if (fd < 0) {
-		snprintf(dev_name, sizeof(dev_name), "/dev/video0");
-		fd = open(dev_name, O_RDWR | O_NONBLOCK, 0);
-		if (-1 == fd) {
-			fprintf(stderr, "Cannot open '%s': %d, %s\n", dev_name, errno, strerror(errno));
-			return -1;
-		}
-	}
-
-cont:
+// Is w x h a better camera mode than best_w x best_h to get a width x height
+// frame from: the smallest that covers it, else the biggest there is.
+static bool v4l_better_size(int w, int h, int best_w, int best_h, int width, int height) {
+	bool covers = w >= width && h >= height;
+	bool best_covers = best_w >= width && best_h >= height;
+	if (covers != best_covers)
+		return covers;
+	return covers ? w * h < best_w * best_h : w * h > best_w * best_h;
+}
 
-	CLEAR(cap);
-	if (-1 == xioctl(fd, VIDIOC_QUERYCAP, &cap)) {
-		if (EINVAL == errno) {
-			fprintf(stderr, "%s is no V4L2 device\n", dev_name);
-			return -1;
+// Best frame size for width x height the camera offers in given format,
+// 0x0 if it offers none.
+static void v4l_best_size(unsigned int format, int width, int height, int &best_width, int &best_height) {
+	struct v4l2_frmsizeenum size;
+	best_width = best_height = 0;
+
+	CLEAR(size);
+	size.pixel_format = format;
+	for (size.index = 0; xioctl(fd, VIDIOC_ENUM_FRAMESIZES, &size) == 0; size.index++) {
+		int w, h;
+		if (size.type == V4L2_FRMSIZE_TYPE_DISCRETE) {
+			w = size.discrete.width;
+			h = size.discrete.height;
 		} else {
-			fprintf(stderr, "%s error %d, %s\n", "VIDIOC_QUERYCAP", errno, strerror(errno));
-			return -1;
+			// stepwise/continuous: smallest step at or above the target, within limits
+			const struct v4l2_frmsize_stepwise &sw = size.stepwise;
+			int step_w = sw.step_width ? sw.step_width : 1;
+			int step_h = sw.step_height ? sw.step_height : 1;
+			w = std::max<int>(width, sw.min_width);
+			h = std::max<int>(height, sw.min_height);
+			w = std::min<int>(sw.min_width + (w - sw.min_width + step_w - 1) / step_w * step_w, sw.max_width);
+			h = std::min<int>(sw.min_height + (h - sw.min_height + step_h - 1) / step_h * step_h, sw.max_height);
 		}
-	}
 
-	if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE)) {
-		fprintf(stderr, "%s is no video capture device\n", dev_name);
-		return -1;
-	}
+		if (!best_width || v4l_better_size(w, h, best_width, best_height, width, height)) {
+			best_width = w;
+			best_height = h;
+		}
 
-	if (!(cap.capabilities & V4L2_CAP_STREAMING)) {
-		fprintf(stderr, "%s does not support streaming i/o\n", dev_name);
-		return -1;
+		if (size.type != V4L2_FRMSIZE_TYPE_DISCRETE)
+			break;
 	}
+}
 
-	struct v4l2_cropcap cropcap;
-	CLEAR(cropcap);
-	cropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+// Picks the cheapest native mode to get a width x height frame from: the
+// smallest frame size that covers it (anything bigger is just more to
+// convert), YUYV over JPEG on a tie since it needs no decoding. Without
+// enumeration support, asks the driver for YUYV at the target size.
+static void v4l_pick_format(int width, int height, struct v4l2_format &fmt) {
+	unsigned int best_format = V4L2_PIX_FMT_YUYV;
+	int best_width = width, best_height = height;
+	bool found = false;
+
+	struct v4l2_fmtdesc desc;
+	CLEAR(desc);
+	desc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	for (desc.index = 0; xioctl(fd, VIDIOC_ENUM_FMT, &desc) == 0; desc.index++) {
+		if (desc.pixelformat != V4L2_PIX_FMT_YUYV && desc.pixelformat != V4L2_PIX_FMT_JPEG)
+			continue;
 
-	if (0 == xioctl(fd, VIDIOC_CROPCAP, &cropcap)) {
-		struct v4l2_crop crop;
-		crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-		crop.c = cropcap.defrect;
+		int w, h;
+		v4l_best_size(desc.pixelformat, width, height, w, h);
+		if (!w || !h)
+			continue;
 
-		if (-1 == xioctl(fd, VIDIOC_S_CROP, &crop)) {
-			switch (errno) {
-			case EINVAL:
-				break;
-			default:
-				break;
-			}
+		if (!found || v4l_better_size(w, h, best_width, best_height, width, height)
+			|| (desc.pixelformat == V4L2_PIX_FMT_YUYV && !v4l_better_size(best_width, best_height, w, h, width, height))) {
+			best_format = desc.pixelformat;
+			best_width = w;
+			best_height = h;
+			found = true;
 		}
 	}
 
-	struct v4l2_format fmt;
 	CLEAR(fmt);
 	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	fmt.fmt.pix.width       = 320;
-	fmt.fmt.pix.height      = 240;
-	fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+	fmt.fmt.pix.width       = best_width;
+	fmt.fmt.pix.height      = best_height;
+	fmt.fmt.pix.pixelformat = best_format;
+}
+
+// Sets the camera mode, maps the buffers and starts streaming
+static int v4l_start(const struct v4l2_format &want) {
+	struct v4l2_format fmt = want;
+	buffers = NULL;
+	n_buffers = 0;
 
 	if (-1 == xioctl(fd, VIDIOC_S_FMT, &fmt)) {
 		fprintf(stderr, "%s error %d, %s\n", "VIDIOC_S_FMT", errno, strerror(errno));
 		return -1;
 	}
 	pixelformat = fmt.fmt.pix.pixelformat;
-	fprintf(stderr, "VIDIOC_S_FMT res=%dx%d, fmt=%c%c%c%c\n", fmt.fmt.pix.width, fmt.fmt.pix.height,
+	capture_width = fmt.fmt.pix.width;
+	capture_height = fmt.fmt.pix.height;
+	capture_stride = fmt.fmt.pix.bytesperline;
+	fprintf(stderr, "VIDIOC_S_FMT res=%dx%d, fmt=%c%c%c%c\n", capture_width, capture_height,
 		pixelformat, pixelformat>>8, pixelformat>>16, pixelformat>>24
 	);
+	if (pixelformat == V4L2_PIX_FMT_JPEG && capture.rgb.size() < (size_t)capture_width * capture_height * 3)
+		capture.rgb.resize(capture_width * capture_height * 3);
 
 	struct v4l2_requestbuffers req;
 	CLEAR(req);
@@ -225,7 +251,7 @@ cont:
 
 	if (-1 == xioctl(fd, VIDIOC_REQBUFS, &req)) {
 		if (EINVAL == errno) {
-			fprintf(stderr, "%s does not support memory mapping\n", dev_name);
+			fprintf(stderr, "Camera does not support memory mapping\n");
 			return -1;
 		} else {
 			fprintf(stderr, "%s error %d, %s\n", "VIDIOC_REQBUFS", errno, strerror(errno));
@@ -234,7 +260,7 @@ cont:
 	}
 
 	if (req.count < 2) {
-		fprintf(stderr, "Insufficient buffer memory on %s\n", dev_name);
+		fprintf(stderr, "Insufficient buffer memory for camera\n");
 		return -1;
 	}
 
@@ -289,9 +315,150 @@ cont:
 	return 0;
 }
 
+// Undoes v4l_start(), also after it failed half way
+static void v4l_stop() {
+	enum v4l2_buf_type type;
+	type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	if (-1 == xioctl(fd, VIDIOC_STREAMOFF, &type))
+		fprintf(stderr, "%s error %d, %s\n", "VIDIOC_STREAMOFF", errno, strerror(errno));
+
+	for (unsigned int i = 0; i < n_buffers; ++i) {
+		if (-1 == munmap(buffers[i].start, buffers[i].length))
+			fprintf(stderr, "%s error %d, %s\n", "munmap", errno, strerror(errno));
+	}
+	free(buffers);
+	buffers = NULL;
+	n_buffers = 0;
+
+	// release the driver's buffers too, S_FMT fails while they're allocated
+	struct v4l2_requestbuffers req;
+	CLEAR(req);
+	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	req.memory = V4L2_MEMORY_MMAP;
+	xioctl(fd, VIDIOC_REQBUFS, &req);
+}
+
+static int v4l_open(std::string selectedDevice) {
+	char dev_name[64];
+	struct v4l2_capability cap;
+
+	fd = -1;
+	for (int index = 0; index < 64; index++) {
+		snprintf(dev_name, sizeof(dev_name), "/dev/video%d", index);
+
+		if ((fd = open(dev_name, O_RDWR | O_NONBLOCK, 0)) < 0) {
+			continue;
+		}
+
+		CLEAR(cap);
+		if(ioctl(fd, VIDIOC_QUERYCAP, &cap) >= 0) {
+			fprintf(stderr, "Camera: %s / %s\n", dev_name, (char*)cap.card);
+			if (!selectedDevice.empty() && strcmp(selectedDevice.c_str(), (char*)cap.card) == 0) {
+				goto cont;
+			}
+		}
+
+		close(fd);
+		fd = -1;
+	}
+
+	if (fd < 0) {
+		snprintf(dev_name, sizeof(dev_name), "/dev/video0");
+		fd = open(dev_name, O_RDWR | O_NONBLOCK, 0);
+		if (-1 == fd) {
+			fprintf(stderr, "Cannot open '%s': %d, %s\n", dev_name, errno, strerror(errno));
+			return -1;
+		}
+	}
+
+cont:
+
+	CLEAR(cap);
+	if (-1 == xioctl(fd, VIDIOC_QUERYCAP, &cap)) {
+		if (EINVAL == errno) {
+			fprintf(stderr, "%s is no V4L2 device\n", dev_name);
+			return -1;
+		} else {
+			fprintf(stderr, "%s error %d, %s\n", "VIDIOC_QUERYCAP", errno, strerror(errno));
+			return -1;
+		}
+	}
+
+	if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE)) {
+		fprintf(stderr, "%s is no video capture device\n", dev_name);
+		return -1;
+	}
+
+	if (!(cap.capabilities & V4L2_CAP_STREAMING)) {
+		fprintf(stderr, "%s does not support streaming i/o\n", dev_name);
+		return -1;
+	}
+
+	struct v4l2_cropcap cropcap;
+	CLEAR(cropcap);
+	cropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+	if (0 == xioctl(fd, VIDIOC_CROPCAP, &cropcap)) {
+		struct v4l2_crop crop;
+		crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		crop.c = cropcap.defrect;
+
+		if (-1 == xioctl(fd, VIDIOC_S_CROP, &crop)) {
+			switch (errno) {
+			case EINVAL:
+				break;
+			default:
+				break;
+			}
+		}
+	}
+
+	struct v4l2_format fmt;
+	v4l_pick_format(frame_width, frame_height, fmt);
+	return v4l_start(fmt);
+}
+
+
+// Capture thread side of SetSize(). Switches the camera mode only if the new
+// frame size wants a different one, and goes back to the old mode if the
+// switch fails.
+static int v4l_apply_size() {
+	uint32_t size = requested_size.load();
+	int width = size >> 16, height = size & 0xFFFF;
+	if (width == frame_width && height == frame_height)
+		return 0;
+
+	struct v4l2_format fmt;
+	v4l_pick_format(width, height, fmt);
+	if (fmt.fmt.pix.pixelformat != pixelformat || (int)fmt.fmt.pix.width != capture_width
+		|| (int)fmt.fmt.pix.height != capture_height) {
+		struct v4l2_format old;
+		CLEAR(old);
+		old.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		old.fmt.pix.width       = capture_width;
+		old.fmt.pix.height      = capture_height;
+		old.fmt.pix.pixelformat = pixelformat;
+
+		v4l_stop();
+		if (v4l_start(fmt) != 0) {
+			fprintf(stderr, "Camera: cannot switch mode, keeping %dx%d\n", old.fmt.pix.width, old.fmt.pix.height);
+			v4l_stop();
+			if (v4l_start(old) != 0)
+				return -1;
+		}
+	}
+
+	fprintf(stderr, "EyeToy frame size %dx%d\n", width, height);
+	frame_width = width;
+	frame_height = height;
+	return 0;
+}
 
 static void* v4l_thread(void *arg) {
 	while(eyetoy_running) {
+		if (v4l_apply_size() != 0)
+			break;
+
 		for (;;) {
 			fd_set fds;
 
@@ -323,20 +490,7 @@ static void* v4l_thread(void *arg) {
 }
 
 static int v4l_close() {
-	enum v4l2_buf_type type;
-	type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	if (-1 == xioctl(fd, VIDIOC_STREAMOFF, &type)) {
-		fprintf(stderr, "%s error %d, %s\n", "VIDIOC_STREAMOFF", errno, strerror(errno));
-		return -1;
-	}
-
-	for (unsigned int i = 0; i < n_buffers; ++i) {
-		if (-1 == munmap(buffers[i].start, buffers[i].length)) {
-			fprintf(stderr, "%s error %d, %s\n", "munmap", errno, strerror(errno));
-			return -1;
-		}
-	}
-	free(buffers);
+	v4l_stop();
 
 	if (-1 == close(fd)) {
 		fprintf(stderr, "%s error %d, %s\n", "close", errno, strerror(errno));
@@ -351,7 +505,7 @@ void create_dummy_frame() {
 	const int height = 240;
 	const int bytesPerPixel = 3;
 
-	unsigned char *rgbData = (unsigned char*) calloc(1, width * height * bytesPerPixel);
+	unsigned char *rgbData = capture.rgb.data();
 	for (int y = 0; y < height; y++) {
 		for (int x = 0; x < width; x++) {
 			unsigned char *ptr = rgbData + (y*width+x) * bytesPerPixel;
@@ -360,29 +514,31 @@ void create_dummy_frame() {
 			ptr[2] = 255-y;
 		}
 	}
-	unsigned char *mpegData = (unsigned char*) calloc(1, width * height * bytesPerPixel);
-	int mpegLen = jo_write_mpeg(mpegData, rgbData, width, height, JO_RGB24, JO_NONE, JO_NONE);
-	free(rgbData);
-
-	store_mpeg_frame(mpegData, mpegLen);
-	free(mpegData);
+	int mpegLen = jo_write_mpeg_scaled(mpeg_frames.Back(), rgbData, width, height, 0,
+			frame_width, frame_height, JO_RGB24, JO_NONE, JO_NONE);
+	mpeg_frames.Publish(mpegLen, frame_width, frame_height);
 }
 
 int V4L2::Open() {
-	mpeg_buffer.start = calloc(1, 320 * 240 * 2);
-	create_dummy_frame();
+	// capture thread is the only producer, stop it before touching the buffers
 	if (eyetoy_running) {
 		eyetoy_running = 0;
 		pthread_join(eyetoy_thread, NULL);
 		v4l_close();
 	}
+	uint32_t size = requested_size.load();
+	frame_width = size >> 16;
+	frame_height = size & 0xFFFF;
+	mpeg_frames.Resize(640 * 480 * 2);
+	capture.rgb.resize(320 * 240 * 3);
+	create_dummy_frame();
 	std::string selectedDevice;
 	LoadSetting(EyeToyWebCamDevice::TypeName(), mPort, APINAME, N_DEVICE, selectedDevice);
 	if (v4l_open(selectedDevice) != 0)
 		return -1;
 
-	pthread_create(&eyetoy_thread, NULL, &v4l_thread, NULL);
 	eyetoy_running = 1;
+	pthread_create(&eyetoy_thread, NULL, &v4l_thread, NULL);
 	return 0;
 };
 
@@ -397,13 +553,17 @@ int V4L2::Close() {
 	return 0;
 };
 
-int V4L2::GetImage(uint8_t *buf, int len) {
-	mpeg_mutex.lock();
-	int len2 = mpeg_buffer.length;
-	if (len < mpeg_buffer.length) len2 = len;
-	memcpy(buf, mpeg_buffer.start, len2);
-	mpeg_mutex.unlock();
-	return len2;
+const uint8_t *V4L2::GetImage(size_t &len, int &width, int &height) {
+	return mpeg_frames.Acquire(len, width, height);
+};
+
+void V4L2::SetSize(int width, int height) {
+	if (width <= 0 || height <= 0)
+		return;
+	width = std::min(width, 640);
+	height = std::min(height, 480);
+	// picked up by the capture thread or the next Open()
+	requested_size = (uint32_t)width << 16 | height;
 };
 
 static void deviceChanged(GtkComboBox *widget, gpointer data) {
@@ -19,7 +19,8 @@ public:
 	~V4L2(){};
 	int Open();
 	int Close();
-	int GetImage(uint8_t *buf, int len);
+	const uint8_t *GetImage(size_t &len, int &width, int &height);
+	void SetSize(int width, int height);
 	int Reset() { return 0; };
 
 	static const TCHAR *Name() {
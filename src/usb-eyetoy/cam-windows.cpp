@@ -385,18 +385,12 @@ void DirectShow::Stop() {
 	if (FAILED(hr)) throw hr;
 }
 
-void DirectShow::store_mpeg_frame(const std::vector<unsigned char>& data) {
-	std::lock_guard<std::mutex> lk(mpeg_mutex);
-	mpeg_buffer = data;
-}
-
 void DirectShow::dshow_callback(unsigned char *data, int len, int bitsperpixel) {
 	if (bitsperpixel == 24) {
-		std::vector<unsigned char> mpegData (320 * 240 * 2);
-		int mpegLen = jo_write_mpeg(mpegData.data(), data, 320, 240, JO_RGB24, JO_FLIP_X, JO_FLIP_Y);
-		//OSDebugOut(_T("MPEG: alloced: %d, got: %d\n"), mpegData.size(), mpegLen);
-		mpegData.resize(mpegLen);
-		store_mpeg_frame(mpegData);
+		int width = frame_width, height = frame_height;
+		int mpegLen = mpeg_encoder.Encode(mpeg_frames.Back(), data, 320, 240, 0, width, height, JO_RGB24, JO_FLIP_X, JO_FLIP_Y);
+		//OSDebugOut(_T("MPEG: alloced: %d, got: %d\n"), mpeg_frames.Capacity(), mpegLen);
+		mpeg_frames.Publish(mpegLen, width, height);
 	} else {
 		fprintf(stderr, "dshow_callback: unk format: len=%d bpp=%d\n", len, bitsperpixel);
 	}
@@ -418,10 +412,9 @@ void DirectShow::create_dummy_frame() {
 		}
 	}
 
-	std::vector<unsigned char> mpegData (width * height * bytesPerPixel, 255);
-	int mpegLen = jo_write_mpeg(mpegData.data(), rgbData.data(), width, height, JO_RGB24, JO_NONE, JO_NONE);
-	mpegData.resize(mpegLen);
-	store_mpeg_frame(mpegData);
+	int mpegLen = jo_write_mpeg_scaled(mpeg_frames.Back(), rgbData.data(), width, height, 0,
+			frame_width, frame_height, JO_RGB24, JO_NONE, JO_NONE);
+	mpeg_frames.Publish(mpegLen, frame_width, frame_height);
 }
 
 DirectShow::DirectShow(int port) {
@@ -435,12 +428,13 @@ DirectShow::DirectShow(int port) {
 	pSourceConfig = NULL;
 	samplegrabber = NULL;
 	callbackhandler = new CallbackHandler(this);
+	frame_width = 320;
+	frame_height = 240;
 	CoInitialize(NULL);
 }
 
 int DirectShow::Open() {
-	mpeg_buffer.resize(320 * 240 * 2);
-	std::fill(mpeg_buffer.begin(), mpeg_buffer.end(), 0);
+	mpeg_frames.Resize(640 * 480 * 2);
 
 	create_dummy_frame();
 
@@ -478,18 +472,19 @@ int DirectShow::Close() {
 	pGraph->Release();
 	pControl->Release();
 
-	std::lock_guard<std::mutex>  lck(mpeg_mutex);
-	mpeg_buffer.resize(0);
-
 	return 0;
 };
 
-int DirectShow::GetImage(uint8_t *buf, int len) {
-	std::lock_guard<std::mutex>  lck(mpeg_mutex);
-	int len2 = mpeg_buffer.size();
-	if (len < mpeg_buffer.size()) len2 = len;
-	memcpy(buf, mpeg_buffer.data(), len2);
-	return len2;
+const uint8_t *DirectShow::GetImage(size_t &len, int &width, int &height) {
+	return mpeg_frames.Acquire(len, width, height);
+};
+
+void DirectShow::SetSize(int width, int height) {
+	if (width <= 0 || height <= 0)
+		return;
+	// capture stays at 320x240, frames are scaled to the requested size
+	frame_width = width < 640 ? width : 640;
+	frame_height = height < 480 ? height : 480;
 };
 
 BOOL CALLBACK DirectShowDlgProc(HWND hW, UINT uMsg, WPARAM wParam, LPARAM lParam) {
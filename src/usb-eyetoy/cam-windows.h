@@ -1,5 +1,6 @@
 #include "videodev.h"
-#include <mutex>
+#include "framebuffer.h"
+#include "mpegencoder.h"
 
 #pragma comment(lib, "strmiids")
 
@@ -63,7 +64,8 @@ public:
 	~DirectShow() {}
 	int Open();
 	int Close();
-	int GetImage(uint8_t *buf, int len);
+	const uint8_t *GetImage(size_t &len, int &width, int &height);
+	void SetSize(int width, int height);
 	int Reset() { return 0; };
 
 	static const TCHAR *Name() {
@@ -78,7 +80,6 @@ protected:
 	void Start();
 	void Stop();
 	int InitializeDevice(std::wstring selectedDevice);
-	void store_mpeg_frame(const std::vector<unsigned char>& data);
 	void create_dummy_frame();
 	void dshow_callback(unsigned char* data, int len, int bitsperpixel);
 
@@ -95,8 +96,10 @@ private:
 	ISampleGrabber *samplegrabber;
 	IBaseFilter *nullrenderer;
 
-	std::vector<unsigned char> mpeg_buffer{};
-	std::mutex mpeg_mutex;
+	FrameBuffer mpeg_frames;
+	MpegEncoder mpeg_encoder;
+	std::atomic<int> frame_width; // set by emulator, read by grabber callback
+	std::atomic<int> frame_height;
 
 	class CallbackHandler : public ISampleGrabberCB
 	{
@@ -0,0 +1,79 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+#include <atomic>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+namespace usb_eyetoy {
+
+// Lock-free triple buffer for encoded frames between one producer (capture
+// thread) and one consumer (emulator thread). Producer encodes straight into
+// Back() and Publish()es it, which swaps it with the middle slot. Consumer's
+// Acquire() swaps the middle slot in as the front one if a newer frame was
+// published since, otherwise keeps returning the current front frame.
+// Neither side ever waits for the other or copies a frame.
+class FrameBuffer
+{
+	FrameBuffer(const FrameBuffer&) = delete;
+	FrameBuffer& operator=(const FrameBuffer&) = delete;
+
+	static const int FRESH = 4; // middle slot holds a frame the consumer hasn't seen
+
+public:
+	FrameBuffer() : mBack(0), mMiddle(1), mFront(2) {}
+
+	// Not thread safe, call while no capture thread is running. Same size
+	// keeps the buffers, so a front frame held by the consumer stays valid.
+	void Resize(size_t capacity)
+	{
+		for (auto& f : mFrames)
+		{
+			f.data.resize(capacity);
+			f.length = 0;
+			f.width = f.height = 0;
+		}
+		mMiddle.store(mMiddle.load() & ~FRESH);
+	}
+
+	size_t Capacity() const { return mFrames[0].data.size(); }
+
+	// Producer side
+	uint8_t *Back() { return mFrames[mBack].data.data(); }
+
+	void Publish(size_t length, int width, int height)
+	{
+		mFrames[mBack].length = length;
+		mFrames[mBack].width = width;
+		mFrames[mBack].height = height;
+		mBack = mMiddle.exchange(mBack | FRESH, std::memory_order_acq_rel) & ~FRESH;
+	}
+
+	// Consumer side, frame stays valid and unchanged until the next Acquire()
+	const uint8_t *Acquire(size_t &length, int &width, int &height)
+	{
+		if (mMiddle.load(std::memory_order_relaxed) & FRESH)
+			mFront = mMiddle.exchange(mFront, std::memory_order_acq_rel) & ~FRESH;
+		length = mFrames[mFront].length;
+		width = mFrames[mFront].width;
+		height = mFrames[mFront].height;
+		return mFrames[mFront].data.data();
+	}
+
+private:
+	struct Frame
+	{
+		std::vector<uint8_t> data;
+		size_t length = 0;
+		int width = 0;
+		int height = 0;
+	};
+
+	Frame mFrames[3];
+	int mBack;                 // owned by producer
+	std::atomic<int> mMiddle;  // slot index | FRESH
+	int mFront;                // owned by consumer
+};
+
+} // namespace usb_eyetoy
+#endif
@@ -0,0 +1,98 @@
+#include "mpegencoder.h"
+#include <algorithm>
+
+namespace usb_eyetoy {
+
+static const unsigned MAX_SLICES = 4;
+
+MpegEncoder::~MpegEncoder()
+{
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mQuit = true;
+	}
+	mStartCv.notify_all();
+	for (auto& t : mThreads)
+		t.join();
+}
+
+void MpegEncoder::Start()
+{
+	// calling thread encodes slice 0, a worker each for the rest
+	unsigned slices = std::min(std::max(std::thread::hardware_concurrency(), 1u), MAX_SLICES);
+	mSlices.resize(slices);
+	mSliceData.resize(slices);
+	for (unsigned i = 1; i < slices; i++)
+		mThreads.emplace_back(&MpegEncoder::Worker, this, i);
+}
+
+void MpegEncoder::Worker(int slice)
+{
+	unsigned seen = 0;
+	std::unique_lock<std::mutex> lock(mMutex);
+	for (;;)
+	{
+		mStartCv.wait(lock, [&] { return mQuit || mGeneration != seen; });
+		if (mQuit)
+			return;
+		seen = mGeneration;
+
+		if (slice < mJob.slices)
+		{
+			lock.unlock();
+			EncodeSlice(slice);
+			lock.lock();
+		}
+		if (--mPending == 0)
+			mDoneCv.notify_one();
+	}
+}
+
+void MpegEncoder::EncodeSlice(int slice)
+{
+	const Job& j = mJob;
+	jo_write_mpeg_slice(&mSlices[slice], j.raw, j.src_width, j.src_height, j.src_stride,
+		j.width, j.height, j.format, j.flipx, j.flipy,
+		j.rows * slice / j.slices, j.rows * (slice + 1) / j.slices);
+}
+
+size_t MpegEncoder::Encode(uint8_t *mpeg_buf, const uint8_t *raw, int src_width, int src_height, int src_stride,
+	int width, int height, int format, int flipx, int flipy)
+{
+	if (mSlices.empty())
+		Start();
+
+	int rows = (height + 15) / 16;
+	int slices = std::min<int>(mSlices.size(), rows);
+	if (slices < 2)
+		return jo_write_mpeg_scaled(mpeg_buf, raw, src_width, src_height, src_stride, width, height, format, flipx, flipy);
+
+	if (width != mWidth || height != mHeight)
+	{
+		// same bound as the frame buffers, 2 bytes per pixel
+		size_t size = (size_t)((rows + mSlices.size() - 1) / mSlices.size() + 1) * ((width + 15) / 16) * 16 * 16 * 2;
+		for (size_t i = 0; i < mSlices.size(); i++)
+		{
+			mSliceData[i].resize(size);
+			mSlices[i].buf = mSliceData[i].data();
+		}
+		mWidth = width;
+		mHeight = height;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mJob = { raw, src_width, src_height, src_stride, width, height, format, flipx, flipy, rows, slices };
+		mPending = mThreads.size();
+		mGeneration++;
+	}
+	mStartCv.notify_all();
+
+	EncodeSlice(0);
+
+	std::unique_lock<std::mutex> lock(mMutex);
+	mDoneCv.wait(lock, [&] { return mPending == 0; });
+	return jo_join_mpeg_slices(mpeg_buf, mSlices.data(), slices);
+}
+
+} // namespace usb_eyetoy
@@ -0,0 +1,57 @@
+#ifndef MPEGENCODER_H
+#define MPEGENCODER_H
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include "jo_mpeg/jo_mpeg.h"
+
+namespace usb_eyetoy {
+
+// Encodes a frame as slices of macroblock rows on a few worker threads, the
+// calling thread does the first slice itself, then joins them. Same stream
+// as jo_write_mpeg_scaled(), just done sooner so the guest gets a fresher
+// frame. Workers start on first use, buffers only change with frame size.
+// One caller at a time.
+class MpegEncoder
+{
+	MpegEncoder(const MpegEncoder&) = delete;
+	MpegEncoder& operator=(const MpegEncoder&) = delete;
+
+public:
+	MpegEncoder() {}
+	~MpegEncoder();
+
+	size_t Encode(uint8_t *mpeg_buf, const uint8_t *raw, int src_width, int src_height, int src_stride,
+		int width, int height, int format, int flipx, int flipy);
+
+private:
+	void Start();
+	void Worker(int slice);
+	void EncodeSlice(int slice);
+
+	struct Job
+	{
+		const uint8_t *raw;
+		int src_width, src_height, src_stride;
+		int width, height, format, flipx, flipy;
+		int rows, slices;
+	} mJob = {};
+
+	std::vector<std::thread> mThreads;
+	std::vector<std::vector<uint8_t>> mSliceData;
+	std::vector<jo_mpeg_slice_t> mSlices;
+	int mWidth = 0, mHeight = 0; // frame size slice buffers are for
+
+	std::mutex mMutex;
+	std::condition_variable mStartCv;
+	std::condition_variable mDoneCv;
+	unsigned mGeneration = 0;
+	size_t mPending = 0;
+	bool mQuit = false;
+};
+
+} // namespace usb_eyetoy
+#endif
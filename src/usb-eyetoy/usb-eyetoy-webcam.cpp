@@ -44,9 +44,9 @@ typedef struct EYETOYState {
 	uint8_t i2c_regs[0xFF]; //OV764x
 
 	int frame_step;
-	unsigned char *mpeg_frame_data;
-	unsigned int   mpeg_frame_size;
-	unsigned int   mpeg_frame_offset;
+	const unsigned char *mpeg_frame_data; // owned by videodev, valid until next GetImage
+	size_t         mpeg_frame_size;
+	size_t         mpeg_frame_offset;
 	uint8_t alts[3];
 	uint8_t filter_log;
 //	} f;
@@ -355,8 +355,8 @@ static void eyetoy_handle_control(USBDevice *dev, USBPacket *p, int request, int
 			case OV519_R51_RESET1:
 				if (data[0] & 0x8)
 				{
-					// reset video FIFO
-					//s->videodev->SetSize(s->regs[OV519_R10_H_SIZE] << 4, s->regs[OV519_R11_V_SIZE] << 3);
+					// reset video FIFO, frame size takes effect here
+					s->videodev->SetSize(s->regs[OV519_R10_H_SIZE] << 4, s->regs[OV519_R11_V_SIZE] << 3);
 				}
 				break;
 			case OV519_R10_H_SIZE:
@@ -431,7 +431,8 @@ static void eyetoy_handle_data(USBDevice *dev, USBPacket *p)
 
 			if (s->frame_step == 0) {
 
-				s->mpeg_frame_size = s->videodev->GetImage(s->mpeg_frame_data, 320 * 240 * 2);
+				int frame_width, frame_height;
+				s->mpeg_frame_data = s->videodev->GetImage(s->mpeg_frame_size, frame_width, frame_height);
 				if (s->mpeg_frame_size == 0) {
 					goto send_packet;
 				}
@@ -445,6 +446,10 @@ static void eyetoy_handle_data(USBDevice *dev, USBPacket *p)
 					0x69, 0x70, 0x75, 0x6D, 0x00, 0x00, 0x00, 0x00, 0x40, 0x01, 0xF0, 0x00, 0x01, 0x00, 0x00, 0x00,
 					0x00
 				};
+				header2[8]  = frame_width & 0xFF;
+				header2[9]  = frame_width >> 8;
+				header2[10] = frame_height & 0xFF;
+				header2[11] = frame_height >> 8;
 				memcpy(data + sizeof(header1), header2, sizeof(header2));
 				
 				int data_pk = max_ep_size - sizeof(header1) - sizeof(header2);
@@ -554,7 +559,8 @@ USBDevice *EyeToyWebCamDevice::CreateDevice(int port)
 
 	reset_i2c(s);
 	s->frame_step = 0;
-	s->mpeg_frame_data = (unsigned char *) calloc(1, 320 * 240 * 4); // TODO: 640x480 ?
+	s->mpeg_frame_data = nullptr;
+	s->mpeg_frame_size = 0;
 	s->mpeg_frame_offset = 0;
 	s->regs[OV519_R10_H_SIZE] = 320>>4;
 	s->regs[OV519_R11_V_SIZE] = 240>>3;
@@ -11,7 +11,10 @@ public:
 	virtual ~VideoDevice() {}
 	virtual int Open() = 0;
 	virtual int Close() = 0;
-	virtual int GetImage(uint8_t *buf, int len) = 0;
+	// Latest encoded frame and its size, stays valid and unchanged until the next call
+	virtual const uint8_t *GetImage(size_t &len, int &width, int &height) = 0;
+	// Output frame size requested by the game, up to 640x480
+	virtual void SetSize(int width, int height) = 0;
 	virtual int Reset() = 0;
 
 	virtual int Port() { return mPort; }
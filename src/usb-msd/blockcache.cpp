@@ -0,0 +1,81 @@
+#include "blockcache.h"
+#include <cstring>
+#include <algorithm>
+
+namespace usb_msd {
+
+void BlockCache::resize(size_t block_size, size_t capacity)
+{
+	m_block_size = block_size;
+	m_capacity = capacity;
+	m_storage.assign(block_size * capacity, 0);
+	m_storage.shrink_to_fit();
+	clear();
+}
+
+void BlockCache::clear()
+{
+	m_lru.clear();
+	m_index.clear();
+	m_free.clear();
+	for (size_t i = 0; i < m_capacity; i++)
+		m_free.push_back(m_storage.data() + i * m_block_size);
+}
+
+uint8_t* BlockCache::lookup(int64_t block)
+{
+	auto it = m_index.find(block);
+	if (it == m_index.end())
+		return nullptr;
+
+	m_lru.splice(m_lru.begin(), m_lru, it->second);
+	return it->second->data;
+}
+
+uint8_t* BlockCache::insert(int64_t block)
+{
+	uint8_t *data;
+
+	if (!m_capacity || contains(block))
+		return nullptr;
+
+	if (m_free.empty())
+	{
+		Entry& old = m_lru.back();
+		data = old.data;
+		m_index.erase(old.block);
+		m_lru.pop_back();
+	}
+	else
+	{
+		data = m_free.back();
+		m_free.pop_back();
+	}
+
+	m_lru.push_front(Entry{ block, data });
+	m_index[block] = m_lru.begin();
+	return data;
+}
+
+void BlockCache::update(int64_t offset, const uint8_t *src, size_t len)
+{
+	if (!m_capacity)
+		return;
+
+	while (len)
+	{
+		int64_t block = offset / m_block_size;
+		size_t off = (size_t)(offset % m_block_size);
+		size_t n = std::min(len, m_block_size - off);
+
+		auto it = m_index.find(block);
+		if (it != m_index.end())
+			memcpy(it->second->data + off, src, n);
+
+		offset += n;
+		src += n;
+		len -= n;
+	}
+}
+
+} //namespace
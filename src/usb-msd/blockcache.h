@@ -0,0 +1,53 @@
+#ifndef USBMSD_BLOCKCACHE_H
+#define USBMSD_BLOCKCACHE_H
+#include <cstdint>
+#include <cstddef>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+namespace usb_msd {
+
+// Fixed size LRU cache of image blocks, storage is allocated once by resize().
+class BlockCache
+{
+public:
+	BlockCache() : m_block_size(0), m_capacity(0) {}
+
+	// Drops all blocks, capacity 0 disables the cache
+	void resize(size_t block_size, size_t capacity);
+	void clear();
+
+	// Block data or NULL, found block becomes most recently used
+	uint8_t* lookup(int64_t block);
+	bool contains(int64_t block) const { return m_index.count(block) != 0; }
+
+	// Storage for a new block, evicting least recently used one if full.
+	// NULL if block is already cached, cached copy is as new or newer.
+	uint8_t* insert(int64_t block);
+
+	// Copy written data into cached blocks it overlaps
+	void update(int64_t offset, const uint8_t *src, size_t len);
+
+	size_t block_size() const { return m_block_size; }
+	size_t capacity() const { return m_capacity; }
+	size_t size() const { return m_lru.size(); }
+
+private:
+	struct Entry
+	{
+		int64_t block;
+		uint8_t *data;
+	};
+	typedef std::list<Entry> EntryList;
+
+	size_t m_block_size;
+	size_t m_capacity;
+	std::vector<uint8_t> m_storage;
+	std::vector<uint8_t *> m_free;
+	EntryList m_lru; // front is most recently used
+	std::unordered_map<int64_t, EntryList::iterator> m_index;
+};
+
+} //namespace
+#endif
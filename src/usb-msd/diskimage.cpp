@@ -0,0 +1,575 @@
+#include "diskimage.h"
+#include "../shared/lz4block.h"
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <sys/stat.h>
+#if defined(_WIN32)
+#include <io.h>
+#include <winioctl.h>
+#else
+#include <unistd.h>
+#include <sys/uio.h>
+#endif
+
+namespace usb_msd {
+
+#define OVERLAY_MAGIC "USBMSDOV"
+#define OVERLAY_VERSION 1
+#define OVERLAY_CLUSTER_SIZE 4096
+
+#define COMPRESSED_MAGIC "USBMSDCZ"
+#define COMPRESSED_VERSION 1
+#define COMPRESSED_MAX_CHUNK (16 * 1024 * 1024)
+
+struct CompressedHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t chunk_size;
+	int64_t size; // logical size, what READ_CAPACITY reports
+	uint64_t chunks;
+};
+
+struct OverlayHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t cluster_size;
+	int64_t size; // of base image overlay was created for
+	int64_t bitmap_offset;
+	int64_t data_offset;
+};
+
+int64_t get_file_size(FILE *file)
+{
+	int fd;
+
+#if defined(_WIN32)
+	struct _stat64 buf;
+	fd = _fileno(file);
+	if (_fstat64(fd, &buf) != 0)
+		return -1;
+	return buf.st_size;
+#elif defined(__GNUC__)
+	struct stat64 buf;
+	fd = fileno(file);
+	if (fstat64(fd, &buf) != 0)
+		return -1;
+	return buf.st_size;
+#else
+	#error Unknown platform
+#endif
+}
+
+static bool file_read(FILE *file, int64_t offset, void *dst, size_t len)
+{
+	return !fseeko64(file, offset, SEEK_SET) && fread(dst, 1, len, file) == len;
+}
+
+static bool file_write(FILE *file, int64_t offset, const void *src, size_t len)
+{
+	return !fseeko64(file, offset, SEEK_SET) && fwrite(src, 1, len, file) == len;
+}
+
+bool DiskImage::readv(int64_t offset, const struct iovec *iov, int cnt)
+{
+	for (int i = 0; i < cnt; i++)
+	{
+		if (!read(offset, (uint8_t *)iov[i].iov_base, iov[i].iov_len))
+			return false;
+		offset += iov[i].iov_len;
+	}
+	return true;
+}
+
+bool DiskImage::writev(int64_t offset, const struct iovec *iov, int cnt)
+{
+	for (int i = 0; i < cnt; i++)
+	{
+		if (!write(offset, (const uint8_t *)iov[i].iov_base, iov[i].iov_len))
+			return false;
+		offset += iov[i].iov_len;
+	}
+	return true;
+}
+
+DiskImage* DiskImage::Open(const TSTDSTRING& path, bool writable)
+{
+	FILE *file = nullptr;
+	bool read_only = !writable;
+
+	if (writable)
+		file = wfopen(path.c_str(), TEXT("r+b"));
+	if (!file)
+	{
+		file = wfopen(path.c_str(), TEXT("rb"));
+		read_only = true;
+	}
+	if (!file)
+		return nullptr;
+
+	if (CompressedImage::IsCompressed(file))
+		return CompressedImage::Open(file);
+	return new RawImage(file, read_only);
+}
+
+RawImage::RawImage(FILE *file, bool read_only)
+	: m_file(file)
+	, m_size(get_file_size(file))
+	, m_read_only(read_only)
+{
+}
+
+RawImage::~RawImage()
+{
+	fclose(m_file);
+}
+
+#if defined(_WIN32)
+bool RawImage::read(int64_t offset, uint8_t *dst, size_t len)
+{
+	return file_read(m_file, offset, dst, len);
+}
+
+bool RawImage::write(int64_t offset, const uint8_t *src, size_t len)
+{
+	return file_write(m_file, offset, src, len);
+}
+#else
+bool RawImage::read(int64_t offset, uint8_t *dst, size_t len)
+{
+	struct iovec iov = { dst, len };
+	return readv(offset, &iov, 1);
+}
+
+bool RawImage::write(int64_t offset, const uint8_t *src, size_t len)
+{
+	struct iovec iov = { (void *)src, len };
+	return writev(offset, &iov, 1);
+}
+
+// Short transfers are continued from where they stopped, copy of the
+// vector is only made then
+static bool file_rwv(int fd, int64_t offset, const struct iovec *iov, int cnt, bool write)
+{
+	std::vector<struct iovec> rest;
+	size_t total = iov_size(iov, cnt);
+
+	while (total)
+	{
+		ssize_t n = write ? pwritev(fd, iov, cnt, offset) : preadv(fd, iov, cnt, offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false; // error or unexpected end of file
+
+		total -= n;
+		offset += n;
+		if (!total)
+			break;
+
+		rest.resize(cnt);
+		cnt = iov_copy(rest.data(), cnt, iov, cnt, n, total);
+		iov = rest.data();
+	}
+	return true;
+}
+
+bool RawImage::readv(int64_t offset, const struct iovec *iov, int cnt)
+{
+	return file_rwv(fileno(m_file), offset, iov, cnt, false);
+}
+
+bool RawImage::writev(int64_t offset, const struct iovec *iov, int cnt)
+{
+	return !m_read_only && file_rwv(fileno(m_file), offset, iov, cnt, true);
+}
+#endif
+
+bool RawImage::flush()
+{
+	return !fflush(m_file);
+}
+
+CompressedImage::CompressedImage(FILE *file)
+	: m_file(file)
+	, m_chunk_size(0)
+	, m_size(0)
+	, m_chunk_no(-1)
+{
+}
+
+CompressedImage::~CompressedImage()
+{
+	fclose(m_file);
+}
+
+bool CompressedImage::IsCompressed(FILE *file)
+{
+	char magic[8];
+	return file_read(file, 0, magic, sizeof(magic))
+		&& !memcmp(magic, COMPRESSED_MAGIC, sizeof(magic));
+}
+
+CompressedImage* CompressedImage::Open(FILE *file)
+{
+	CompressedImage *img = new CompressedImage(file);
+	if (!img->load())
+	{
+		fprintf(stderr, "usb-msd: Bad compressed image\n");
+		delete img;
+		return nullptr;
+	}
+	return img;
+}
+
+bool CompressedImage::load()
+{
+	CompressedHeader hdr;
+
+	if (!file_read(m_file, 0, &hdr, sizeof(hdr)) || hdr.version != COMPRESSED_VERSION)
+		return false;
+	if (!hdr.chunk_size || hdr.chunk_size > COMPRESSED_MAX_CHUNK || hdr.size < 0
+		|| hdr.chunks != ((uint64_t)hdr.size + hdr.chunk_size - 1) / hdr.chunk_size)
+		return false;
+
+	m_chunk_size = hdr.chunk_size;
+	m_size = hdr.size;
+	m_index.resize((size_t)hdr.chunks + 1);
+	m_chunk.resize(m_chunk_size);
+	m_packed.resize(lz4_compress_bound(m_chunk_size));
+
+	if (!file_read(m_file, sizeof(hdr), m_index.data(), m_index.size() * sizeof(uint64_t)))
+		return false;
+	for (size_t i = 0; i + 1 < m_index.size(); i++)
+	{
+		if (m_index[i] > m_index[i + 1] || m_index[i + 1] - m_index[i] > m_packed.size())
+			return false;
+	}
+	return true;
+}
+
+bool CompressedImage::load_chunk(int64_t chunk)
+{
+	size_t len = (size_t)std::min<int64_t>(m_chunk_size, m_size - chunk * m_chunk_size);
+	size_t packed = (size_t)(m_index[chunk + 1] - m_index[chunk]);
+
+	if (chunk == m_chunk_no)
+		return true;
+	m_chunk_no = -1;
+
+	if (!packed)
+		memset(m_chunk.data(), 0, len);
+	else if (packed == len)
+	{
+		if (!file_read(m_file, m_index[chunk], m_chunk.data(), len))
+			return false;
+	}
+	else if (!file_read(m_file, m_index[chunk], m_packed.data(), packed)
+		|| !lz4_decompress(m_packed.data(), packed, m_chunk.data(), len))
+		return false;
+
+	m_chunk_no = chunk;
+	return true;
+}
+
+bool CompressedImage::read(int64_t offset, uint8_t *dst, size_t len)
+{
+	if (offset < 0 || offset + (int64_t)len > m_size)
+		return false;
+
+	while (len)
+	{
+		int64_t chunk = offset / m_chunk_size;
+		size_t off = (size_t)(offset % m_chunk_size);
+		size_t n = std::min(len, (size_t)m_chunk_size - off);
+
+		if (!load_chunk(chunk))
+			return false;
+		memcpy(dst, m_chunk.data() + off, n);
+
+		offset += n;
+		dst += n;
+		len -= n;
+	}
+	return true;
+}
+
+bool CompressedImage::Pack(DiskImage *src, FILE *dst, uint32_t chunk_size)
+{
+	CompressedHeader hdr;
+	std::vector<uint8_t> chunk(chunk_size), packed(lz4_compress_bound(chunk_size));
+	std::vector<uint64_t> index;
+	uint64_t pos;
+
+	if (!chunk_size || chunk_size > COMPRESSED_MAX_CHUNK || src->size() < 0)
+		return false;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, COMPRESSED_MAGIC, sizeof(hdr.magic));
+	hdr.version = COMPRESSED_VERSION;
+	hdr.chunk_size = chunk_size;
+	hdr.size = src->size();
+	hdr.chunks = ((uint64_t)hdr.size + chunk_size - 1) / chunk_size;
+	index.resize((size_t)hdr.chunks + 1);
+
+	// index is written again once offsets are known
+	pos = sizeof(hdr) + index.size() * sizeof(uint64_t);
+	if (!file_write(dst, 0, &hdr, sizeof(hdr))
+		|| !file_write(dst, sizeof(hdr), index.data(), index.size() * sizeof(uint64_t)))
+		return false;
+
+	for (uint64_t i = 0; i < hdr.chunks; i++)
+	{
+		size_t len = (size_t)std::min<int64_t>(chunk_size, hdr.size - i * chunk_size);
+		const uint8_t *data = chunk.data();
+		size_t packed_len;
+
+		index[i] = pos;
+		if (!src->read(i * chunk_size, chunk.data(), len))
+			return false;
+
+		if (std::all_of(chunk.begin(), chunk.begin() + len, [](uint8_t b) { return b == 0; }))
+			continue;
+
+		packed_len = lz4_compress(chunk.data(), len, packed.data(), packed.size());
+		if (packed_len && packed_len < len)
+			data = packed.data();
+		else
+			packed_len = len;
+
+		if (!file_write(dst, pos, data, packed_len))
+			return false;
+		pos += packed_len;
+	}
+	index[hdr.chunks] = pos;
+
+	return file_write(dst, sizeof(hdr), index.data(), index.size() * sizeof(uint64_t))
+		&& !fflush(dst);
+}
+
+OverlayImage::OverlayImage(DiskImage *base, FILE *file)
+	: m_base(base)
+	, m_file(file)
+	, m_cluster_size(OVERLAY_CLUSTER_SIZE)
+	, m_bitmap_offset(0)
+	, m_data_offset(0)
+	, m_dirty_begin(0)
+	, m_dirty_end(0)
+{
+}
+
+OverlayImage::~OverlayImage()
+{
+	if (m_file)
+	{
+		flush();
+		fclose(m_file);
+	}
+	delete m_base;
+}
+
+OverlayImage* OverlayImage::Open(DiskImage *base, const TSTDSTRING& path)
+{
+	OverlayImage *img;
+	FILE *file;
+	bool ok;
+
+	if (base->size() <= 0)
+	{
+		delete base;
+		return nullptr;
+	}
+
+	file = wfopen(path.c_str(), TEXT("r+b"));
+	if (file)
+	{
+		img = new OverlayImage(base, file);
+		ok = img->load();
+	}
+	else
+	{
+		file = wfopen(path.c_str(), TEXT("w+b"));
+		if (!file)
+		{
+			delete base;
+			return nullptr;
+		}
+		img = new OverlayImage(base, file);
+		ok = img->create();
+	}
+
+	if (!ok)
+	{
+		delete img;
+		return nullptr;
+	}
+	return img;
+}
+
+bool OverlayImage::create()
+{
+	OverlayHeader hdr;
+	int64_t clusters = (size() + m_cluster_size - 1) / m_cluster_size;
+
+#if defined(_WIN32)
+	// NTFS only skips unwritten clusters in sparse files
+	DWORD ret;
+	DeviceIoControl((HANDLE)_get_osfhandle(_fileno(m_file)), FSCTL_SET_SPARSE,
+		NULL, 0, NULL, 0, &ret, NULL);
+#endif
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, OVERLAY_MAGIC, sizeof(hdr.magic));
+	hdr.version = OVERLAY_VERSION;
+	hdr.cluster_size = m_cluster_size;
+	hdr.size = size();
+	hdr.bitmap_offset = sizeof(hdr);
+	hdr.data_offset = hdr.bitmap_offset + (clusters + 7) / 8;
+	hdr.data_offset = (hdr.data_offset + m_cluster_size - 1) / m_cluster_size * m_cluster_size;
+
+	m_bitmap_offset = hdr.bitmap_offset;
+	m_data_offset = hdr.data_offset;
+	m_bitmap.assign((size_t)((clusters + 7) / 8), 0);
+	m_cluster.resize(m_cluster_size);
+
+	return file_write(m_file, 0, &hdr, sizeof(hdr))
+		&& file_write(m_file, hdr.bitmap_offset, m_bitmap.data(), m_bitmap.size())
+		&& !fflush(m_file);
+}
+
+bool OverlayImage::load()
+{
+	OverlayHeader hdr;
+	int64_t clusters;
+
+	if (!file_read(m_file, 0, &hdr, sizeof(hdr)))
+		return false;
+
+	if (memcmp(hdr.magic, OVERLAY_MAGIC, sizeof(hdr.magic)) || hdr.version != OVERLAY_VERSION)
+	{
+		fprintf(stderr, "usb-msd: Not an overlay file\n");
+		return false;
+	}
+
+	if (hdr.size != size())
+	{
+		fprintf(stderr, "usb-msd: Overlay was created for a different base image\n");
+		return false;
+	}
+
+	if (!hdr.cluster_size || (hdr.cluster_size & (hdr.cluster_size - 1)))
+		return false;
+
+	m_cluster_size = hdr.cluster_size;
+	m_bitmap_offset = hdr.bitmap_offset;
+	m_data_offset = hdr.data_offset;
+	clusters = (size() + m_cluster_size - 1) / m_cluster_size;
+	m_bitmap.resize((size_t)((clusters + 7) / 8));
+	m_cluster.resize(m_cluster_size);
+
+	return file_read(m_file, m_bitmap_offset, m_bitmap.data(), m_bitmap.size());
+}
+
+void OverlayImage::set_present(int64_t cluster)
+{
+	size_t byte = (size_t)(cluster >> 3);
+
+	m_bitmap[byte] |= 1 << (cluster & 7);
+	if (m_dirty_begin == m_dirty_end)
+	{
+		m_dirty_begin = byte;
+		m_dirty_end = byte + 1;
+	}
+	else
+	{
+		m_dirty_begin = std::min(m_dirty_begin, byte);
+		m_dirty_end = std::max(m_dirty_end, byte + 1);
+	}
+}
+
+size_t OverlayImage::cluster_len(int64_t cluster) const
+{
+	return (size_t)std::min<int64_t>(m_cluster_size, size() - cluster * m_cluster_size);
+}
+
+bool OverlayImage::copy_up(int64_t cluster)
+{
+	int64_t offset = cluster * m_cluster_size;
+	size_t len = cluster_len(cluster);
+
+	if (present(cluster))
+		return true;
+
+	return m_base->read(offset, m_cluster.data(), len)
+		&& file_write(m_file, m_data_offset + offset, m_cluster.data(), len);
+}
+
+bool OverlayImage::read(int64_t offset, uint8_t *dst, size_t len)
+{
+	while (len)
+	{
+		int64_t cluster = offset / m_cluster_size;
+		size_t n = std::min(len, (size_t)(m_cluster_size - offset % m_cluster_size));
+		bool in_overlay = present(cluster);
+		bool ok;
+
+		// whole run of clusters from the same file in one go
+		while (n < len && present(++cluster) == in_overlay)
+			n = std::min(len, n + m_cluster_size);
+
+		if (in_overlay)
+			ok = file_read(m_file, m_data_offset + offset, dst, n);
+		else
+			ok = m_base->read(offset, dst, n);
+		if (!ok)
+			return false;
+
+		offset += n;
+		dst += n;
+		len -= n;
+	}
+	return true;
+}
+
+bool OverlayImage::write(int64_t offset, const uint8_t *src, size_t len)
+{
+	int64_t first, last, end = offset + len;
+
+	if (!len)
+		return true;
+
+	first = offset / m_cluster_size;
+	last = (end - 1) / m_cluster_size;
+
+	// only first and last cluster can be partially overwritten
+	if (offset != first * m_cluster_size && !copy_up(first))
+		return false;
+	if (end != last * m_cluster_size + (int64_t)cluster_len(last)
+		&& (last != first || offset == first * m_cluster_size) && !copy_up(last))
+		return false;
+
+	if (!file_write(m_file, m_data_offset + offset, src, len))
+		return false;
+
+	for (int64_t c = first; c <= last; c++)
+		set_present(c);
+	return true;
+}
+
+bool OverlayImage::flush()
+{
+	if (m_dirty_begin != m_dirty_end)
+	{
+		// bitmap goes after data so a crash can't point it at garbage
+		if (fflush(m_file)
+			|| !file_write(m_file, m_bitmap_offset + m_dirty_begin,
+				m_bitmap.data() + m_dirty_begin, m_dirty_end - m_dirty_begin))
+			return false;
+		m_dirty_begin = m_dirty_end = 0;
+	}
+	return !fflush(m_file);
+}
+
+} //namespace
@@ -0,0 +1,159 @@
+#ifndef USBMSD_DISKIMAGE_H
+#define USBMSD_DISKIMAGE_H
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <climits>
+#include <string>
+#include <vector>
+#include "../platcompat.h"
+#if !defined(_WIN32)
+#include <sys/uio.h>
+#endif
+#include "../qemu-usb/iov.h"
+
+namespace usb_msd {
+
+// Backing store of a mass storage device. Called from I/O worker or from
+// emulation thread while worker is idle, never from both at once.
+class DiskImage
+{
+public:
+	virtual ~DiskImage() {}
+
+	// logical size in bytes
+	virtual int64_t size() const = 0;
+	virtual bool read(int64_t offset, uint8_t *dst, size_t len) = 0;
+	virtual bool write(int64_t offset, const uint8_t *src, size_t len) = 0;
+	// scatter-gather versions, default goes through read()/write() per element
+	virtual bool readv(int64_t offset, const struct iovec *iov, int cnt);
+	virtual bool writev(int64_t offset, const struct iovec *iov, int cnt);
+	// push written data to the file(s)
+	virtual bool flush() = 0;
+	// writable plain image file that can be memory-mapped, NULL if image has a format
+	virtual FILE* file() { return nullptr; }
+	// writes always fail
+	virtual bool read_only() const { return false; }
+
+	// Raw or compressed image depending on file contents. Raw image is
+	// opened for writing if 'writable' and the file allows it.
+	static DiskImage* Open(const TSTDSTRING& path, bool writable);
+};
+
+// Image file is used as is. Outside of Windows file data goes through the
+// descriptor with positioned reads/writes, no seeking or stdio buffering,
+// and vectored requests are a single preadv/pwritev.
+class RawImage : public DiskImage
+{
+public:
+	RawImage(FILE *file, bool read_only = false);
+	~RawImage();
+
+	int64_t size() const { return m_size; }
+	bool read(int64_t offset, uint8_t *dst, size_t len);
+	bool write(int64_t offset, const uint8_t *src, size_t len);
+#if !defined(_WIN32)
+	bool readv(int64_t offset, const struct iovec *iov, int cnt);
+	bool writev(int64_t offset, const struct iovec *iov, int cnt);
+#endif
+	bool flush();
+	FILE* file() { return m_read_only ? nullptr : m_file; }
+	bool read_only() const { return m_read_only; }
+
+private:
+	FILE *m_file;
+	int64_t m_size;
+	bool m_read_only;
+};
+
+// Read-only image split into fixed size chunks compressed one by one.
+// Put an overlay on top of it to make it writable.
+//
+// File layout:
+//   CompressedHeader
+//   index, u64 file offset of each chunk plus one for end of the last one
+//   chunks: empty - all zeros, chunk size - stored as is, otherwise LZ4 block
+class CompressedImage : public DiskImage
+{
+public:
+	~CompressedImage();
+
+	// Takes ownership of file
+	static CompressedImage* Open(FILE *file);
+	// Writes 'src' to 'dst' in compressed format
+	static bool Pack(DiskImage *src, FILE *dst, uint32_t chunk_size);
+	static bool IsCompressed(FILE *file);
+
+	int64_t size() const { return m_size; }
+	bool read(int64_t offset, uint8_t *dst, size_t len);
+	bool write(int64_t offset, const uint8_t *src, size_t len) { return false; }
+	bool flush() { return true; }
+	bool read_only() const { return true; }
+
+private:
+	CompressedImage(FILE *file);
+
+	bool load();
+	// decompress into m_chunk, last one is kept
+	bool load_chunk(int64_t chunk);
+
+	FILE *m_file;
+	uint32_t m_chunk_size;
+	int64_t m_size;
+	std::vector<uint64_t> m_index;
+	std::vector<uint8_t> m_chunk;
+	std::vector<uint8_t> m_packed;
+	int64_t m_chunk_no;
+};
+
+// Copy-on-write overlay: base image is only read, written clusters go to
+// a sparse overlay file at their own offset, bitmap tells which are there.
+//
+// Overlay file layout:
+//   OverlayHeader
+//   bitmap, a bit per cluster, LSB first
+//   clusters, starting at data_offset (cluster aligned)
+class OverlayImage : public DiskImage
+{
+public:
+	~OverlayImage();
+
+	// Takes ownership of base. Creates overlay file if it doesn't exist.
+	static OverlayImage* Open(DiskImage *base, const TSTDSTRING& path);
+
+	int64_t size() const { return m_base->size(); }
+	bool read(int64_t offset, uint8_t *dst, size_t len);
+	bool write(int64_t offset, const uint8_t *src, size_t len);
+	bool flush();
+
+private:
+	OverlayImage(DiskImage *base, FILE *file);
+
+	bool create();
+	bool load();
+
+	bool present(int64_t cluster) const
+	{
+		return (m_bitmap[cluster >> 3] >> (cluster & 7)) & 1;
+	}
+	void set_present(int64_t cluster);
+	// last cluster can be short
+	size_t cluster_len(int64_t cluster) const;
+	// copy cluster from base before it is partially overwritten
+	bool copy_up(int64_t cluster);
+
+	DiskImage *m_base;
+	FILE *m_file;
+	uint32_t m_cluster_size;
+	int64_t m_bitmap_offset;
+	int64_t m_data_offset;
+	std::vector<uint8_t> m_bitmap;
+	std::vector<uint8_t> m_cluster; // copy-up buffer
+	// bitmap bytes changed since last flush
+	size_t m_dirty_begin, m_dirty_end;
+};
+
+int64_t get_file_size(FILE *file);
+
+} //namespace
+#endif
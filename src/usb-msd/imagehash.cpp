@@ -0,0 +1,174 @@
+#include "imagehash.h"
+#include <cstring>
+
+namespace usb_msd {
+
+#define HASH_BLOCK_SIZE (64 * 1024)
+#define HASH_MAX_LEAVES (1 << 20) // bigger images get bigger blocks
+
+static const uint64_t P1 = 11400714785074694791ULL;
+static const uint64_t P2 = 14029467366897019727ULL;
+static const uint64_t P3 = 1609587929392839161ULL;
+static const uint64_t P4 = 9650029242287828579ULL;
+static const uint64_t P5 = 2870177450012600261ULL;
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const uint8_t *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t mix_round(uint64_t acc, uint64_t v)
+{
+	acc += v * P2;
+	acc = rotl64(acc, 31);
+	return acc * P1;
+}
+
+static inline uint64_t mix_merge(uint64_t acc, uint64_t v)
+{
+	acc ^= mix_round(0, v);
+	return acc * P1 + P4;
+}
+
+static inline uint64_t avalanche(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= P2;
+	h ^= h >> 29;
+	h *= P3;
+	h ^= h >> 32;
+	return h;
+}
+
+uint64_t ImageHash::Hash(const uint8_t *p, size_t len, uint64_t seed)
+{
+	const uint8_t *end = p + len;
+	uint64_t h;
+
+	if (len >= 32)
+	{
+		uint64_t v1 = seed + P1 + P2, v2 = seed + P2, v3 = seed, v4 = seed - P1;
+		const uint8_t *limit = end - 32;
+		do
+		{
+			v1 = mix_round(v1, read64(p));
+			v2 = mix_round(v2, read64(p + 8));
+			v3 = mix_round(v3, read64(p + 16));
+			v4 = mix_round(v4, read64(p + 24));
+			p += 32;
+		} while (p <= limit);
+
+		h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+		h = mix_merge(h, v1);
+		h = mix_merge(h, v2);
+		h = mix_merge(h, v3);
+		h = mix_merge(h, v4);
+	}
+	else
+		h = seed + P5;
+
+	h += len;
+	for (; p + 8 <= end; p += 8)
+	{
+		h ^= mix_round(0, read64(p));
+		h = rotl64(h, 27) * P1 + P4;
+	}
+	for (; p < end; p++)
+	{
+		h ^= *p * P5;
+		h = rotl64(h, 11) * P1;
+	}
+	return avalanche(h);
+}
+
+static uint64_t hash_pair(uint64_t left, uint64_t right)
+{
+	uint64_t v[2] = { left, right };
+	return ImageHash::Hash((const uint8_t *)v, sizeof(v), 0);
+}
+
+void ImageHash::reset(int64_t size)
+{
+	int64_t blocks;
+
+	m_size = size > 0 ? size : 0;
+	m_block_size = HASH_BLOCK_SIZE;
+	while ((m_size + m_block_size - 1) / m_block_size > HASH_MAX_LEAVES)
+		m_block_size *= 2;
+	blocks = (m_size + m_block_size - 1) / m_block_size;
+
+	for (m_leaves = 1; (int64_t)m_leaves < blocks; m_leaves *= 2)
+		;
+	m_tree.assign(m_leaves * 2, 0);
+	m_stale_map.assign((size_t)blocks, true);
+	m_stale = (size_t)blocks;
+	m_cursor = 0;
+}
+
+void ImageHash::invalidate(int64_t offset, size_t len)
+{
+	if (!len || offset >= m_size)
+		return;
+
+	int64_t first = offset / m_block_size;
+	int64_t last = (offset + (int64_t)len - 1) / m_block_size;
+	if (last >= blocks())
+		last = blocks() - 1;
+
+	for (int64_t b = first; b <= last; b++)
+	{
+		if (!m_stale_map[b])
+		{
+			m_stale_map[b] = true;
+			m_stale++;
+		}
+	}
+}
+
+int64_t ImageHash::next_stale(int64_t from) const
+{
+	int64_t n = blocks();
+
+	if (!m_stale)
+		return -1;
+	if (from < 0 || from >= n)
+		from = 0;
+	for (int64_t i = 0; i < n; i++)
+	{
+		int64_t b = (from + i) % n;
+		if (m_stale_map[b])
+			return b;
+	}
+	return -1;
+}
+
+size_t ImageHash::block_len(int64_t block) const
+{
+	int64_t left = m_size - block * m_block_size;
+	return (size_t)(left < m_block_size ? left : m_block_size);
+}
+
+void ImageHash::set_block(int64_t block, const uint8_t *data)
+{
+	size_t node = m_leaves + (size_t)block;
+
+	if (m_stale_map[block])
+	{
+		m_stale_map[block] = false;
+		m_stale--;
+	}
+
+	// seeded with block number so moving data around changes the hash too
+	m_tree[node] = Hash(data, block_len(block), (uint64_t)block);
+	for (node /= 2; node; node /= 2)
+		m_tree[node] = hash_pair(m_tree[2 * node], m_tree[2 * node + 1]);
+}
+
+} //namespace
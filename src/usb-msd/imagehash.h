@@ -0,0 +1,56 @@
+#ifndef USBMSD_IMAGEHASH_H
+#define USBMSD_IMAGEHASH_H
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+namespace usb_msd {
+
+// Merkle-style content hash of an image. Leaves hash fixed size blocks,
+// inner nodes hash their two children, so a changed block costs one leaf
+// and log2(blocks) nodes to rehash and root is always at hand.
+//
+// Writes only mark blocks stale, their data is hashed later by whoever
+// reads it back (background pass or save state), root is valid once
+// nothing is stale.
+class ImageHash
+{
+public:
+	ImageHash() : m_size(0), m_block_size(0), m_leaves(0), m_stale(0), m_cursor(0) {}
+
+	// All blocks start stale
+	void reset(int64_t size);
+
+	// Data in [offset, offset + len) changed
+	void invalidate(int64_t offset, size_t len);
+	// Stale block at or after 'from', wrapping around, -1 if none
+	int64_t next_stale(int64_t from) const;
+	// Round robin over stale blocks for background hashing
+	int64_t next_stale() { return m_cursor = next_stale(m_cursor); }
+	bool is_stale(int64_t block) const { return m_stale_map[block]; }
+	size_t stale() const { return m_stale; }
+
+	// 'data' is current contents of 'block', block_len() bytes
+	void set_block(int64_t block, const uint8_t *data);
+
+	uint64_t root() const { return m_tree[1]; }
+	uint32_t block_size() const { return m_block_size; }
+	int64_t blocks() const { return (int64_t)m_stale_map.size(); }
+	// last block can be short
+	size_t block_len(int64_t block) const;
+
+	// Fast non-cryptographic 64-bit hash, xxHash64 style
+	static uint64_t Hash(const uint8_t *data, size_t len, uint64_t seed);
+
+private:
+	int64_t m_size;
+	uint32_t m_block_size;
+	size_t m_leaves; // power of 2, unused ones hash to 0
+	std::vector<uint64_t> m_tree; // [1] is root, children of n are 2n and 2n+1
+	std::vector<bool> m_stale_map;
+	size_t m_stale;
+	int64_t m_cursor;
+};
+
+} //namespace
+#endif
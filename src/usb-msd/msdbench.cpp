@@ -0,0 +1,441 @@
+// Throughput benchmark for usb-msd without PCSX2: drives CBW/DATA/CSW
+// sequences straight through usb_handle_packet against an image file.
+// usbmsd-bench [-t seq|rand|fat|mixed] [-n commands] [-s KB per read]
+//              [-p packet bytes] [-S image MB] [-i image] [-o key=value]...
+#include <cstdio>
+#include <cstdlib>
+#include <cstdarg>
+#include <cstring>
+#include <string>
+#include <map>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include "../qemu-usb/vl.h"
+#include "../qemu-usb/desc.h"
+#include "../qemu-usb/USBinternal.h"
+#include "../configuration.h"
+#include "usb-msd.h"
+
+using namespace usb_msd;
+
+#define DEFAULT_COMMANDS 2000
+#define DEFAULT_READ_KB 64
+#define DEFAULT_PACKET 4096
+#define DEFAULT_IMAGE_MB 64
+#define SMALL_IO 4096
+#define FAT_AREA (1024 * 1024) // small writes land here, FAT-like
+
+#define READ_CAPACITY_10 0x25
+#define READ_10 0x28
+#define WRITE_10 0x2a
+
+// What the plugin gets from PCSX2 and its config, settings come from -o
+USBstats usb_stats;
+bool usb_freeze_delta;
+TSTDSTRING IniPath;
+static std::map<TSTDSTRING, TSTDSTRING> settings;
+
+bool LoadSettingValue(const TSTDSTRING& ini, const TSTDSTRING& section, const TCHAR* param, TSTDSTRING& value)
+{
+	auto it = settings.find(param);
+	if (it == settings.end())
+		return false;
+	value = it->second;
+	return true;
+}
+
+bool LoadSettingValue(const TSTDSTRING& ini, const TSTDSTRING& section, const TCHAR* param, int32_t& value)
+{
+	auto it = settings.find(param);
+	if (it == settings.end())
+		return false;
+	value = (int32_t)strtol(it->second.c_str(), nullptr, 10);
+	return true;
+}
+
+#if defined(_WIN32)
+void SysMessageW(const wchar_t *fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	vfwprintf(stderr, fmt, args);
+	va_end(args);
+}
+#else
+void SysMessage(const char *fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+}
+#endif
+
+struct usb_msd_cbw {
+	uint32_t sig;
+	uint32_t tag;
+	uint32_t data_len;
+	uint8_t flags;
+	uint8_t lun;
+	uint8_t cmd_len;
+	uint8_t cmd[16];
+};
+
+enum Pattern { SEQ_READ, RAND_READ, FAT_WRITE, MIXED };
+
+struct Bench
+{
+	USBDevice *dev;
+	USBPort port;
+	USBPacket packet;
+	bool complete;
+	uint32_t tag;
+	size_t packet_size;
+	std::vector<uint8_t> buf;
+	uint64_t frames;
+	uint32_t block_size; // from READ_CAPACITY
+	uint32_t blocks;
+};
+
+static void port_attach(USBPort *port) { port->dev->port = port; }
+static void port_detach(USBPort *port) {}
+static void port_complete(USBPort *port, USBPacket *p)
+{
+	((Bench *)port->opaque)->complete = true;
+}
+
+static USBPortOps port_ops = { port_attach, port_detach, nullptr, port_complete };
+
+// Read/write syscalls so far, Linux only
+static bool syscall_count(uint64_t &count)
+{
+#if defined(__linux__)
+	FILE *f = fopen("/proc/self/io", "r");
+	char line[128];
+	unsigned long long v;
+	int found = 0;
+
+	if (!f)
+		return false;
+	count = 0;
+	while (fgets(line, sizeof(line), f))
+	{
+		if (sscanf(line, "syscr: %llu", &v) == 1 || sscanf(line, "syscw: %llu", &v) == 1)
+		{
+			count += v;
+			found++;
+		}
+	}
+	fclose(f);
+	return found == 2;
+#else
+	return false;
+#endif
+}
+
+// Run packet to completion, polling frames while device has it async
+static int transfer(Bench &b, int pid, int ep, uint8_t *data, size_t len)
+{
+	USBPacket *p = &b.packet;
+
+	usb_packet_setup(p, pid, usb_ep_get(b.dev, pid, ep), 0, b.tag, false, false);
+	usb_packet_addbuf(p, data, len);
+	b.complete = false;
+	usb_handle_packet(b.dev, p);
+	while (p->status == USB_RET_ASYNC && !b.complete)
+	{
+		usb_device_handle_frame(b.dev);
+		b.frames++;
+		std::this_thread::yield();
+	}
+	if (p->status != USB_RET_SUCCESS)
+		return -1;
+	return p->actual_length;
+}
+
+// One command with its data phase from/to 'data', false on any protocol or SCSI error
+static bool command(Bench &b, const uint8_t *cdb, bool write, uint8_t *data, size_t len)
+{
+	usb_msd_cbw cbw = {};
+	uint8_t csw[13];
+
+	cbw.sig = 0x43425355;
+	cbw.tag = ++b.tag;
+	cbw.data_len = (uint32_t)len;
+	cbw.flags = write ? 0 : 0x80;
+	cbw.cmd_len = 10;
+	memcpy(cbw.cmd, cdb, 10);
+
+	if (transfer(b, USB_TOKEN_OUT, 2, (uint8_t *)&cbw, 31) != 31)
+		return false;
+
+	for (size_t off = 0; off < len; off += b.packet_size)
+	{
+		size_t n = std::min(b.packet_size, len - off);
+		if (transfer(b, write ? USB_TOKEN_OUT : USB_TOKEN_IN, write ? 2 : 1, data + off, n) != (int)n)
+			return false;
+	}
+
+	if (transfer(b, USB_TOKEN_IN, 1, csw, sizeof(csw)) != sizeof(csw))
+		return false;
+	return csw[12] == 0;
+}
+
+static bool read_write(Bench &b, bool write, uint32_t lba, uint32_t blocks)
+{
+	uint8_t cdb[10] = {};
+	size_t len = (size_t)blocks * b.block_size;
+
+	cdb[0] = write ? WRITE_10 : READ_10;
+	cdb[2] = lba >> 24;
+	cdb[3] = lba >> 16;
+	cdb[4] = lba >> 8;
+	cdb[5] = lba;
+	cdb[7] = blocks >> 8;
+	cdb[8] = blocks;
+
+	if (b.buf.size() < len)
+		b.buf.resize(len);
+	return command(b, cdb, write, b.buf.data(), len);
+}
+
+static bool read_capacity(Bench &b)
+{
+	uint8_t cdb[10] = { READ_CAPACITY_10 };
+	uint8_t data[8];
+
+	if (!command(b, cdb, false, data, sizeof(data)))
+		return false;
+	b.blocks = ((data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3]) + 1;
+	b.block_size = (data[4] << 24) | (data[5] << 16) | (data[6] << 8) | data[7];
+	return b.block_size && b.blocks;
+}
+
+static bool create_image(const std::string &path, int64_t size)
+{
+	FILE *f = fopen(path.c_str(), "wb");
+	std::vector<uint8_t> chunk(1024 * 1024);
+	bool ok = !!f;
+
+	for (size_t i = 0; i < chunk.size(); i++)
+		chunk[i] = (uint8_t)(i * 31 + (i >> 9));
+	for (int64_t off = 0; ok && off < size; off += chunk.size())
+		ok = fwrite(chunk.data(), 1, (size_t)std::min<int64_t>(chunk.size(), size - off), f) > 0;
+	if (f)
+		ok = !fclose(f) && ok;
+	return ok;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -t seq|rand|fat|mixed  access pattern (default seq)\n"
+		"  -n N         number of commands (default %d)\n"
+		"  -s KB        transfer size of sequential reads (default %d)\n"
+		"  -p bytes     USB packet size (default %d)\n"
+		"  -S MB        size of temporary image (default %d)\n"
+		"  -i path      use existing image instead of a temporary one\n"
+		"  -o key=value device setting as in ini, e.g. mmap=1, cache_kb=0\n",
+		name, DEFAULT_COMMANDS, DEFAULT_READ_KB, DEFAULT_PACKET, DEFAULT_IMAGE_MB);
+}
+
+int main(int argc, char *argv[])
+{
+	Pattern pattern = SEQ_READ;
+	const char *pattern_name = "seq";
+	int commands = DEFAULT_COMMANDS;
+	uint32_t read_kb = DEFAULT_READ_KB;
+	size_t packet_size = DEFAULT_PACKET;
+	int64_t image_mb = DEFAULT_IMAGE_MB;
+	std::string image;
+	bool temp_image = false;
+
+	for (int i = 1; i < argc; i++)
+	{
+		const char *arg = argv[i];
+		const char *val = i + 1 < argc ? argv[i + 1] : nullptr;
+
+		if (arg[0] != '-' || !arg[1] || arg[2] || !val)
+		{
+			usage(argv[0]);
+			return 1;
+		}
+		i++;
+
+		switch (arg[1])
+		{
+		case 't':
+			pattern_name = val;
+			if (!strcmp(val, "seq"))
+				pattern = SEQ_READ;
+			else if (!strcmp(val, "rand"))
+				pattern = RAND_READ;
+			else if (!strcmp(val, "fat"))
+				pattern = FAT_WRITE;
+			else if (!strcmp(val, "mixed"))
+				pattern = MIXED;
+			else
+			{
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'n': commands = atoi(val); break;
+		case 's': read_kb = (uint32_t)atoi(val); break;
+		case 'p': packet_size = (size_t)atoi(val); break;
+		case 'S': image_mb = atoll(val); break;
+		case 'i': image = val; break;
+		case 'o':
+		{
+			const char *eq = strchr(val, '=');
+			if (!eq)
+			{
+				usage(argv[0]);
+				return 1;
+			}
+			settings[std::string(val, eq - val)] = eq + 1;
+			break;
+		}
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (commands <= 0 || !read_kb || read_kb > 1024 || !packet_size || image_mb <= 0)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (image.empty())
+	{
+		image = "usbmsd-bench.img";
+		temp_image = true;
+		if (!create_image(image, image_mb * 1024 * 1024))
+		{
+			fprintf(stderr, "Could not create '%s'\n", image.c_str());
+			return 1;
+		}
+	}
+	settings[N_CONFIG_PATH] = image;
+
+	Bench b = {};
+	b.packet_size = packet_size;
+	b.dev = MsdDevice::CreateDevice(0);
+	if (!b.dev)
+	{
+		fprintf(stderr, "Could not create device for '%s'\n", image.c_str());
+		if (temp_image)
+			remove(image.c_str());
+		return 1;
+	}
+
+	b.port.ops = &port_ops;
+	b.port.opaque = &b;
+	b.port.speedmask = USB_SPEED_MASK_FULL;
+	b.port.dev = b.dev;
+	b.dev->attached = true;
+	usb_attach(&b.port);
+	usb_device_reset(b.dev);
+	usb_desc_set_config(b.dev, 1);
+	usb_packet_init(&b.packet);
+
+	bool ok = read_capacity(b);
+	uint32_t total = b.blocks;
+	uint32_t seq_blocks = std::max(read_kb * 1024 / b.block_size, 1u);
+	uint32_t small_blocks = std::max(SMALL_IO / b.block_size, 1u);
+	uint32_t fat_blocks = std::max(FAT_AREA / b.block_size, 1u);
+	uint32_t next_lba = 0, data_lba = fat_blocks;
+	std::vector<double> latency;
+	uint64_t bytes = 0, sys_start = 0, sys_end = 0;
+	bool have_sys = syscall_count(sys_start);
+	srand(1);
+
+	if (ok && total < fat_blocks + small_blocks + seq_blocks)
+	{
+		fprintf(stderr, "Image is too small\n");
+		ok = false;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; ok && i < commands; i++)
+	{
+		bool write = false;
+		uint32_t lba, blocks;
+
+		switch (pattern)
+		{
+		case SEQ_READ:
+			if (next_lba + seq_blocks > total)
+				next_lba = 0;
+			lba = next_lba;
+			blocks = seq_blocks;
+			next_lba += blocks;
+			break;
+		case RAND_READ:
+			blocks = small_blocks;
+			lba = (uint32_t)(rand() % (total / blocks)) * blocks;
+			break;
+		case FAT_WRITE:
+			// FAT sector update followed by a cluster of file data
+			write = true;
+			if (i % 2 == 0)
+			{
+				blocks = 1;
+				lba = (uint32_t)(rand() % fat_blocks);
+			}
+			else
+			{
+				blocks = small_blocks;
+				if (data_lba + blocks > total)
+					data_lba = fat_blocks;
+				lba = data_lba;
+				data_lba += blocks;
+			}
+			break;
+		default: // MIXED, 70% random reads, 30% random writes
+			blocks = small_blocks;
+			lba = (uint32_t)(rand() % (total / blocks)) * blocks;
+			write = rand() % 10 < 3;
+			break;
+		}
+
+		auto t = std::chrono::steady_clock::now();
+		ok = read_write(b, write, lba, blocks);
+		latency.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t).count());
+		bytes += (uint64_t)blocks * b.block_size;
+	}
+	double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	have_sys = syscall_count(sys_end) && have_sys;
+
+	b.dev->klass.unrealize(b.dev);
+	usb_packet_cleanup(&b.packet);
+	if (temp_image)
+		remove(image.c_str());
+
+	if (!ok)
+	{
+		fprintf(stderr, "Command %zu failed\n", latency.size());
+		return 1;
+	}
+	if (latency.empty())
+		return 1;
+
+	std::sort(latency.begin(), latency.end());
+	auto pct = [&](double q) { return latency[std::min(latency.size() - 1, (size_t)(q * latency.size()))]; };
+
+	printf("pattern     %s, %u byte blocks\n", pattern_name, b.block_size);
+	printf("commands    %d (%.1f MB)\n", commands, bytes / (1024.0 * 1024.0));
+	printf("throughput  %.1f MB/s, %.0f commands/s\n", bytes / (1024.0 * 1024.0) / secs, commands / secs);
+	printf("latency us  p50 %.1f  p90 %.1f  p99 %.1f  max %.1f\n", pct(0.5), pct(0.9), pct(0.99), latency.back());
+	printf("frames/cmd  %.1f\n", (double)b.frames / commands);
+	if (have_sys)
+		printf("syscalls/cmd %.2f (read/write family)\n", (double)(sys_end - sys_start) / commands);
+	else
+		printf("syscalls/cmd n/a\n");
+	return 0;
+}
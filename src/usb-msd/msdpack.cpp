@@ -0,0 +1,54 @@
+// Converts a raw USB disk image to usb-msd compressed image format.
+// usbmsd-pack <raw image> <compressed image> [chunk size in KB]
+#include <cstdio>
+#include <cstdlib>
+#include "diskimage.h"
+
+using namespace usb_msd;
+
+#define DEFAULT_CHUNK_KB 64
+
+int main(int argc, char *argv[])
+{
+	uint32_t chunk_kb = DEFAULT_CHUNK_KB;
+	DiskImage *src;
+	FILE *dst;
+	bool ok;
+
+	if (argc < 3)
+	{
+		fprintf(stderr, "Usage: %s <raw image> <compressed image> [chunk size in KB, default %d]\n",
+			argv[0], DEFAULT_CHUNK_KB);
+		return 1;
+	}
+
+	if (argc > 3)
+		chunk_kb = (uint32_t)strtoul(argv[3], nullptr, 10);
+
+	FILE *file = fopen(argv[1], "rb");
+	if (!file)
+	{
+		fprintf(stderr, "Could not open '%s'\n", argv[1]);
+		return 1;
+	}
+	src = new RawImage(file, true);
+
+	dst = fopen(argv[2], "wb");
+	if (!dst)
+	{
+		fprintf(stderr, "Could not create '%s'\n", argv[2]);
+		delete src;
+		return 1;
+	}
+
+	ok = CompressedImage::Pack(src, dst, chunk_kb * 1024);
+	fclose(dst);
+	delete src;
+
+	if (!ok)
+	{
+		fprintf(stderr, "Failed to write '%s'\n", argv[2]);
+		return 1;
+	}
+	return 0;
+}
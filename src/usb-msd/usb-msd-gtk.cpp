@@ -85,9 +85,17 @@ int MsdDevice::Configure(int port, const std::string& api, void *data)
 	gtk_box_pack_start (GTK_BOX (rs_hbox), entry, TRUE, TRUE, 5);
 	gtk_box_pack_start (GTK_BOX (rs_hbox), button, FALSE, FALSE, 5);
 
+	GtkWidget *map_check = gtk_check_button_new_with_label ("Memory-map image file");
+	gtk_box_pack_start (GTK_BOX (vbox), map_check, FALSE, FALSE, 5);
+
+	int32_t use_map = 0;
+	if (LoadSetting(TypeName(), port, APINAME, N_CONFIG_MMAP, use_map))
+		gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (map_check), use_map != 0);
+
 	gtk_widget_show_all (dlg);
 	gint result = gtk_dialog_run (GTK_DIALOG (dlg));
 	std::string path = gtk_entry_get_text(GTK_ENTRY(entry));
+	use_map = gtk_toggle_button_get_active (GTK_TOGGLE_BUTTON (map_check)) ? 1 : 0;
 	gtk_widget_destroy (dlg);
 
 	// Wait for all gtk events to be consumed ...
@@ -96,7 +104,8 @@ int MsdDevice::Configure(int port, const std::string& api, void *data)
 
 	if (result == GTK_RESPONSE_OK)
 	{
-		if(SaveSetting(TypeName(), port, APINAME, N_CONFIG_PATH, path))
+		if(SaveSetting(TypeName(), port, APINAME, N_CONFIG_PATH, path)
+			&& SaveSetting(TypeName(), port, APINAME, N_CONFIG_MMAP, use_map))
 			return RESULT_OK;
 		else
 			return RESULT_FAILED;
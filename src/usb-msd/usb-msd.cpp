@@ -10,9 +10,23 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <map>
+#include <vector>
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <sys/mman.h>
+#endif
 #include "../qemu-usb/vl.h"
 #include "../qemu-usb/desc.h"
+#include "../qemu-usb/USBinternal.h"
 #include "usb-msd.h"
+#include "blockcache.h"
+#include "diskimage.h"
+#include "imagehash.h"
 
 #define le32_to_cpu(x) (x)
 #define cpu_to_le32(x) (x)
@@ -37,6 +51,19 @@ struct usb_msd_csw {
 };
 
 #define LBA_BLOCK_SIZE 512
+#define MSD_MAX_LUNS 4
+/* OHCI packet spans two pages at most */
+#define MSD_IO_MAX_IOV 4
+/* mapped image gets msync'ed after this much data has been written */
+#define MSD_MAP_FLUSH_BYTES (1024 * 1024)
+/* read cache, sizes in KB can be changed in ini */
+#define MSD_CACHE_BLOCK 4096
+#define MSD_CACHE_KB 1024
+#define MSD_READAHEAD_KB 128
+/* write-back, pending writes are flushed when they reach this size or
+   after MSD_WB_FLUSH_FRAMES */
+#define MSD_WRITEBACK_KB 1024
+#define MSD_WB_FLUSH_FRAMES 1000
 
 #define DPRINTF(fmt, ...) OSDebugOut(TEXT(fmt), ##__VA_ARGS__)
 
@@ -51,12 +78,60 @@ enum USBMSDMode : int8_t {
     USB_MSDM_CSW /* Command Status.  */
 };
 
+enum USBMSDIOState {
+    USB_MSD_IO_IDLE,
+    USB_MSD_IO_PENDING, /* worker is reading/writing */
+    USB_MSD_IO_DONE, /* waiting to be picked up by handle_frame */
+};
+
+/* Pending writes keyed by file offset, adjacent ones are merged */
+typedef std::map<int64_t, std::vector<uint8_t>> ExtentMap;
+
 typedef struct ReqState {
     uint32_t tag;
     //
     bool valid;
+    uint8_t lun;
 } ReqState;
 
+/* Logical unit, each has its own image */
+typedef struct MSDLun {
+    DiskImage *image;
+    int64_t file_size;
+    uint32_t block_size; /* logical sector size */
+
+    /* Write-back, OUT data is collected here instead of written right away */
+    struct {
+        ExtentMap extents;
+        size_t bytes;
+        size_t max; /* 0 - disabled, every chunk goes to worker */
+        uint32_t age; /* frames since first pending write */
+        bool failed; /* a delayed write failed, reported by next sync */
+    } wb;
+
+    BlockCache cache;
+    /* Content hash for save states, stale blocks are hashed in background */
+    ImageHash hash;
+    int64_t last_block; /* for counting hits once per block */
+
+    /* Sequential read detection */
+    struct {
+        int64_t next_off; /* where next READ continues if sequential */
+        uint32_t window; /* blocks to read ahead, grows while sequential */
+        uint32_t max;
+    } ra;
+
+    /* Image mapped into memory, file data phases copy straight to/from it
+       and skip the worker thread */
+    struct {
+        uint8_t *ptr;
+        size_t dirty; /* bytes written since last flush */
+#if defined(_WIN32)
+        HANDLE handle;
+#endif
+    } map;
+} MSDLun;
+
 typedef struct MSDState {
     USBDevice dev;
 
@@ -75,11 +150,38 @@ typedef struct MSDState {
         uint8_t last_cmd;
         ReqState req;
 
-        //TODO how to detect if image is different
-        uint32_t hash;
+        uint32_t hash; /* of image contents when saved, 0 - unknown */
     } f; //freezable
 
-    FILE *file;
+    MSDLun luns[MSD_MAX_LUNS];
+    int nluns;
+    MSDLun *lun; /* addressed by current command */
+    int64_t file_off; /* where next chunk of current READ/WRITE goes */
+
+    /* File reads/writes run on worker thread so slow storage doesn't stall emulation */
+    struct {
+        std::thread thread;
+        std::mutex mutex;
+        std::condition_variable cv;
+        USBMSDIOState state;
+        bool quit;
+        bool write;
+        bool fill; /* reading cache blocks to fill_buf */
+        bool hash; /* reading a stale hash block to hash_buf */
+        bool demand; /* guest is waiting for the fill */
+        bool flush; /* writing out 'extents' */
+        bool ok;
+        MSDLun *lun;
+        int64_t offset;
+        size_t len;
+        /* part of packet's buffers the file data goes to/comes from */
+        struct iovec iov[MSD_IO_MAX_IOV];
+        int niov;
+        std::vector<uint8_t> fill_buf;
+        std::vector<uint8_t> hash_buf;
+        ExtentMap extents;
+    } io;
+
     //char fn[MAX_PATH+1]; //TODO Could use with open/close,
                             //but error recovery currently can't deal with file suddenly
                             //becoming not accessible
@@ -310,6 +412,7 @@ static const USBDescStrings desc_strings = {
 #define WRITE_16 0x8a
 #define WRITE_VERIFY_16 0x8e
 #define SERVICE_ACTION_IN 0x9e
+#define SAI_READ_CAPACITY_16 0x10
 #define REPORT_LUNS 0xa0
 #define LOAD_UNLOAD 0xa6
 #define SET_CD_SPEED 0xbb
@@ -399,6 +502,10 @@ const struct SCSISense sense_code_UNRECOVERED_READ_ERROR = {
     MEDIUM_ERROR, 0x11, 0x00
 };
 
+const struct SCSISense sense_code_WRITE_PROTECTED = {
+    DATA_PROTECT, 0x27, 0x00
+};
+
 const struct SCSISense sense_code_INVALID_OPCODE = {
     ILLEGAL_REQUEST, 0x20, 0x00
 };
@@ -412,33 +519,74 @@ const struct SCSISense sense_code_OUT_OF_RANGE = {
 //    .key = ILLEGAL_REQUEST, .asc = 0x4b, .ascq = 0x01
 //};
 
-static int64_t get_file_size(FILE *file)
+/* Can fail for big images on 32-bit host, caller falls back to stdio then */
+static bool usb_msd_map_image(MSDLun *l)
 {
-    int fd;
+    if (!l->image->file() || l->file_size <= 0 || (uint64_t)l->file_size > SIZE_MAX)
+        return false;
 
 #if defined(_WIN32)
-    struct _stat64 buf;
-    fd = _fileno(file);
-    if (_fstat64(fd, &buf) != 0)
-        return -1;
-    return buf.st_size;
-#elif defined(__GNUC__)
-    struct stat64 buf;
-    fd = fileno(file);
-    if (fstat64(fd, &buf) != 0)
-        return -1;
-    return buf.st_size;
+    HANDLE fh = (HANDLE)_get_osfhandle(_fileno(l->image->file()));
+    l->map.handle = CreateFileMapping(fh, NULL, PAGE_READWRITE, 0, 0, NULL);
+    if (!l->map.handle)
+        return false;
+    l->map.ptr = (uint8_t *)MapViewOfFile(l->map.handle, FILE_MAP_WRITE, 0, 0, 0);
+    if (!l->map.ptr) {
+        CloseHandle(l->map.handle);
+        l->map.handle = NULL;
+        return false;
+    }
 #else
-    #error Unknown platform
+    void *ptr = mmap(NULL, (size_t)l->file_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED, fileno(l->image->file()), 0);
+    if (ptr == MAP_FAILED)
+        return false;
+    l->map.ptr = (uint8_t *)ptr;
 #endif
+    l->map.dirty = 0;
+    return true;
+}
 
+/* Push written data to the file, 'wait' blocks until it is on disk */
+static void usb_msd_map_flush(MSDLun *l, bool wait)
+{
+    if (!l->map.ptr || !l->map.dirty)
+        return;
+
+#if defined(_WIN32)
+    FlushViewOfFile(l->map.ptr, 0);
+    if (wait)
+        FlushFileBuffers((HANDLE)_get_osfhandle(_fileno(l->image->file())));
+#else
+    msync(l->map.ptr, (size_t)l->file_size, wait ? MS_SYNC : MS_ASYNC);
+#endif
+    l->map.dirty = 0;
+}
+
+static void usb_msd_unmap_image(MSDLun *l)
+{
+    if (!l->map.ptr)
+        return;
+
+    usb_msd_map_flush(l, true);
+#if defined(_WIN32)
+    UnmapViewOfFile(l->map.ptr);
+    CloseHandle(l->map.handle);
+    l->map.handle = NULL;
+#else
+    munmap(l->map.ptr, (size_t)l->file_size);
+#endif
+    l->map.ptr = NULL;
 }
 
+static void usb_msd_io_drain(MSDState *s);
+
 static void usb_msd_handle_reset(USBDevice *dev)
 {
     MSDState *s = (MSDState *)dev;
 
     DPRINTF("Reset\n");
+    usb_msd_io_drain(s);
     s->f.mode = USB_MSDM_CBW;
 }
 
@@ -456,6 +604,36 @@ static void usb_msd_handle_reset(USBDevice *dev)
 #define bswap16(x) ( (((x)>>8)&0xff) | (((x)<<8)&0xff00) )
 #endif
 
+/* Big-endian CDB fields, unaligned */
+static inline uint16_t lduw_be_p(const uint8_t *p)
+{
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static inline uint32_t ldl_be_p(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline uint64_t ldq_be_p(const uint8_t *p)
+{
+    return ((uint64_t)ldl_be_p(p) << 32) | ldl_be_p(p + 4);
+}
+
+static inline void stl_be_p(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static inline void stq_be_p(uint8_t *p, uint64_t v)
+{
+    stl_be_p(p, (uint32_t)(v >> 32));
+    stl_be_p(p + 4, (uint32_t)v);
+}
+
 static void set_sense(void *opaque, SCSISense sense)
 {
     MSDState *s = (MSDState *)opaque;
@@ -558,52 +736,671 @@ static void usb_msd_command_complete(MSDState *req, uint32_t status)
 
 static void usb_msd_copy_data(MSDState *s, USBPacket *p)
 {
-    size_t len, file_ret;
+    size_t len, copy;
     len = p->iov.size - p->actual_length;
     //if (len > s->scsi_len)
     //    len = s->scsi_len;
 
-    if (len > sizeof(s->f.buf))
-        len = sizeof(s->f.buf);
+    /* buffer may be consumed over several packets, anything past its end
+       is zeros (IN) or dropped (OUT) */
+    copy = MIN(len, sizeof(s->f.buf) - s->f.off);
+    usb_packet_copy(p, s->f.buf + s->f.off, copy);
+    usb_packet_skip(p, len - copy);
+
+    s->f.off += copy;
+    s->f.data_len -= len;
+    
+    usb_msd_command_complete (s, s->f.result);
+}
+
+/* Write extents and flush image */
+static bool usb_msd_wb_write(DiskImage *image, const ExtentMap &extents)
+{
+    bool ok = true;
+
+    for (const auto &e : extents) {
+        if (!image->write(e.first, e.second.data(), e.second.size()))
+            ok = false;
+    }
+    return image->flush() && ok;
+}
+
+static void usb_msd_io_thread(MSDState *s)
+{
+    std::unique_lock<std::mutex> lock(s->io.mutex);
+
+    while (true) {
+        s->io.cv.wait(lock, [s] { return s->io.quit || s->io.state == USB_MSD_IO_PENDING; });
+        if (s->io.quit)
+            break;
+
+        bool write = s->io.write;
+        int64_t offset = s->io.offset;
+        size_t len = s->io.len;
+        bool fill = s->io.fill;
+        bool hash = s->io.hash;
+        bool flush = s->io.flush;
+        bool ok;
+
+        lock.unlock();
+        if (flush) {
+            ok = usb_msd_wb_write(s->io.lun->image, s->io.extents);
+            s->io.extents.clear();
+        } else if (fill) {
+            ok = s->io.lun->image->read(offset, s->io.fill_buf.data(), len);
+        } else if (hash) {
+            ok = s->io.lun->image->read(offset, s->io.hash_buf.data(), len);
+        } else if (write) {
+            ok = s->io.lun->image->writev(offset, s->io.iov, s->io.niov);
+        } else {
+            ok = s->io.lun->image->readv(offset, s->io.iov, s->io.niov);
+        }
+        lock.lock();
+
+        s->io.ok = ok;
+        s->io.state = USB_MSD_IO_DONE;
+        s->io.cv.notify_all();
+    }
+}
+
+/* Worker reads/writes next 'len' bytes of packet's buffers in place,
+   caller checked it's idle */
+static void usb_msd_io_start(MSDState *s, USBPacket *p, bool write, size_t len)
+{
+    std::lock_guard<std::mutex> lock(s->io.mutex);
+    s->io.lun = s->lun;
+    s->io.write = write;
+    s->io.fill = false;
+    s->io.hash = false;
+    s->io.flush = false;
+    s->io.niov = iov_copy(s->io.iov, MSD_IO_MAX_IOV, p->iov.iov, p->iov.niov, p->actual_length, len);
+    s->io.offset = s->file_off;
+    s->io.len = iov_size(s->io.iov, s->io.niov);
+    s->io.state = USB_MSD_IO_PENDING;
+    s->file_off += s->io.len;
+    s->io.cv.notify_all();
+}
+
+/* Read 'count' cache blocks to io.fill_buf, clipped to end of image */
+static void usb_msd_io_fill(MSDState *s, int64_t block, size_t count, bool demand)
+{
+    std::lock_guard<std::mutex> lock(s->io.mutex);
+    s->io.lun = s->lun;
+    s->io.write = false;
+    s->io.fill = true;
+    s->io.hash = false;
+    s->io.flush = false;
+    s->io.niov = 0;
+    s->io.demand = demand;
+    s->io.offset = block * MSD_CACHE_BLOCK;
+    s->io.len = (size_t)MIN((int64_t)(count * MSD_CACHE_BLOCK), s->lun->file_size - s->io.offset);
+    s->io.state = USB_MSD_IO_PENDING;
+    s->io.cv.notify_all();
+
+    if (demand)
+        usb_stats.msd.cache_misses++;
+    else
+        usb_stats.msd.prefetched += count;
+}
+
+/* Hand pending writes of 'l' over to worker, caller checked it's idle */
+static void usb_msd_io_flush(MSDState *s, MSDLun *l)
+{
+    std::lock_guard<std::mutex> lock(s->io.mutex);
+    s->io.lun = l;
+    s->io.extents.swap(l->wb.extents);
+    s->io.write = true;
+    s->io.fill = false;
+    s->io.hash = false;
+    s->io.flush = true;
+    s->io.niov = 0;
+    s->io.state = USB_MSD_IO_PENDING;
+    s->io.cv.notify_all();
+
+    l->wb.bytes = 0;
+    l->wb.age = 0;
+}
+
+/* Read stale hash block to io.hash_buf, caller checked it's idle */
+static void usb_msd_io_hash(MSDState *s, MSDLun *l, int64_t block)
+{
+    std::lock_guard<std::mutex> lock(s->io.mutex);
+    s->io.lun = l;
+    s->io.write = false;
+    s->io.fill = false;
+    s->io.hash = true;
+    s->io.flush = false;
+    s->io.niov = 0;
+    s->io.offset = block * l->hash.block_size();
+    s->io.len = l->hash.block_len(block);
+    if (s->io.hash_buf.size() < s->io.len)
+        s->io.hash_buf.resize(s->io.len);
+    s->io.state = USB_MSD_IO_PENDING;
+    s->io.cv.notify_all();
+}
+
+static bool usb_msd_io_busy(MSDState *s)
+{
+    std::lock_guard<std::mutex> lock(s->io.mutex);
+    return s->io.state != USB_MSD_IO_IDLE;
+}
+
+/* Wait until file is up to date */
+static void usb_msd_io_wait(MSDState *s)
+{
+    std::unique_lock<std::mutex> lock(s->io.mutex);
+    s->io.cv.wait(lock, [s] { return s->io.state != USB_MSD_IO_PENDING; });
+}
+
+/* Wait and forget about the result, transfer is being aborted */
+static void usb_msd_io_drain(MSDState *s)
+{
+    std::unique_lock<std::mutex> lock(s->io.mutex);
+    s->io.cv.wait(lock, [s] { return s->io.state != USB_MSD_IO_PENDING; });
+    s->io.state = USB_MSD_IO_IDLE;
+}
+
+/* Read rest of IN packet straight into it */
+static void usb_msd_data_in(MSDState *s, USBPacket *p)
+{
+    size_t len = MIN(p->iov.size - p->actual_length, s->f.data_len);
+
+    DPRINTF("Deferring packet %p [wait data-in]\n", p);
+    s->packet = p;
+    p->status = USB_RET_ASYNC;
+    usb_msd_io_start(s, p, false, len);
+}
+
+/* Space for [off, off + len) in pending writes, merging with extents it
+   touches. Appending to an extent, the usual sequential case, grows it in place. */
+static uint8_t *usb_msd_wb_reserve(MSDLun *l, int64_t off, size_t len)
+{
+    ExtentMap &ext = l->wb.extents;
+    int64_t start = off, end = off + len;
+    ExtentMap::iterator first, last, it;
+
+    first = ext.upper_bound(off);
+    if (first != ext.begin()) {
+        it = std::prev(first);
+        if (it->first + (int64_t)it->second.size() >= off)
+            first = it;
+    }
+    for (last = first; last != ext.end() && last->first <= end; ++last)
+        ;
+
+    if (first != last && first->first <= off && std::next(first) == last) {
+        std::vector<uint8_t> &data = first->second;
+        size_t need = (size_t)(end - first->first);
+        if (need > data.size()) {
+            l->wb.bytes += need - data.size();
+            data.resize(need);
+        }
+        return data.data() + (off - first->first);
+    }
+
+    if (first != last) {
+        it = std::prev(last);
+        start = MIN(start, first->first);
+        end = MAX(end, it->first + (int64_t)it->second.size());
+    }
+
+    std::vector<uint8_t> data((size_t)(end - start));
+    for (it = first; it != last; ++it) {
+        memcpy(data.data() + (it->first - start), it->second.data(), it->second.size());
+        l->wb.bytes -= it->second.size();
+    }
+    ext.erase(first, last);
+    l->wb.bytes += data.size();
+
+    it = ext.emplace(start, std::move(data)).first;
+    return it->second.data() + (off - start);
+}
+
+/* Patch data just read from file with writes that are still pending */
+static void usb_msd_wb_overlay_iov(MSDLun *l, int64_t off, const struct iovec *iov, int cnt)
+{
+    ExtentMap &ext = l->wb.extents;
+    int64_t end = off + iov_size(iov, cnt);
+    ExtentMap::iterator it = ext.upper_bound(off);
+
+    if (it != ext.begin())
+        --it;
+    for (; it != ext.end() && it->first < end; ++it) {
+        int64_t a = MAX(off, it->first);
+        int64_t b = MIN(end, it->first + (int64_t)it->second.size());
+        if (a < b)
+            iov_from_buf(iov, cnt, (size_t)(a - off), it->second.data() + (a - it->first), (size_t)(b - a));
+    }
+}
+
+static void usb_msd_wb_overlay(MSDLun *l, int64_t off, uint8_t *buf, size_t len)
+{
+    struct iovec iov = { buf, len };
+    usb_msd_wb_overlay_iov(l, off, &iov, 1);
+}
+
+/* Flush pending writes in background once there is enough of them or
+   they have waited long enough */
+static void usb_msd_wb_tick(MSDState *s)
+{
+    for (int i = 0; i < s->nluns; i++) {
+        MSDLun *l = &s->luns[i];
+        if (l->wb.extents.empty())
+            continue;
+
+        l->wb.age++;
+        if ((l->wb.bytes >= l->wb.max || l->wb.age >= MSD_WB_FLUSH_FRAMES) && !usb_msd_io_busy(s))
+            usb_msd_io_flush(s, l);
+    }
+}
+
+/* Get everything written so far into the image file, waits for it */
+static bool usb_msd_sync(MSDState *s)
+{
+    bool ok = true;
+
+    usb_msd_io_wait(s);
+    /* read result not picked up yet predates the writes below */
+    if (s->io.state == USB_MSD_IO_DONE && !s->io.write) {
+        if (s->io.fill)
+            usb_msd_wb_overlay(s->io.lun, s->io.offset, s->io.fill_buf.data(), s->io.len);
+        else if (s->io.hash)
+            usb_msd_wb_overlay(s->io.lun, s->io.offset, s->io.hash_buf.data(), s->io.len);
+        else
+            usb_msd_wb_overlay_iov(s->io.lun, s->io.offset, s->io.iov, s->io.niov);
+    }
+
+    for (int i = 0; i < s->nluns; i++) {
+        MSDLun *l = &s->luns[i];
+        if (l->map.ptr) {
+            usb_msd_map_flush(l, true);
+            continue;
+        }
+
+        if (!usb_msd_wb_write(l->image, l->wb.extents) || l->wb.failed)
+            ok = false;
+        l->wb.extents.clear();
+        l->wb.bytes = 0;
+        l->wb.age = 0;
+        l->wb.failed = false;
+    }
+    return ok;
+}
+
+/* Move completed fill into cache, short last block is zero padded */
+static void usb_msd_cache_insert(MSDState *s)
+{
+    MSDLun *l = s->io.lun;
+    int64_t block = s->io.offset / MSD_CACHE_BLOCK;
+    size_t off;
+
+    usb_msd_wb_overlay(l, s->io.offset, s->io.fill_buf.data(), s->io.len);
+    for (off = 0; off < s->io.len; off += MSD_CACHE_BLOCK, block++) {
+        uint8_t *data = l->cache.insert(block);
+        size_t len = MIN(s->io.len - off, (size_t)MSD_CACHE_BLOCK);
+        if (!data)
+            continue;
+        memcpy(data, s->io.fill_buf.data() + off, len);
+        memset(data + len, 0, MSD_CACHE_BLOCK - len);
+    }
+}
+
+/* Completed background hash read, pending writes are newer than the file */
+static void usb_msd_hash_insert(MSDState *s)
+{
+    MSDLun *l = s->io.lun;
+
+    usb_msd_wb_overlay(l, s->io.offset, s->io.hash_buf.data(), s->io.len);
+    l->hash.set_block(s->io.offset / l->hash.block_size(), s->io.hash_buf.data());
+}
+
+/* Hash a stale block while device is between commands, so save states
+   only have to hash what was written recently */
+static void usb_msd_hash_tick(MSDState *s)
+{
+    if (s->f.mode != USB_MSDM_CBW || s->packet)
+        return;
+
+    for (int i = 0; i < s->nluns; i++) {
+        MSDLun *l = &s->luns[i];
+        int64_t block;
+
+        if (!l->hash.stale())
+            continue;
+
+        block = l->hash.next_stale();
+        if (l->map.ptr)
+            l->hash.set_block(block, l->map.ptr + block * l->hash.block_size());
+        else if (!usb_msd_io_busy(s))
+            usb_msd_io_hash(s, l, block);
+        return;
+    }
+}
+
+/* Content hash of all LUNs for save states, from what the background pass
+   has hashed so far. 0 (unknown) while anything is still stale, a save or
+   load never reads the image on the emulation thread to finish it. */
+static uint32_t usb_msd_image_hash(MSDState *s)
+{
+    uint64_t h[2] = {0, 0};
+
+    for (int i = 0; i < s->nluns; i++) {
+        MSDLun *l = &s->luns[i];
+
+        if (l->hash.stale())
+            return 0;
+
+        h[1] = l->hash.root();
+        h[0] = ImageHash::Hash((const uint8_t *)h, sizeof(h), i);
+    }
+
+    /* 0 is for old save states without a hash */
+    return (uint32_t)(h[0] ^ (h[0] >> 32)) | 1;
+}
+
+/* Number of uncached blocks from 'block' on, up to 'max' */
+static size_t usb_msd_cache_gap(MSDLun *l, int64_t block, size_t max)
+{
+    int64_t last = (l->file_size - 1) / MSD_CACHE_BLOCK;
+    size_t n = 0;
+
+    while (n < max && block + (int64_t)n <= last && !l->cache.contains(block + n))
+        n++;
+    return n;
+}
+
+/* Keep read-ahead window in front of a sequential reader filled */
+static void usb_msd_prefetch(MSDState *s)
+{
+    int64_t block = s->file_off / MSD_CACHE_BLOCK;
+    int64_t end = block + s->lun->ra.window;
+    size_t count;
+
+    if (!s->lun->ra.window || usb_msd_io_busy(s))
+        return;
+
+    while (block < end && s->lun->cache.contains(block))
+        block++;
+    count = usb_msd_cache_gap(s->lun, block, (size_t)(end - block));
+    if (count)
+        usb_msd_io_fill(s, block, count, false);
+}
+
+/* Serve IN packet from cache. Returns false if it has to wait for a
+   block, fill is already started then or will be by handle_frame. */
+static bool usb_msd_cache_in(MSDState *s, USBPacket *p)
+{
+    while (s->f.data_len && (size_t)p->actual_length < p->iov.size) {
+        int64_t block = s->file_off / MSD_CACHE_BLOCK;
+        size_t off = (size_t)(s->file_off % MSD_CACHE_BLOCK);
+        const uint8_t *data = s->lun->cache.lookup(block);
+        size_t len;
+
+        if (!data) {
+            s->lun->last_block = block;
+            if (!usb_msd_io_busy(s))
+                usb_msd_io_fill(s, block, usb_msd_cache_gap(s->lun, block, 1 + s->lun->ra.window), true);
+            return false;
+        }
+
+        if (block != s->lun->last_block) {
+            s->lun->last_block = block;
+            usb_stats.msd.cache_hits++;
+        }
+
+        len = MIN(p->iov.size - p->actual_length, s->f.data_len);
+        len = MIN(len, MSD_CACHE_BLOCK - off);
+        usb_packet_copy(p, (void *)(data + off), len);
+        s->file_off += len;
+        s->f.data_len -= len;
+    }
+
+    usb_msd_prefetch(s);
+    return true;
+}
+
+/* Write rest of OUT packet straight from its buffers. Returns true if
+   packet is deferred until worker is done with them. */
+static bool usb_msd_data_out(MSDState *s, USBPacket *p)
+{
+    size_t len = MIN(p->iov.size - p->actual_length, s->f.data_len);
+    int64_t off = s->file_off;
+
+    /* after a failed write just swallow the rest */
+    if (!len || s->f.result != COMMAND_PASSED) {
+        usb_packet_skip(p, len);
+        s->f.data_len -= len;
+        return false;
+    }
+
+    DPRINTF("Deferring packet %p [wait data-out]\n", p);
+    s->packet = p;
+    p->status = USB_RET_ASYNC;
+    usb_msd_io_start(s, p, true, len);
+    s->lun->hash.invalidate(off, s->io.len);
+    /* worker only reads the buffers too */
+    for (int i = 0; i < s->io.niov; i++) {
+        s->lun->cache.update(off, (const uint8_t *)s->io.iov[i].iov_base, s->io.iov[i].iov_len);
+        off += s->io.iov[i].iov_len;
+    }
+    return true;
+}
+
+/* Write-back: move next chunk of OUT data to pending writes */
+static void usb_msd_wb_data_out(MSDState *s, USBPacket *p)
+{
+    size_t len = MIN(p->iov.size - p->actual_length, s->f.data_len);
+
+    if (s->f.result != COMMAND_PASSED) {
+        usb_packet_skip(p, len);
+    } else {
+        uint8_t *data = usb_msd_wb_reserve(s->lun, s->file_off, len);
+        usb_packet_copy(p, data, len);
+        s->lun->cache.update(s->file_off, data, len);
+        s->lun->hash.invalidate(s->file_off, len);
+    }
+    s->file_off += len;
+    s->f.data_len -= len;
+
+    if (s->f.data_len == 0)
+        usb_msd_command_complete(s, s->f.result);
+}
+
+/* All write data is in and on disk */
+static void usb_msd_data_out_done(MSDState *s)
+{
+    if (s->f.data_len == 0 && !usb_msd_io_busy(s))
+        usb_msd_command_complete(s, s->f.result);
+}
+
+/* Mapped image: move next chunk of file data between packet and mapping
+   synchronously, no bounce buffer or seek */
+static void usb_msd_map_data(MSDState *s, USBPacket *p)
+{
+    size_t len = MIN(p->iov.size - p->actual_length, s->f.data_len);
+
+    if (p->pid == USB_TOKEN_OUT && s->f.result != COMMAND_PASSED) {
+        /* after a failed write just swallow the rest */
+        usb_packet_skip(p, len);
+    } else {
+        usb_packet_copy(p, s->lun->map.ptr + s->file_off, len);
+        if (p->pid == USB_TOKEN_OUT) {
+            s->lun->hash.invalidate(s->file_off, len);
+            s->lun->map.dirty += len;
+            if (s->lun->map.dirty >= MSD_MAP_FLUSH_BYTES)
+                usb_msd_map_flush(s->lun, false);
+        }
+    }
+    s->file_off += len;
+    s->f.data_len -= len;
+
+    if (s->f.data_len == 0)
+        usb_msd_command_complete(s, s->f.result);
+}
+
+static void usb_msd_handle_frame(USBDevice *dev)
+{
+    MSDState *s = (MSDState *)dev;
+    USBPacket *p;
+    bool ok, write, fill, demand, flush, hash;
+    size_t len;
+
+    usb_msd_wb_tick(s);
+    usb_msd_hash_tick(s);
 
-    //TODO No async reader/writer so do it right here
-    if (s->f.tag == s->f.file_op_tag)
     {
-        switch (s->f.mode) {
-        case USB_MSDM_DATAOUT:
-            usb_packet_copy(p, s->f.buf, len);
-            if (len > 0 && (file_ret = fwrite(s->f.buf, 1, len, s->file)) < len)
-            {
-                DPRINTF("Write failed: %d!=%d\n", len, file_ret);
-                s->f.result = COMMAND_FAILED; //PHASE_ERROR;
-                set_sense(s, SENSE_CODE(WRITE_FAULT));
-                goto fail;
+        std::lock_guard<std::mutex> lock(s->io.mutex);
+        if (s->io.state != USB_MSD_IO_DONE)
+            return;
+        s->io.state = USB_MSD_IO_IDLE;
+        ok = s->io.ok;
+        write = s->io.write;
+        fill = s->io.fill;
+        demand = s->io.demand;
+        flush = s->io.flush;
+        hash = s->io.hash;
+        len = s->io.len;
+    }
+
+    p = s->packet;
+    if (flush) {
+        if (!ok) {
+            fprintf(stderr, "usb-msd: Delayed write failed\n");
+            s->io.lun->wb.failed = true;
+        }
+    } else if (fill) {
+        if (ok) {
+            usb_msd_cache_insert(s);
+        } else if (demand) {
+            DPRINTF("Read failed\n");
+            s->f.result = COMMAND_FAILED;
+            set_sense(s, SENSE_CODE(UNRECOVERED_READ_ERROR));
+            if (p && p->pid == USB_TOKEN_IN) {
+                p->actual_length = 0;
+                p->status = USB_RET_STALL;
+                usb_msd_packet_complete(s);
+                return;
             }
-            break;
-        case USB_MSDM_DATAIN:
-            if((file_ret = fread(s->f.buf, 1, p->iov.size, s->file)) < p->iov.size) {
-                s->f.result = COMMAND_FAILED;
-                set_sense(s, SENSE_CODE(UNRECOVERED_READ_ERROR));
-                goto fail;
+        }
+        /* failed prefetch is retried as demand read when guest gets there */
+    } else if (hash) {
+        /* failed block stays stale and is tried again */
+        if (ok)
+            usb_msd_hash_insert(s);
+    } else if (!ok) {
+        DPRINTF("%s failed\n", write ? "Write" : "Read");
+        s->f.result = COMMAND_FAILED;
+        set_sense(s, write ? SENSE_CODE(WRITE_FAULT) : SENSE_CODE(UNRECOVERED_READ_ERROR));
+    }
+
+    if (fill || flush || hash) {
+        /* IN packet waiting for a block or for worker to be free */
+        if (p && s->f.mode == USB_MSDM_DATAIN && p->pid == USB_TOKEN_IN) {
+            if (!s->lun->cache.capacity()) {
+                usb_msd_data_in(s, p);
+                return;
             }
-            usb_packet_copy(p, s->f.buf, len);
-            break;
-        default: //TODO
-        fail:
+            if (!usb_msd_cache_in(s, p))
+                return;
+            s->packet = NULL;
+            usb_msd_command_complete(s, s->f.result);
+            p->status = USB_RET_SUCCESS;
+            usb_packet_complete(&s->dev, p);
+            return;
+        }
+        /* otherwise a write may be waiting for worker to be free */
+        if (s->f.mode != USB_MSDM_DATAOUT)
+            return;
+    } else if (!write) {
+        if (!p) /* cancelled */
+            return;
+
+        if (!ok) {
             p->actual_length = 0;
             p->status = USB_RET_STALL;
+            usb_msd_packet_complete(s);
+            return;
+        }
+
+        /* data is already in the packet */
+        usb_msd_wb_overlay_iov(s->io.lun, s->io.offset, s->io.iov, s->io.niov);
+        p->actual_length += len;
+        s->f.data_len -= len;
+        if (s->f.data_len && (size_t)p->actual_length < p->iov.size) {
+            usb_msd_data_in(s, p);
             return;
         }
+
+        s->packet = NULL;
+        usb_msd_command_complete(s, s->f.result);
+        p->status = USB_RET_SUCCESS;
+        usb_packet_complete(&s->dev, p);
+        return;
+    } else {
+        if (!p) /* cancelled */
+            return;
+
+        /* packet's data has been written, or failed to */
+        p->actual_length += len;
+        s->f.data_len -= len;
     }
-    else
-        usb_packet_copy(p, s->f.buf + s->f.off, len);
 
-    s->f.off += len;
-    s->f.data_len -= len;
-    
-    //XXX Now continue async activity or...
-    // Force complete, no async support right now
-    usb_msd_command_complete (s, s->f.result);
+    /* OUT packet that was waiting for worker or has more to write */
+    if (p && s->f.mode == USB_MSDM_DATAOUT && p->pid == USB_TOKEN_OUT) {
+        if ((size_t)p->actual_length < p->iov.size && usb_msd_data_out(s, p))
+            return;
+        p->status = USB_RET_SUCCESS;
+        usb_msd_packet_complete(s);
+    } else if (p && s->f.mode == USB_MSDM_DATAIN && p->pid == USB_TOKEN_IN) {
+        usb_msd_data_in(s, p);
+        return;
+    }
+
+    /* also completes status packet waiting for the write */
+    usb_msd_data_out_done(s);
+}
+
+/* Decode LBA and block count of READ/WRITE 10/12/16, sets up data phase.
+   Returns false if request doesn't fit the image, sense is set then. */
+static bool usb_msd_parse_rw(MSDState *s, struct usb_msd_cbw *cbw,
+                             uint64_t *lba, uint32_t *xfer_len)
+{
+    uint64_t blocks = s->lun->file_size / s->lun->block_size;
+
+    switch (cbw->cmd[0]) {
+    case READ_16:
+    case WRITE_16:
+        *lba = ldq_be_p(&cbw->cmd[2]);
+        *xfer_len = ldl_be_p(&cbw->cmd[10]);
+        break;
+    case READ_12:
+    case WRITE_12:
+        *lba = ldl_be_p(&cbw->cmd[2]);
+        *xfer_len = ldl_be_p(&cbw->cmd[6]);
+        break;
+    default:
+        *lba = ldl_be_p(&cbw->cmd[2]);
+        *xfer_len = lduw_be_p(&cbw->cmd[7]);
+        break;
+    }
+
+    /* residue and data_len are 32-bit */
+    if ((uint64_t)*xfer_len * s->lun->block_size > 0xFFFFFFFF) {
+        s->f.data_len = 0;
+        s->f.result = COMMAND_FAILED;
+        set_sense(s, SENSE_CODE(OUT_OF_RANGE));
+        return false;
+    }
+
+    s->f.data_len = *xfer_len * s->lun->block_size;
+    /* data phase does the actual reading/writing on io thread */
+    s->file_off = (int64_t)(*lba * s->lun->block_size);
+    if (*lba > blocks || *xfer_len > blocks - *lba) {
+        s->f.result = COMMAND_FAILED;
+        set_sense(s, SENSE_CODE(OUT_OF_RANGE));
+        return false;
+    }
+    return true;
 }
 
 static void send_command(void *opaque, struct usb_msd_cbw *cbw)
@@ -611,7 +1408,7 @@ static void send_command(void *opaque, struct usb_msd_cbw *cbw)
     MSDState *s = (MSDState *)opaque;
     DPRINTF("Command: lun=%d tag=0x%x len %zd data=0x%02x\n", cbw->lun, cbw->tag, cbw->data_len, cbw->cmd[0]);
 
-    int64_t lba;
+    uint64_t lba, last_lba;
     uint32_t xfer_len;
     s->f.last_cmd = cbw->cmd[0];
 
@@ -647,104 +1444,93 @@ static void send_command(void *opaque, struct usb_msd_cbw *cbw)
         break;
 
     case READ_CAPACITY_10:
-        int64_t fsize, lbas;
-        uint32_t *last_lba, *blk_len;
-
         memset(s->f.buf, 0, sizeof(s->f.buf));
 
-        fsize = get_file_size(s->file);
-
-        if (fsize == -1) //TODO
+        if (s->lun->file_size == -1) //TODO
         {
             s->f.result = COMMAND_FAILED;
             set_sense(s, SENSE_CODE(UNKNOWN_ERROR));
             break;
         }
 
-        last_lba = (uint32_t*)&s->f.buf[0];
-        blk_len = (uint32_t*)&s->f.buf[4]; //in bytes
-        //right?
-        *blk_len = LBA_BLOCK_SIZE;//descriptor is currently max 64 bytes for bulk though
+        /* address of the last block, not the block count */
+        last_lba = s->lun->file_size / s->lun->block_size - 1;
+        /* too big, tells host to use READ_CAPACITY_16 instead */
+        if (last_lba > 0xFFFFFFFF)
+            last_lba = 0xFFFFFFFF;
 
-        lbas = fsize / LBA_BLOCK_SIZE;
-        if (lbas > 0xFFFFFFFF) {
-            DPRINTF("Maximum LBA is out of range!\n");
+        DPRINTF("read capacity lba=0x%llx, block=0x%x\n", last_lba, s->lun->block_size);
+
+        stl_be_p(&s->f.buf[0], (uint32_t)last_lba);
+        stl_be_p(&s->f.buf[4], s->lun->block_size);
+        break;
+
+    case SERVICE_ACTION_IN:
+        if ((cbw->cmd[1] & 0x1f) != SAI_READ_CAPACITY_16) {
             s->f.result = COMMAND_FAILED;
-            set_sense(s, SENSE_CODE(OUT_OF_RANGE));
-            *last_lba = 0xFFFFFFFF;
+            set_sense(s, SENSE_CODE(INVALID_OPCODE));
+            break;
         }
-        else
-            *last_lba = static_cast<uint32_t>(lbas);
 
-        DPRINTF("read capacity lba=0x%x, block=0x%x\n", *last_lba, *blk_len);
+        memset(s->f.buf, 0, sizeof(s->f.buf));
+        last_lba = s->lun->file_size / s->lun->block_size - 1;
+
+        DPRINTF("read capacity(16) lba=0x%llx, block=0x%x\n", last_lba, s->lun->block_size);
 
-        *last_lba = bswap32(*last_lba);
-        *blk_len = bswap32(*blk_len);
+        stq_be_p(&s->f.buf[0], last_lba);
+        stl_be_p(&s->f.buf[8], s->lun->block_size);
+        /* rest of the 32 bytes: no protection, one logical block per physical */
         break;
 
+    case READ_16:
     case READ_12:
     case READ_10:
-        lba = bswap32(*(uint32_t *)&cbw->cmd[2]);
-        if(cbw->cmd[0] == READ_10)
-            xfer_len = bswap16(*(uint16_t *)&cbw->cmd[7]);
-        else
-            xfer_len = bswap32(*(uint32_t *)&cbw->cmd[6]);
+        if (!usb_msd_parse_rw(s, cbw, &lba, &xfer_len))
+            return;
 
-        s->f.data_len = xfer_len * LBA_BLOCK_SIZE;
         s->f.file_op_tag = s->f.tag;
 
-        DPRINTF("read lba=0x%llx, len=0x%x\n", lba, xfer_len * LBA_BLOCK_SIZE);
+        DPRINTF("read lba=0x%llx, len=0x%x\n", lba, s->f.data_len);
 
         if(xfer_len == 0) // nothing to do
             break;
 
-        if(fseeko64(s->file, lba * LBA_BLOCK_SIZE, SEEK_SET)) {
-            s->f.result = COMMAND_FAILED;
-            //TODO use errno
-            int64_t fsize = get_file_size(s->file);
-            if ((lba + xfer_len) * LBA_BLOCK_SIZE > fsize)
-                set_sense(s, SENSE_CODE(OUT_OF_RANGE));
-            else
-                set_sense(s, SENSE_CODE(NO_SEEK_COMPLETE));
-            return;
-        }
-
-        //memset(s->f.buf, 0, sizeof(s->f.buf));
-        //Or do actual reading in USB_MSDM_DATAIN?
-        //TODO probably dont set data_len to read length
-        //if(!(s->f.data_len = fread(s->f.buf, 1, /*s->f.data_len*/ xfer_len * LBA_BLOCK_SIZE, s->file))) {
-        //  s->f.result = PHASE_ERROR;
-        //  set_sense(s, SENSE_CODE(UNRECOVERED_READ_ERROR));
-        //}
+        /* grow read-ahead while guest keeps reading where it left off */
+        if (s->file_off == s->lun->ra.next_off)
+            s->lun->ra.window = MIN(MAX(s->lun->ra.window * 2, 1u), s->lun->ra.max);
+        else
+            s->lun->ra.window = 0;
+        s->lun->ra.next_off = s->file_off + s->f.data_len;
         break;
 
+    case WRITE_16:
     case WRITE_12:
     case WRITE_10:
-        lba = bswap32(*(uint32_t *)&cbw->cmd[2]);
-        if(cbw->cmd[0] == WRITE_10)
-            xfer_len = bswap16(*(uint16_t *)&cbw->cmd[7]);
-        else
-            xfer_len = bswap32(*(uint32_t *)&cbw->cmd[6]);
-        DPRINTF("write lba=0x%x, len=0x%x\n", lba, xfer_len * LBA_BLOCK_SIZE);
+        if (!usb_msd_parse_rw(s, cbw, &lba, &xfer_len))
+            return;
 
-        s->f.data_len = xfer_len * LBA_BLOCK_SIZE;
         s->f.file_op_tag = s->f.tag;
 
+        DPRINTF("write lba=0x%llx, len=0x%x\n", lba, s->f.data_len);
+
         if(xfer_len == 0) //nothing to do
           break;
-        if(fseeko64(s->file, lba * LBA_BLOCK_SIZE, SEEK_SET)) {
+        if (s->lun->image->read_only()) {
             s->f.result = COMMAND_FAILED;
-            //TODO use errno
-            int64_t fsize = get_file_size(s->file);
-            if ((lba + xfer_len) * LBA_BLOCK_SIZE > fsize)
-                set_sense(s, SENSE_CODE(OUT_OF_RANGE));
-            else
-                set_sense(s, SENSE_CODE(NO_SEEK_COMPLETE));
+            set_sense(s, SENSE_CODE(WRITE_PROTECTED));
             return;
         }
 
         //Actual write comes with next command in USB_MSDM_DATAOUT
         break;
+
+    case SYNCHRONIZE_CACHE:
+        DPRINTF("synchronize cache\n");
+        if (!usb_msd_sync(s)) {
+            s->f.result = COMMAND_FAILED;
+            set_sense(s, SENSE_CODE(WRITE_FAULT));
+        }
+        break;
     default:
         DPRINTF("usb-msd: invalid command %d\n", cbw->cmd[0]);
         s->f.result = COMMAND_FAILED;
@@ -772,11 +1558,12 @@ static void usb_msd_handle_control(USBDevice *dev, USBPacket *p, int request, in
     case ClassInterfaceOutRequest | MassStorageReset:
         /* Reset state ready for the next CBW.  */
         DPRINTF("Resetting msd...\n");
+        usb_msd_io_drain(s);
         s->f.mode = USB_MSDM_CBW;
         ret = 0;
         break;
     case ClassInterfaceRequest | GetMaxLun:
-        data[0] = 0;
+        data[0] = s->nluns - 1;
         p->actual_length = 1;
         break;
     default:
@@ -792,6 +1579,17 @@ static void usb_msd_cancel_io(USBDevice *dev, USBPacket *p)
 
     assert(s->packet == p);
     s->packet = NULL;
+    /* worker may still be using packet's buffers. Its result belongs to this
+       packet only, drop it so it isn't credited to the next one, which then
+       redoes the transfer from the same offset. */
+    if (s->io.niov) {
+        std::unique_lock<std::mutex> lock(s->io.mutex);
+        s->io.cv.wait(lock, [s] { return s->io.state != USB_MSD_IO_PENDING; });
+        if (s->io.state == USB_MSD_IO_DONE) {
+            s->io.state = USB_MSD_IO_IDLE;
+            s->file_off -= s->io.len;
+        }
+    }
 
     if (s->f.req.valid) {
         //scsi_req_cancel(s->req);
@@ -828,10 +1626,11 @@ static void usb_msd_handle_data(USBDevice *dev, USBPacket *p)
                 goto fail;
             }
             DPRINTF("Command on LUN %d\n", cbw.lun);
-            if (cbw.lun != 0) {
+            if (cbw.lun >= s->nluns) {
                 fprintf(stderr, "usb-msd: Bad LUN %d\n", cbw.lun);
                 goto fail;
             }
+            s->lun = &s->luns[cbw.lun];
             s->f.tag = le32_to_cpu(cbw.tag);
             s->f.data_len = le32_to_cpu(cbw.data_len);
             if (s->f.data_len == 0) {
@@ -847,6 +1646,7 @@ static void usb_msd_handle_data(USBDevice *dev, USBPacket *p)
             //async fread/fwrite handle or something
             s->f.req.valid = true;
             s->f.req.tag = le32_to_cpu(cbw.tag);
+            s->f.req.lun = cbw.lun;
             send_command(s, &cbw);
             break;
 
@@ -861,6 +1661,27 @@ static void usb_msd_handle_data(USBDevice *dev, USBPacket *p)
             if (p->iov.size == 0) //TODO send status?
                 goto send_csw;
 
+            if (s->f.tag == s->f.file_op_tag) {
+                if (s->lun->map.ptr) {
+                    usb_msd_map_data(s, p);
+                    break;
+                }
+                if (s->lun->wb.max) {
+                    usb_msd_wb_data_out(s, p);
+                    break;
+                }
+                if (usb_msd_io_busy(s)) {
+                    DPRINTF("Deferring packet %p [wait io]\n", p);
+                    s->packet = p;
+                    p->status = USB_RET_ASYNC;
+                    break;
+                }
+                if (usb_msd_data_out(s, p))
+                    break;
+                usb_msd_data_out_done(s);
+                break;
+            }
+
             //if (s->scsi_len)
             {
                 usb_msd_copy_data(s, p);
@@ -938,6 +1759,33 @@ static void usb_msd_handle_data(USBDevice *dev, USBPacket *p)
                 goto fail;
             }
 
+            if (s->f.tag == s->f.file_op_tag) {
+                if (s->f.result != COMMAND_PASSED)
+                    goto fail;
+                if (s->lun->map.ptr) {
+                    usb_msd_map_data(s, p);
+                    break;
+                }
+                if (s->lun->cache.capacity()) {
+                    if (!usb_msd_cache_in(s, p)) {
+                        DPRINTF("Deferring packet %p [wait cache]\n", p);
+                        s->packet = p;
+                        p->status = USB_RET_ASYNC;
+                    } else if (s->f.data_len == 0) {
+                        usb_msd_command_complete(s, s->f.result);
+                    }
+                    break;
+                }
+                if (usb_msd_io_busy(s)) {
+                    DPRINTF("Deferring packet %p [wait io]\n", p);
+                    s->packet = p;
+                    p->status = USB_RET_ASYNC;
+                    break;
+                }
+                usb_msd_data_in(s, p);
+                break;
+            }
+
             //if (s->scsi_len)
             {
                 usb_msd_copy_data(s, p);
@@ -978,36 +1826,140 @@ static void usb_msd_handle_data(USBDevice *dev, USBPacket *p)
 static void usb_msd_handle_destroy(USBDevice *dev)
 {
     MSDState *s = (MSDState *)dev;
-    if (s && s->file)
+    if (s && s->nluns)
+        usb_msd_sync(s);
+    if (s && s->io.thread.joinable())
     {
-        fclose(s->file);
-        s->file = NULL;
+        {
+            std::lock_guard<std::mutex> lock(s->io.mutex);
+            s->io.quit = true;
+            s->io.cv.notify_all();
+        }
+        s->io.thread.join();
+    }
+    for (int i = 0; s && i < MSD_MAX_LUNS; i++) {
+        if (!s->luns[i].image)
+            continue;
+        usb_msd_unmap_image(&s->luns[i]);
+        delete s->luns[i].image;
     }
     delete s;
 }
 
+/* LUN 0 uses plain ini keys, others get LUN number appended: path1, overlay1 ... */
+static TSTDSTRING usb_msd_lun_key(const TCHAR *name, int n)
+{
+    TSTDSTRING key = name;
+    if (n)
+        key += (TCHAR)(TEXT('0') + n);
+    return key;
+}
+
+/* mmap and cache sizes can be set per LUN too, plain key is the default for all */
+static bool usb_msd_lun_setting(const char *type, int port, const std::string &api, const TCHAR *name, int n, int32_t &value)
+{
+    return (n && LoadSetting(type, port, api, usb_msd_lun_key(name, n).c_str(), value))
+        || LoadSetting(type, port, api, name, value);
+}
+
+/* Open image of LUN 'n' and set up its caches. Returns false if it is
+   not configured or can't be opened. */
+static bool usb_msd_open_lun(MSDState *s, int port, const std::string &api, int n, bool &need_worker)
+{
+    const char *type = MsdDevice::TypeName();
+    MSDLun *l = &s->luns[n];
+    TSTDSTRING path, overlay;
+    int32_t use_map, block_size;
+
+    if (!LoadSetting(type, port, api, usb_msd_lun_key(N_CONFIG_PATH, n).c_str(), path) || path.empty())
+        return false;
+
+    /* with an overlay, base image can be shared and is only read */
+    if (LoadSetting(type, port, api, usb_msd_lun_key(N_CONFIG_OVERLAY, n).c_str(), overlay) && !overlay.empty()) {
+        DiskImage *base = DiskImage::Open(path, false);
+        if (base)
+            l->image = OverlayImage::Open(base, overlay);
+        if (!l->image) {
+            SysMessage(TEXT("usb-msd: Could not open image file '%s' with overlay '%s'\n"),
+                path.c_str(), overlay.c_str());
+            return false;
+        }
+    } else {
+        /* compressed or read-only image file is write protected */
+        l->image = DiskImage::Open(path, true);
+        if (!l->image) {
+            SysMessage(TEXT("usb-msd: Could not open image file '%s'\n"), path.c_str());
+            return false;
+        }
+    }
+
+    l->file_size = l->image->size();
+    l->hash.reset(l->file_size);
+
+    /* 4K sectors only for guests that can handle them */
+    if (!LoadSetting(type, port, api, usb_msd_lun_key(N_CONFIG_BLOCK_SIZE, n).c_str(), block_size)
+        || block_size != 4096)
+        block_size = LBA_BLOCK_SIZE;
+    l->block_size = (uint32_t)block_size;
+
+    /* READ CAPACITY reports last LBA, there has to be one */
+    if (l->file_size < block_size) {
+        SysMessage(TEXT("usb-msd: Image file '%s' is smaller than one %d byte block\n"), path.c_str(), block_size);
+        delete l->image;
+        l->image = nullptr;
+        return false;
+    }
+
+    if (!usb_msd_lun_setting(type, port, api, N_CONFIG_MMAP, n, use_map))
+        use_map = 0;
+    if (!use_map || !usb_msd_map_image(l)) {
+        int32_t cache_kb, ra_kb, wb_kb;
+
+        if (use_map)
+            fprintf(stderr, "usb-msd: Could not map image file, using stdio\n");
+
+        if (!usb_msd_lun_setting(type, port, api, N_CONFIG_CACHE, n, cache_kb) || cache_kb < 0)
+            cache_kb = MSD_CACHE_KB;
+        if (!usb_msd_lun_setting(type, port, api, N_CONFIG_READAHEAD, n, ra_kb) || ra_kb < 0)
+            ra_kb = MSD_READAHEAD_KB;
+        if (!usb_msd_lun_setting(type, port, api, N_CONFIG_WRITEBACK, n, wb_kb) || wb_kb < 0)
+            wb_kb = MSD_WRITEBACK_KB;
+        l->wb.max = (size_t)wb_kb * 1024;
+
+        /* read-ahead shouldn't evict what it is ahead of */
+        size_t blocks = (size_t)cache_kb * 1024 / MSD_CACHE_BLOCK;
+        l->ra.max = (uint32_t)MIN((size_t)ra_kb * 1024 / MSD_CACHE_BLOCK, blocks / 2);
+        l->cache.resize(MSD_CACHE_BLOCK, blocks);
+        if (s->io.fill_buf.size() < (1 + l->ra.max) * MSD_CACHE_BLOCK)
+            s->io.fill_buf.resize((1 + l->ra.max) * MSD_CACHE_BLOCK);
+        l->last_block = -1;
+        l->ra.next_off = -1;
+        need_worker = true;
+    }
+    return true;
+}
+
 USBDevice *MsdDevice::CreateDevice(int port)
 {
     MSDState *s = new MSDState();
+    bool need_worker = false;
 
     //CONFIGVARIANT varApi(N_DEVICE_API, CONFIG_TYPE_CHAR);
     //LoadSetting(port, DEVICENAME, varApi);
     std::string api = *MsdDevice::ListAPIs().begin();
 
-    TSTDSTRING var;
+    /* LUNs are numbered without gaps, first one missing ends the list */
+    while (s->nluns < MSD_MAX_LUNS && usb_msd_open_lun(s, port, api, s->nluns, need_worker))
+        s->nluns++;
 
-    if (!LoadSetting(TypeName(), port, api, N_CONFIG_PATH, var))
-    {
+    if (!s->nluns) {
         fprintf(stderr, "usb-msd: Could not load settings\n");
-        delete s;
-        return NULL;
-    }
-
-    s->file = wfopen(var.c_str(), TEXT("r+b"));
-    if (!s->file) {
-        SysMessage(TEXT("usb-msd: Could not open image file '%s'\n"), var.c_str());
         goto fail;
     }
+    s->lun = &s->luns[0];
+
+    if (need_worker)
+        s->io.thread = std::thread(usb_msd_io_thread, s);
 
     s->f.hash = 0;
     s->f.last_cmd = -1;
@@ -1025,6 +1977,7 @@ USBDevice *MsdDevice::CreateDevice(int port)
     s->dev.klass.handle_reset   = usb_msd_handle_reset;
     s->dev.klass.handle_control = usb_msd_handle_control;
     s->dev.klass.handle_data    = usb_msd_handle_data;
+    s->dev.klass.handle_frame   = usb_msd_handle_frame;
     s->dev.klass.unrealize      = usb_msd_handle_destroy;
     s->dev.klass.usb_desc       = &s->desc;
     s->dev.klass.product_desc   = desc_strings[STR_PRODUCT];
@@ -1055,9 +2008,23 @@ int MsdDevice::Freeze(int mode, USBDevice *dev, void *data)
     {
         case FREEZE_LOAD:
             //if (s->f.req) free (s->f.req);
+            usb_msd_io_drain(s);
 
             tmp = (MSDState::freeze *)data;
+            /* writes since then are part of the image too */
+            usb_msd_sync(s);
+            if (tmp->hash) {
+                uint32_t hash = usb_msd_image_hash(s);
+                if (!hash)
+                    fprintf(stderr, "usb-msd: Image not fully hashed yet, skipping save state image check\n");
+                else if (hash != tmp->hash)
+                    SysMessage(TEXT("usb-msd: Image file has changed since the save state was made, guest may see a corrupted file system.\n"));
+            }
             s->f = *tmp;
+            /* state from a setup with more LUNs */
+            if (s->f.req.lun >= s->nluns)
+                s->f.req.lun = 0;
+            s->lun = &s->luns[s->f.req.lun];
             //ReqState *req = (ReqState *)((char*)data + sizeof(MSDState::freeze));
             //s->f.req = qemu_mallocz (sizeof(ReqState));
             //*s->f.req = *req;
@@ -1068,6 +2035,11 @@ int MsdDevice::Freeze(int mode, USBDevice *dev, void *data)
             return sizeof(MSDState::freeze);// + sizeof(ReqState);
 
         case FREEZE_SAVE:
+            /* Real save states commit pending write-back to the image,
+               rewind snapshots don't, the hash covers it anyway */
+            if (!usb_freeze_delta)
+                usb_msd_sync(s);
+            s->f.hash = usb_msd_image_hash(s);
             tmp = (MSDState::freeze *)data;
             *tmp = s->f;
             return sizeof(MSDState::freeze);
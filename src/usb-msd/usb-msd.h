@@ -5,6 +5,12 @@
 namespace usb_msd {
 
 static const char *APINAME = "cstdio";
+#define N_CONFIG_MMAP TEXT("mmap")
+#define N_CONFIG_CACHE TEXT("cache_kb")
+#define N_CONFIG_READAHEAD TEXT("readahead_kb")
+#define N_CONFIG_WRITEBACK TEXT("writeback_kb")
+#define N_CONFIG_OVERLAY TEXT("overlay")
+#define N_CONFIG_BLOCK_SIZE TEXT("block_size")
 
 class MsdDevice
 {